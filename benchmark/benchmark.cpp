@@ -0,0 +1,881 @@
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <barrier>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <memory>
+#include <memory_resource>
+#include <stdexcept>
+#include <cstdint>
+#include <cmath>
+
+#include "parallel_octree.h"
+#include "perf_counters.h"
+
+// Runs fixed operation mixes over several shape distributions, octree sizes and thread counts
+// and prints one line per measurement to stdout, either as CSV or as JSON lines.
+//
+//   parallel_octree_benchmark [--quick] [--count N] [--size-logs 6,8,10] [--max-threads N]
+//                             [--repeats N] [--arena-mb N] [--format csv|json]
+
+namespace
+{
+	enum class distribution
+	{
+		uniform,
+		clustered,
+		large,
+		point
+	};
+
+	constexpr distribution DISTRIBUTIONS[] = { distribution::uniform, distribution::clustered, distribution::large, distribution::point };
+
+	const char* distribution_name(distribution value)
+	{
+		switch (value)
+		{
+		case distribution::uniform:
+			return "uniform";
+		case distribution::clustered:
+			return "clustered";
+		case distribution::large:
+			return "large";
+		default:
+			return "point";
+		}
+	}
+
+	struct options final
+	{
+		uint32_t Count = 100000;
+		std::vector<uint32_t> SizeLogs{ 6, 8, 10 };
+		uint32_t MaxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		uint32_t Repeats = 3;
+		uint32_t ArenaMegabytes = 1024;
+		bool IsJson = false;
+	};
+
+	struct measurement final
+	{
+		const char* Operation;
+		size_t Count;
+		double Seconds;
+		// p50, p99, p99.9 and max of single calls, only with PARALLEL_OCTREE_LATENCY_HISTOGRAMS
+		uint64_t LatencyNanoseconds[4] = {};
+		// Summed over all threads
+		perf_counters::values Counters;
+
+		measurement(const char* operation, size_t count, double seconds)
+			: Operation (operation)
+			, Count (count)
+			, Seconds (seconds)
+		{
+		}
+	};
+
+	// Threads are started once per configuration, every phase is fenced by a barrier
+	class thread_team final
+	{
+	private:
+		uint32_t _threadsCount;
+		std::barrier<> _barrier;
+		std::function<void(uint32_t)> _job;
+		bool _isStopping;
+		// Counters follow only the thread which opened them, so every thread measures itself
+		perf_counters _mainCounters;
+		std::vector<perf_counters::values> _threadCounters;
+		perf_counters::values _counters;
+		bool _hasCounters;
+		std::vector<std::thread> _threads;
+
+	public:
+		explicit thread_team(uint32_t threadsCount)
+			: _threadsCount (threadsCount)
+			, _barrier (std::ptrdiff_t(threadsCount))
+			, _isStopping (false)
+			, _threadCounters (threadsCount)
+			, _hasCounters (false)
+		{
+			for (uint32_t i = 1; i < threadsCount; ++i)
+			{
+				_threads.emplace_back([this, i]() { run_thread(i); });
+			}
+		}
+
+		~thread_team()
+		{
+			_isStopping = true;
+			_barrier.arrive_and_wait();
+
+			for (std::thread& thread : _threads)
+			{
+				thread.join();
+			}
+		}
+
+		thread_team(const thread_team&) = delete;
+		const thread_team& operator = (const thread_team&) = delete;
+
+		uint32_t threads_count() const
+		{
+			return _threadsCount;
+		}
+
+		// Returns the wall time of the job on all threads
+		double run(std::function<void(uint32_t)> job)
+		{
+			_job = std::move(job);
+
+			// Taken before the barrier, other threads may finish the job before this one wakes up
+			const auto time0 = std::chrono::steady_clock::now();
+			_barrier.arrive_and_wait();
+
+			run_job(0, _mainCounters);
+
+			_barrier.arrive_and_wait();
+			const auto time1 = std::chrono::steady_clock::now();
+
+			perf_counters::values counters = _threadCounters[0];
+			for (uint32_t i = 1; i < _threadsCount; ++i)
+			{
+				counters += _threadCounters[i];
+			}
+
+			if (_hasCounters)
+			{
+				_counters += counters;
+			}
+			else
+			{
+				_counters = counters;
+				_hasCounters = true;
+			}
+
+			return std::chrono::duration<double>(time1 - time0).count();
+		}
+
+		// Counters of the runs since the previous call
+		perf_counters::values take_counters()
+		{
+			_hasCounters = false;
+			return _counters;
+		}
+
+	private:
+		void run_job(uint32_t threadIndex, const perf_counters& counters)
+		{
+			const perf_counters::values counters0 = counters.read();
+			_job(threadIndex);
+			_threadCounters[threadIndex] = counters.read() - counters0;
+		}
+
+		void run_thread(uint32_t threadIndex)
+		{
+			const perf_counters counters;
+
+			for (;;)
+			{
+				_barrier.arrive_and_wait();
+
+				if (_isStopping)
+				{
+					return;
+				}
+
+				run_job(threadIndex, counters);
+				_barrier.arrive_and_wait();
+			}
+		}
+	};
+
+	float random_float(std::minstd_rand0& rand)
+	{
+		return float(rand()) / float(rand.max());
+	}
+
+	parallel_octree::aabb make_box(const parallel_octree::point& centre, float size, float fieldSize)
+	{
+		const float halfSize = size * 0.5f;
+		const auto clamp = [fieldSize, halfSize](float value) { return std::clamp(value, halfSize, fieldSize - halfSize); };
+
+		const float x = clamp(centre.X);
+		const float y = clamp(centre.Y);
+		const float z = clamp(centre.Z);
+
+		return { { x - halfSize, y - halfSize, z - halfSize }, { x + halfSize, y + halfSize, z + halfSize } };
+	}
+
+	parallel_octree::point box_centre(const parallel_octree::aabb& box)
+	{
+		return { (box.Min.X + box.Max.X) * 0.5f, (box.Min.Y + box.Max.Y) * 0.5f, (box.Min.Z + box.Max.Z) * 0.5f };
+	}
+
+	std::vector<parallel_octree::shape_data> generate_shapes(distribution type, uint32_t count, float fieldSize)
+	{
+		std::minstd_rand0 rand(uint32_t(type) + 1);
+		std::normal_distribution<float> normal(0.0f, fieldSize / 64.0f);
+
+		std::vector<parallel_octree::point> clusters(32);
+		for (parallel_octree::point& cluster : clusters)
+		{
+			cluster = { random_float(rand) * fieldSize, random_float(rand) * fieldSize, random_float(rand) * fieldSize };
+		}
+
+		std::vector<parallel_octree::shape_data> shapes;
+		shapes.reserve(count);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			parallel_octree::point centre{ random_float(rand) * fieldSize, random_float(rand) * fieldSize, random_float(rand) * fieldSize };
+			float size = random_float(rand) + 0.1f;
+
+			switch (type)
+			{
+			case distribution::clustered:
+			{
+				const parallel_octree::point& cluster = clusters[rand() % clusters.size()];
+				centre = { cluster.X + normal(rand), cluster.Y + normal(rand), cluster.Z + normal(rand) };
+				break;
+			}
+			case distribution::large:
+				size = 2.0f + random_float(rand) * 4.0f;
+				break;
+			case distribution::point:
+				size = 0.0f;
+				break;
+			default:
+				break;
+			}
+
+			shapes.push_back({ make_box(centre, std::min(size, fieldSize), fieldSize), i });
+		}
+
+		return shapes;
+	}
+
+	// Small displacements like in a simulation step
+	std::vector<parallel_octree::shape_move> generate_moves(const std::vector<parallel_octree::shape_data>& shapes, float fieldSize)
+	{
+		std::minstd_rand0 rand(uint32_t(shapes.size()));
+
+		std::vector<parallel_octree::shape_move> moves;
+		moves.reserve(shapes.size());
+
+		for (const parallel_octree::shape_data& shape : shapes)
+		{
+			const parallel_octree::point centre = box_centre(shape.AABB);
+			const parallel_octree::point newCentre{
+				centre.X + random_float(rand) - 0.5f,
+				centre.Y + random_float(rand) - 0.5f,
+				centre.Z + random_float(rand) - 0.5f
+			};
+
+			moves.push_back({ shape.AABB, make_box(newCentre, shape.AABB.Max.X - shape.AABB.Min.X, fieldSize), shape.Index });
+		}
+
+		return moves;
+	}
+
+	template <typename TFunc>
+	void for_each_part(size_t count, uint32_t threadIndex, uint32_t threadsCount, TFunc&& func)
+	{
+		const size_t begin = count * threadIndex / threadsCount;
+		const size_t end = count * (threadIndex + 1) / threadsCount;
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			func(i);
+		}
+	}
+
+	// Takes percentiles of the calls made since the previous call and starts over
+	void take_latency(parallel_octree& octree, measurement& value)
+	{
+#ifdef PARALLEL_OCTREE_LATENCY_HISTOGRAMS
+		latency_histograms histograms;
+		octree.merge_latency_histograms(histograms);
+		octree.reset_latency_histograms();
+
+		const std::string operation = value.Operation;
+		latency_histogram& histogram = operation == "add"
+			? histograms.Add
+			: (operation == "add_batch" ? histograms.AddBatch
+			: (operation == "remove" ? histograms.Remove : (operation == "gc" ? histograms.CollectGarbage : histograms.Move)));
+
+		if (operation == "mixed")
+		{
+			histogram.merge(histograms.Remove);
+		}
+
+		value.LatencyNanoseconds[0] = histogram.percentile(0.5);
+		value.LatencyNanoseconds[1] = histogram.percentile(0.99);
+		value.LatencyNanoseconds[2] = histogram.percentile(0.999);
+		value.LatencyNanoseconds[3] = histogram.max();
+#else
+		(void)octree;
+		(void)value;
+#endif
+	}
+
+	// add -> move -> mixed (every fourth shape removed, the rest moved back) -> gc -> remove
+	std::vector<measurement> run_synchronized(
+		thread_team& team,
+		uint32_t sizeLog,
+		uint32_t arenaSize,
+		const std::vector<parallel_octree::shape_data>& shapes,
+		const std::vector<parallel_octree::shape_move>& moves)
+	{
+		const uint32_t threadsCount = team.threads_count();
+		parallel_octree octree(sizeLog, arenaSize, threadsCount);
+
+		std::vector<measurement> result;
+
+		result.push_back({ "add", shapes.size(), team.run(
+			[&](uint32_t threadIndex)
+			{
+				for_each_part(shapes.size(), threadIndex, threadsCount, [&](size_t i) { octree.add_synchronized(shapes[i], threadIndex); });
+			}) });
+		take_latency(octree, result.back());
+		result.back().Counters = team.take_counters();
+
+		result.push_back({ "move", moves.size(), team.run(
+			[&](uint32_t threadIndex)
+			{
+				for_each_part(moves.size(), threadIndex, threadsCount, [&](size_t i) { octree.move_synchronized(moves[i], threadIndex); });
+			}) });
+		take_latency(octree, result.back());
+		result.back().Counters = team.take_counters();
+
+		result.push_back({ "mixed", moves.size(), team.run(
+			[&](uint32_t threadIndex)
+			{
+				for_each_part(moves.size(), threadIndex, threadsCount,
+					[&](size_t i)
+					{
+						const parallel_octree::shape_move& shapeMove = moves[i];
+
+						if (i % 4 == 0)
+						{
+							octree.remove_synchronized({ shapeMove.aabbNew, shapeMove.Index }, threadIndex);
+						}
+						else
+						{
+							octree.move_synchronized({ shapeMove.aabbNew, shapeMove.aabbOld, shapeMove.Index }, threadIndex);
+						}
+					});
+			}) });
+		take_latency(octree, result.back());
+		result.back().Counters = team.take_counters();
+
+		std::pmr::vector<parallel_octree::gc_root> roots;
+		std::atomic<size_t> nextRoot = 0;
+		std::atomic<size_t> visitedCount = 0;
+
+		const double gcSeconds = team.run(
+			[&](uint32_t threadIndex)
+			{
+				if (threadIndex == 0)
+				{
+					octree.prepare_garbage_collection(roots, 2, 4096);
+				}
+			})
+			+ team.run(
+			[&](uint32_t)
+			{
+				size_t visited = 0;
+
+				for (size_t i = nextRoot++; i < roots.size(); i = nextRoot++)
+				{
+					visited += octree.collect_garbage(roots[i]);
+				}
+
+				visitedCount += visited;
+			});
+
+		result.push_back({ "gc", visitedCount, gcSeconds });
+		take_latency(octree, result.back());
+		result.back().Counters = team.take_counters();
+
+		result.push_back({ "remove", shapes.size(), team.run(
+			[&](uint32_t threadIndex)
+			{
+				for_each_part(shapes.size(), threadIndex, threadsCount,
+					[&](size_t i)
+					{
+						if (i % 4 != 0)
+						{
+							octree.remove_synchronized(shapes[i], threadIndex);
+						}
+					});
+			}) });
+		take_latency(octree, result.back());
+		result.back().Counters = team.take_counters();
+
+		return result;
+	}
+
+	template <typename TFunc>
+	measurement measure(const perf_counters& counters, const char* operation, size_t count, TFunc&& func)
+	{
+		const perf_counters::values counters0 = counters.read();
+		const auto time0 = std::chrono::steady_clock::now();
+		func();
+		const auto time1 = std::chrono::steady_clock::now();
+
+		measurement result{ operation, count, std::chrono::duration<double>(time1 - time0).count() };
+		result.Counters = counters.read() - counters0;
+		return result;
+	}
+
+	std::vector<measurement> run_exclusive(
+		uint32_t sizeLog,
+		uint32_t arenaSize,
+		const std::vector<parallel_octree::shape_data>& shapes,
+		const std::vector<parallel_octree::shape_move>& moves)
+	{
+		parallel_octree octree(sizeLog, arenaSize, 1);
+
+		std::vector<measurement> result;
+
+		const perf_counters counters;
+
+		result.push_back(measure(counters, "add", shapes.size(),
+			[&]()
+			{
+				for (const parallel_octree::shape_data& shape : shapes)
+				{
+					octree.add_exclusive(shape);
+				}
+			}));
+
+		{
+			// Into a second octree of its own, the one above keeps the shapes for the passes below
+			parallel_octree batchOctree(sizeLog, arenaSize, 1);
+
+			result.push_back(measure(counters, "add_batch", shapes.size(),
+				[&]()
+				{
+					batchOctree.add_batch_exclusive(shapes);
+				}));
+			take_latency(batchOctree, result.back());
+		}
+
+		// The new boxes of the moves serve as query boxes, they are spread like the shapes
+		std::vector<parallel_octree::aabb> queries;
+		queries.reserve(moves.size());
+
+		for (const parallel_octree::shape_move& shapeMove : moves)
+		{
+			queries.push_back(shapeMove.aabbNew);
+		}
+
+		result.push_back(measure(counters, "query", queries.size(),
+			[&]()
+			{
+				std::pmr::vector<uint32_t> candidates;
+
+				for (const parallel_octree::aabb& query : queries)
+				{
+					octree.query(query, candidates);
+				}
+			}));
+
+		// Queries issued every tick reuse the result, so the first call which allocates it is not timed
+		parallel_octree::batch_result batchResult;
+		octree.query_batch(queries, batchResult);
+
+		result.push_back(measure(counters, "query_batch", queries.size(),
+			[&]()
+			{
+				octree.query_batch(queries, batchResult);
+			}));
+
+		result.push_back(measure(counters, "move", moves.size(),
+			[&]()
+			{
+				for (const parallel_octree::shape_move& shapeMove : moves)
+				{
+					octree.move_exclusive(shapeMove);
+				}
+			}));
+
+		result.push_back(measure(counters, "mixed", moves.size(),
+			[&]()
+			{
+				for (size_t i = 0; i < moves.size(); ++i)
+				{
+					const parallel_octree::shape_move& shapeMove = moves[i];
+
+					if (i % 4 == 0)
+					{
+						octree.remove_exclusive({ shapeMove.aabbNew, shapeMove.Index });
+					}
+					else
+					{
+						octree.move_exclusive({ shapeMove.aabbNew, shapeMove.aabbOld, shapeMove.Index });
+					}
+				}
+			}));
+
+		size_t visitedCount = 0;
+
+		result.push_back(measure(counters, "gc", 0,
+			[&]()
+			{
+				std::pmr::vector<parallel_octree::gc_root> roots;
+				octree.prepare_garbage_collection(roots);
+
+				for (const parallel_octree::gc_root& root : roots)
+				{
+					visitedCount += octree.collect_garbage(root);
+				}
+			}));
+
+		result.back().Count = visitedCount;
+
+		result.push_back(measure(counters, "remove", shapes.size(),
+			[&]()
+			{
+				for (size_t i = 0; i < shapes.size(); ++i)
+				{
+					if (i % 4 != 0)
+					{
+						octree.remove_exclusive(shapes[i]);
+					}
+				}
+			}));
+
+		return result;
+	}
+
+	// Adds, moves and removes the shapes of the point distribution through the point functions
+	std::vector<measurement> run_points_exclusive(
+		uint32_t sizeLog,
+		uint32_t arenaSize,
+		const std::vector<parallel_octree::shape_data>& shapes,
+		const std::vector<parallel_octree::shape_move>& moves)
+	{
+		parallel_octree octree(sizeLog, arenaSize, 1);
+
+		std::vector<parallel_octree::point_data> points;
+		points.reserve(shapes.size());
+
+		for (const parallel_octree::shape_data& shape : shapes)
+		{
+			points.push_back({ shape.AABB.Min, shape.Index });
+		}
+
+		std::vector<parallel_octree::point_move> pointMoves;
+		pointMoves.reserve(moves.size());
+
+		for (const parallel_octree::shape_move& shapeMove : moves)
+		{
+			pointMoves.push_back({ shapeMove.aabbOld.Min, shapeMove.aabbNew.Min, shapeMove.Index });
+		}
+
+		std::vector<measurement> result;
+
+		const perf_counters counters;
+
+		result.push_back(measure(counters, "add", points.size(),
+			[&]()
+			{
+				for (const parallel_octree::point_data& pointData : points)
+				{
+					octree.add_point_exclusive(pointData);
+				}
+			}));
+
+		result.push_back(measure(counters, "move", pointMoves.size(),
+			[&]()
+			{
+				for (const parallel_octree::point_move& pointMove : pointMoves)
+				{
+					octree.move_point_exclusive(pointMove);
+				}
+			}));
+
+		result.push_back(measure(counters, "remove", points.size(),
+			[&]()
+			{
+				for (const parallel_octree::point_move& pointMove : pointMoves)
+				{
+					octree.remove_point_exclusive({ pointMove.pointNew, pointMove.Index });
+				}
+			}));
+
+		return result;
+	}
+
+	void print_header(const options& settings)
+	{
+		if (!settings.IsJson)
+		{
+			std::cout << "distribution,size_log,mode,threads,operation,count,seconds,mops,p50_ns,p99_ns,p999_ns,max_ns";
+
+			for (uint32_t i = 0; i < perf_counters::count; ++i)
+			{
+				std::cout << ',' << perf_counters::name(perf_counters::counter(i));
+			}
+
+			std::cout << std::endl;
+		}
+	}
+
+	void print(const options& settings, distribution type, uint32_t sizeLog, const char* mode, uint32_t threadsCount, const measurement& value)
+	{
+		const double mops = value.Seconds > 0.0 ? double(value.Count) / value.Seconds * 1e-6 : 0.0;
+
+		if (settings.IsJson)
+		{
+			std::cout
+				<< "{\"distribution\":\"" << distribution_name(type)
+				<< "\",\"size_log\":" << sizeLog
+				<< ",\"mode\":\"" << mode
+				<< "\",\"threads\":" << threadsCount
+				<< ",\"operation\":\"" << value.Operation
+				<< "\",\"count\":" << value.Count
+				<< ",\"seconds\":" << value.Seconds
+				<< ",\"mops\":" << mops
+				<< ",\"p50_ns\":" << value.LatencyNanoseconds[0]
+				<< ",\"p99_ns\":" << value.LatencyNanoseconds[1]
+				<< ",\"p999_ns\":" << value.LatencyNanoseconds[2]
+				<< ",\"max_ns\":" << value.LatencyNanoseconds[3];
+
+			// Counters which are not available are null
+			for (uint32_t i = 0; i < perf_counters::count; ++i)
+			{
+				std::cout << ",\"" << perf_counters::name(perf_counters::counter(i)) << "\":";
+
+				if (value.Counters.IsAvailable[i])
+				{
+					std::cout << value.Counters.Values[i];
+				}
+				else
+				{
+					std::cout << "null";
+				}
+			}
+
+			std::cout << "}" << std::endl;
+		}
+		else
+		{
+			std::cout
+				<< distribution_name(type) << ','
+				<< sizeLog << ','
+				<< mode << ','
+				<< threadsCount << ','
+				<< value.Operation << ','
+				<< value.Count << ','
+				<< value.Seconds << ','
+				<< mops << ','
+				<< value.LatencyNanoseconds[0] << ','
+				<< value.LatencyNanoseconds[1] << ','
+				<< value.LatencyNanoseconds[2] << ','
+				<< value.LatencyNanoseconds[3];
+
+			// Counters which are not available are left empty
+			for (uint32_t i = 0; i < perf_counters::count; ++i)
+			{
+				std::cout << ',';
+
+				if (value.Counters.IsAvailable[i])
+				{
+					std::cout << value.Counters.Values[i];
+				}
+			}
+
+			std::cout << std::endl;
+		}
+	}
+
+	// Keeps the best time of every operation over the repeats
+	void keep_best(std::vector<measurement>& best, const std::vector<measurement>& current)
+	{
+		if (best.empty())
+		{
+			best = current;
+			return;
+		}
+
+		for (size_t i = 0; i < best.size(); ++i)
+		{
+			if (current[i].Seconds < best[i].Seconds)
+			{
+				best[i] = current[i];
+			}
+		}
+	}
+
+	std::vector<uint32_t> threads_sweep(uint32_t maxThreads)
+	{
+		std::vector<uint32_t> result;
+
+		for (uint32_t threadsCount = 1; threadsCount < maxThreads; threadsCount *= 2)
+		{
+			result.push_back(threadsCount);
+		}
+
+		result.push_back(maxThreads);
+		return result;
+	}
+
+	std::vector<uint32_t> parse_list(const std::string& text)
+	{
+		std::vector<uint32_t> result;
+		size_t begin = 0;
+
+		while (begin < text.size())
+		{
+			const size_t end = std::min(text.find(',', begin), text.size());
+			result.push_back(uint32_t(std::stoul(text.substr(begin, end - begin))));
+			begin = end + 1;
+		}
+
+		return result;
+	}
+
+	options parse_options(int argc, char* argv[])
+	{
+		options result;
+
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string argument = argv[i];
+			const auto value = [&]() -> std::string
+			{
+				if (i + 1 >= argc)
+				{
+					throw std::invalid_argument("missing value of " + argument);
+				}
+				return argv[++i];
+			};
+
+			if (argument == "--quick")
+			{
+				result.Count = 10000;
+				result.SizeLogs = { 6 };
+				result.Repeats = 1;
+				result.ArenaMegabytes = 256;
+			}
+			else if (argument == "--count")
+			{
+				result.Count = uint32_t(std::stoul(value()));
+			}
+			else if (argument == "--size-logs")
+			{
+				result.SizeLogs = parse_list(value());
+			}
+			else if (argument == "--max-threads")
+			{
+				result.MaxThreads = std::max(uint32_t(std::stoul(value())), 1u);
+			}
+			else if (argument == "--repeats")
+			{
+				result.Repeats = std::max(uint32_t(std::stoul(value())), 1u);
+			}
+			else if (argument == "--arena-mb")
+			{
+				result.ArenaMegabytes = uint32_t(std::stoul(value()));
+			}
+			else if (argument == "--format")
+			{
+				const std::string format = value();
+				if (format != "csv" && format != "json")
+				{
+					throw std::invalid_argument("unknown format " + format);
+				}
+				result.IsJson = format == "json";
+			}
+			else
+			{
+				throw std::invalid_argument("unknown argument " + argument);
+			}
+		}
+
+		if (result.ArenaMegabytes == 0 || result.ArenaMegabytes >= 4096)
+		{
+			throw std::invalid_argument("--arena-mb must be in [1, 4095]");
+		}
+
+		return result;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		const options settings = parse_options(argc, argv);
+		const uint32_t arenaSize = settings.ArenaMegabytes * 1024u * 1024u;
+
+		print_header(settings);
+
+		for (const distribution type : DISTRIBUTIONS)
+		{
+			// Large shapes touch dozens of leaves each
+			const uint32_t count = type == distribution::large ? std::max(settings.Count / 8, 1u) : settings.Count;
+
+			for (const uint32_t sizeLog : settings.SizeLogs)
+			{
+				const float fieldSize = float(1u << sizeLog);
+				const std::vector<parallel_octree::shape_data> shapes = generate_shapes(type, count, fieldSize);
+				const std::vector<parallel_octree::shape_move> moves = generate_moves(shapes, fieldSize);
+
+				std::vector<measurement> best;
+				for (uint32_t repeat = 0; repeat < settings.Repeats; ++repeat)
+				{
+					keep_best(best, run_exclusive(sizeLog, arenaSize, shapes, moves));
+				}
+
+				for (const measurement& value : best)
+				{
+					print(settings, type, sizeLog, "exclusive", 1, value);
+				}
+
+				if (type == distribution::point)
+				{
+					best.clear();
+					for (uint32_t repeat = 0; repeat < settings.Repeats; ++repeat)
+					{
+						keep_best(best, run_points_exclusive(sizeLog, arenaSize, shapes, moves));
+					}
+
+					for (const measurement& value : best)
+					{
+						print(settings, type, sizeLog, "exclusive_points", 1, value);
+					}
+				}
+
+				for (const uint32_t threadsCount : threads_sweep(settings.MaxThreads))
+				{
+					thread_team team(threadsCount);
+
+					best.clear();
+					for (uint32_t repeat = 0; repeat < settings.Repeats; ++repeat)
+					{
+						keep_best(best, run_synchronized(team, sizeLog, arenaSize, shapes, moves));
+					}
+
+					for (const measurement& value : best)
+					{
+						print(settings, type, sizeLog, "synchronized", threadsCount, value);
+					}
+				}
+			}
+		}
+	}
+	catch (const std::exception& excp)
+	{
+		std::cerr << "Exception: " << excp.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include "perf_counters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+perf_counters::values& perf_counters::values::operator += (const values& other)
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		Values[i] += other.Values[i];
+		IsAvailable[i] = IsAvailable[i] && other.IsAvailable[i];
+	}
+
+	return *this;
+}
+
+perf_counters::values perf_counters::values::operator - (const values& other) const
+{
+	values result;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		result.Values[i] = Values[i] - other.Values[i];
+		result.IsAvailable[i] = IsAvailable[i] && other.IsAvailable[i];
+	}
+
+	return result;
+}
+
+const char* perf_counters::name(counter index)
+{
+	static const char* const NAMES[count] = { "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "branch_misses" };
+	return NAMES[index];
+}
+
+#ifdef __linux__
+
+static int open_counter(uint32_t type, uint64_t config)
+{
+	perf_event_attr attributes;
+	std::memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = type;
+	attributes.config = config;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return int(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+}
+
+static constexpr uint64_t cache_config(uint64_t cache, uint64_t operation, uint64_t result)
+{
+	return cache | (operation << 8) | (result << 16);
+}
+
+perf_counters::perf_counters()
+{
+	_files[cycles] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	_files[instructions] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	_files[l1d_misses] = open_counter(PERF_TYPE_HW_CACHE, cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+	_files[llc_misses] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	_files[dtlb_misses] = open_counter(PERF_TYPE_HW_CACHE, cache_config(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+	_files[branch_misses] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+}
+
+perf_counters::~perf_counters()
+{
+	for (const int file : _files)
+	{
+		if (file >= 0)
+		{
+			close(file);
+		}
+	}
+}
+
+perf_counters::values perf_counters::read() const
+{
+	values result;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		// Value, time enabled, time running
+		uint64_t data[3];
+
+		if (_files[i] < 0 || ::read(_files[i], data, sizeof(data)) != ssize_t(sizeof(data)))
+		{
+			continue;
+		}
+
+		result.IsAvailable[i] = true;
+		result.Values[i] = data[2] > 0 && data[2] < data[1]
+			? uint64_t(double(data[0]) * double(data[1]) / double(data[2]))
+			: data[0];
+	}
+
+	return result;
+}
+
+#else
+
+perf_counters::perf_counters()
+{
+	for (int& file : _files)
+	{
+		file = -1;
+	}
+}
+
+perf_counters::~perf_counters()
+{
+}
+
+perf_counters::values perf_counters::read() const
+{
+	return values();
+}
+
+#endif
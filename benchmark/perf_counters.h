@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Hardware counters of the calling thread read through perf_event_open. Counters the kernel or the CPU
+// does not provide stay unavailable, which is always the case outside Linux.
+class perf_counters final
+{
+public:
+	enum counter : uint32_t
+	{
+		cycles,
+		instructions,
+		l1d_misses,
+		llc_misses,
+		dtlb_misses,
+		branch_misses,
+		count
+	};
+
+	struct values final
+	{
+		uint64_t Values[count] = {};
+		bool IsAvailable[count] = {};
+
+		values& operator += (const values& other);
+		values operator - (const values& other) const;
+	};
+
+private:
+	int _files[count];
+
+public:
+	// Opens the counters for the calling thread, they do not follow it to other threads
+	perf_counters();
+	~perf_counters();
+
+	perf_counters(const perf_counters&) = delete;
+	const perf_counters& operator = (const perf_counters&) = delete;
+
+	// Values since the construction, scaled up when the kernel had to multiplex the counters
+	values read() const;
+
+	static const char* name(counter index);
+};
@@ -9,30 +9,74 @@
 #include <exception>
 #include <memory>
 #include <cassert>
+#include <algorithm>
 
 template <size_t ChinkSize = CACHE_LINE_SIZE>
 class alignas(CACHE_LINE_SIZE) chunk_allocator final
 {
-	static_assert(sizeof(size_t) == sizeof(std::atomic<size_t>));
+	static_assert(std::atomic_ref<size_t>::is_always_lock_free);
+	static_assert(std::atomic_ref<size_t>::required_alignment <= alignof(size_t));
 
 private:
-	const size_t _size;
-	const std::unique_ptr<uint8_t[], aligned_delete<CACHE_LINE_SIZE>> _data;
+	size_t _size;
+	std::unique_ptr<uint8_t[], aligned_delete<CACHE_LINE_SIZE>> _ownedData;
+	uint8_t* _data;
 
 	alignas(CACHE_LINE_SIZE) size_t _offset;
 
 public:
 	explicit chunk_allocator(size_t size)
 		: _size((size + ChinkSize - 1) / ChinkSize * ChinkSize)
-		, _data(static_cast<uint8_t*>(operator new (_size, std::align_val_t(CACHE_LINE_SIZE))))
+		, _ownedData(static_cast<uint8_t*>(operator new (_size, std::align_val_t(CACHE_LINE_SIZE))))
+		, _data(_ownedData.get())
 		, _offset(0)
 	{
-		assert(std::atomic<size_t>().is_lock_free());
+	}
+
+	// First usedSize bytes are reserved for the caller to fill
+	chunk_allocator(size_t size, size_t usedSize)
+		: chunk_allocator(size)
+	{
+		assert(usedSize % ChinkSize == 0 && usedSize <= _size);
+		_offset = usedSize;
+	}
+
+	// Works on top of memory owned by somebody else, first usedSize bytes are already allocated
+	chunk_allocator(uint8_t* data, size_t size, size_t usedSize)
+		: _size(size / ChinkSize * ChinkSize)
+		, _data(data)
+		, _offset(usedSize)
+	{
+		assert(reinterpret_cast<uintptr_t>(data) % CACHE_LINE_SIZE == 0);
+		assert(usedSize <= _size);
 	}
 
 	chunk_allocator(const chunk_allocator&) = delete;
 	const chunk_allocator& operator = (const chunk_allocator&) = delete;
 
+	void swap(chunk_allocator& other) noexcept
+	{
+		std::swap(_size, other._size);
+		std::swap(_ownedData, other._ownedData);
+		std::swap(_data, other._data);
+		std::swap(_offset, other._offset);
+	}
+
+	uint8_t* data() const
+	{
+		return _data;
+	}
+
+	size_t capacity() const
+	{
+		return _size;
+	}
+
+	size_t used_size() const
+	{
+		return std::min(std::atomic_ref<size_t>(const_cast<size_t&>(_offset)).load(std::memory_order_relaxed), _size);
+	}
+
 	template <typename T, bool Synchronized, typename ... TArgs>
 	T* allocate(TArgs... args)
 	{
@@ -51,7 +95,8 @@ public:
 
 		if constexpr (Synchronized)
 		{
-			prevOffset = reinterpret_cast<std::atomic<size_t>&>(_offset).fetch_add(size);
+			// Only reserves the range, the memory is published by the pointers to it
+			prevOffset = std::atomic_ref<size_t>(_offset).fetch_add(size, std::memory_order_relaxed);
 			currentOffset = prevOffset + size;
 		}
 		else
@@ -66,6 +111,6 @@ public:
 			throw std::bad_alloc();
 		}
 
-		return _data.get() + prevOffset;
+		return _data + prevOffset;
 	}
 };
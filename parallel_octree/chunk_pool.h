@@ -53,7 +53,7 @@ public:
 
 	template <bool PoolSynchronized>
 	chunk_pool(chunk_pool<PoolSynchronized, ChinkSize>&& pool)
-		: _first (pool.take<true>())
+		: _first (pool.template take<true>())
 	{
 	}
 
@@ -124,7 +124,7 @@ public:
 	template <bool DoSynchronize, bool PoolSynchronized>
 	void merge(chunk_pool<PoolSynchronized, ChinkSize>& pool)
 	{
-		header* poolHeader = reinterpret_cast<header*>(pool.take<DoSynchronize>());
+		header* poolHeader = reinterpret_cast<header*>(pool.template take<DoSynchronize>());
 
 		if (!poolHeader)
 		{
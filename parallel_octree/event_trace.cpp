@@ -0,0 +1,88 @@
+#include "event_trace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+std::atomic<uint64_t> event_trace::_lastId{ 0 };
+thread_local std::vector<event_trace::thread_ring> event_trace::_threadRings;
+
+event_trace::event_trace(uint32_t capacityLog)
+	: _id (++_lastId)
+	, _capacityLog (capacityLog)
+	, _start (std::chrono::steady_clock::now())
+{
+}
+
+event_trace::~event_trace()
+{
+	// Entries of other threads are left behind, ids are never reused so they cannot match again
+	std::erase_if(_threadRings, [this](const thread_ring& threadRing) { return threadRing.TraceId == _id; });
+}
+
+event_trace::ring& event_trace::register_thread_ring()
+{
+	std::unique_ptr<ring> newRing = std::make_unique<ring>();
+	newRing->Events.reset(new event[size_t(1) << _capacityLog]);
+	newRing->Head.store(0, std::memory_order_relaxed);
+
+	ring& result = *newRing;
+
+	{
+		const std::lock_guard<std::mutex> guard(_ringsMutex);
+		result.ThreadIndex = uint32_t(_rings.size());
+		_rings.push_back(std::move(newRing));
+	}
+
+	_threadRings.push_back({ _id, &result });
+	return result;
+}
+
+void event_trace::write_chrome_json(std::ostream& stream) const
+{
+	const std::lock_guard<std::mutex> guard(_ringsMutex);
+
+	stream << "{\"traceEvents\":[";
+
+	bool isFirst = true;
+
+	for (const std::unique_ptr<ring>& currentRing : _rings)
+	{
+		const uint64_t head = currentRing->Head.load(std::memory_order_acquire);
+		const uint64_t capacity = uint64_t(1) << _capacityLog;
+
+		for (uint64_t i = head > capacity ? head - capacity : 0; i < head; ++i)
+		{
+			const event& currentEvent = currentRing->Events[i & (capacity - 1)];
+
+			stream << (isFirst ? "\n" : ",\n");
+			stream << "{\"name\":\"" << currentEvent.Name
+				<< "\",\"ph\":\"" << (currentEvent.IsBegin ? 'B' : 'E')
+				<< "\",\"ts\":" << currentEvent.Timestamp / 1000 << '.' << char('0' + currentEvent.Timestamp / 100 % 10)
+				<< char('0' + currentEvent.Timestamp / 10 % 10) << char('0' + currentEvent.Timestamp % 10)
+				<< ",\"pid\":0,\"tid\":" << currentRing->ThreadIndex << '}';
+
+			isFirst = false;
+		}
+	}
+
+	stream << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+void event_trace::write_chrome_json(const std::filesystem::path& path) const
+{
+	std::ofstream stream(path);
+
+	if (!stream)
+	{
+		throw std::runtime_error("event_trace: cannot open " + path.string());
+	}
+
+	write_chrome_json(stream);
+	stream.flush();
+
+	if (!stream)
+	{
+		throw std::runtime_error("event_trace: cannot write " + path.string());
+	}
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <ostream>
+#include <filesystem>
+
+#include "cache_line.h"
+
+// Begin and end events of the calling threads in fixed-size rings, one ring per thread. Recording is lock-free,
+// a full ring overwrites its oldest events. The rings are written as Chrome trace-event JSON (chrome://tracing, Perfetto).
+class event_trace final
+{
+public:
+	// Ends the event it began when destroyed, does nothing without a trace
+	class scope final
+	{
+	private:
+		event_trace* const _trace;
+		const char* const _name;
+
+	public:
+		scope(event_trace* trace, const char* name)
+			: _trace (trace)
+			, _name (name)
+		{
+			if (_trace)
+				[[unlikely]]
+			{
+				_trace->begin(_name);
+			}
+		}
+
+		~scope()
+		{
+			if (_trace)
+				[[unlikely]]
+			{
+				_trace->end(_name);
+			}
+		}
+
+		scope(const scope&) = delete;
+		const scope& operator = (const scope&) = delete;
+	};
+
+private:
+	struct event final
+	{
+		// Names must outlive the trace, string literals are expected
+		const char* Name;
+		uint64_t Timestamp;
+		bool IsBegin;
+	};
+
+	// Written by its thread only
+	struct alignas(CACHE_LINE_SIZE) ring final
+	{
+		std::unique_ptr<event[]> Events;
+		std::atomic<uint64_t> Head;
+		uint32_t ThreadIndex;
+	};
+
+	struct thread_ring final
+	{
+		uint64_t TraceId;
+		ring* Ring;
+	};
+
+private:
+	const uint64_t _id;
+	const uint32_t _capacityLog;
+	const std::chrono::steady_clock::time_point _start;
+
+	mutable std::mutex _ringsMutex;
+	std::vector<std::unique_ptr<ring>> _rings;
+
+	static std::atomic<uint64_t> _lastId;
+	static thread_local std::vector<thread_ring> _threadRings;
+
+public:
+	// Every thread keeps its last 2^capacityLog events
+	explicit event_trace(uint32_t capacityLog = 16);
+	~event_trace();
+
+	event_trace(const event_trace&) = delete;
+	const event_trace& operator = (const event_trace&) = delete;
+
+	void begin(const char* name)
+	{
+		record(name, true);
+	}
+
+	void end(const char* name)
+	{
+		record(name, false);
+	}
+
+	// Events recorded concurrently with the writing may be torn, call it when the traced threads are idle
+	void write_chrome_json(std::ostream& stream) const;
+	void write_chrome_json(const std::filesystem::path& path) const;
+
+private:
+	void record(const char* name, bool isBegin)
+	{
+		ring& currentRing = get_thread_ring();
+		const uint64_t head = currentRing.Head.load(std::memory_order_relaxed);
+
+		event& currentEvent = currentRing.Events[head & ((uint64_t(1) << _capacityLog) - 1)];
+		currentEvent.Name = name;
+		currentEvent.Timestamp = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count());
+		currentEvent.IsBegin = isBegin;
+
+		currentRing.Head.store(head + 1, std::memory_order_release);
+	}
+
+	ring& get_thread_ring()
+	{
+		for (const thread_ring& threadRing : _threadRings)
+		{
+			if (threadRing.TraceId == _id)
+				[[likely]]
+			{
+				return *threadRing.Ring;
+			}
+		}
+
+		return register_thread_ring();
+	}
+
+	ring& register_thread_ring();
+};
@@ -0,0 +1,132 @@
+#include "gc_scheduler.h"
+
+#include <algorithm>
+#include <limits>
+#include <cassert>
+
+gc_scheduler::gc_scheduler(parallel_octree& octree)
+	: gc_scheduler (octree, settings())
+{
+}
+
+gc_scheduler::gc_scheduler(parallel_octree& octree, const settings& settings)
+	: _octree (octree)
+	, _settings (settings)
+	, _nextRoot (0)
+	, _isCollecting (false)
+{
+	assert(_octree.size_log() > 0);
+	assert(_settings.PressureLow < _settings.PressureHigh);
+}
+
+bool gc_scheduler::run_slice()
+{
+	const float currentPressure = pressure();
+
+	if (!_isCollecting)
+	{
+		if (!should_start(currentPressure))
+			[[likely]]
+		{
+			return false;
+		}
+
+		start();
+	}
+	else
+	{
+		_octree.resume_garbage_collection();
+	}
+
+	if (currentPressure >= 1.0f)
+		[[unlikely]]
+	{
+		collect(std::numeric_limits<size_t>::max(), std::chrono::microseconds::max());
+	}
+	else
+	{
+		// Up to 4 times the budget just before the arena gets critical
+		const float scale = 1.0f + 3.0f * currentPressure;
+		collect(
+			size_t(float(_settings.NodesBudget) * scale),
+			std::chrono::microseconds(int64_t(float(_settings.TimeBudget.count()) * scale))
+			);
+	}
+
+	return _isCollecting;
+}
+
+void gc_scheduler::finish()
+{
+	if (!_isCollecting)
+	{
+		return;
+	}
+
+	_octree.resume_garbage_collection();
+	collect(std::numeric_limits<size_t>::max(), std::chrono::microseconds::max());
+}
+
+bool gc_scheduler::is_collecting() const
+{
+	return _isCollecting;
+}
+
+float gc_scheduler::pressure() const
+{
+	// The high-water mark never falls, the pressure has to drop once the GC freed enough
+	const float usage = _octree.live_memory_usage();
+	return std::clamp((usage - _settings.PressureLow) / (_settings.PressureHigh - _settings.PressureLow), 0.0f, 1.0f);
+}
+
+bool gc_scheduler::should_start(float pressure) const
+{
+	// Tombstones of subtrees already collected in a split cycle leave nothing marked
+	if (_octree.pending_gc_work() == 0)
+	{
+		return false;
+	}
+
+	const size_t tombstonesCount = _octree.tombstones_count();
+
+	const size_t threshold = size_t(double(_settings.TombstonesThreshold) * (1.0 - pressure));
+	return tombstonesCount >= threshold;
+}
+
+void gc_scheduler::start()
+{
+	const uint32_t depth = std::min(_settings.RootsDepth, _octree.size_log() - 1);
+	_octree.prepare_garbage_collection(_roots, depth);
+	_nextRoot = 0;
+	_isCollecting = !_roots.empty();
+}
+
+void gc_scheduler::collect(size_t nodesBudget, std::chrono::microseconds timeBudget)
+{
+	const bool isTimeLimited = timeBudget != std::chrono::microseconds::max();
+	const auto deadline = isTimeLimited ? std::chrono::steady_clock::now() + timeBudget : std::chrono::steady_clock::time_point::max();
+
+	size_t visitedCount = 0;
+
+	while (_nextRoot < _roots.size())
+	{
+		visitedCount += _octree.collect_garbage(_roots[_nextRoot++]);
+
+		if (visitedCount >= nodesBudget)
+		{
+			break;
+		}
+
+		if (isTimeLimited && std::chrono::steady_clock::now() >= deadline)
+		{
+			break;
+		}
+	}
+
+	if (_nextRoot == _roots.size())
+	{
+		_roots.clear();
+		_nextRoot = 0;
+		_isCollecting = false;
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <memory_resource>
+
+#include "parallel_octree.h"
+
+// Runs the garbage collection of an octree in slices limited by a budget, one slice per frame.
+// A cycle starts when enough tombstones were left by remove operations under nodes marked for the GC; the threshold
+// goes down and the budget goes up as live nodes fill the arena, so the collection never falls behind the allocations.
+class gc_scheduler final
+{
+public:
+	struct settings final
+	{
+		size_t TombstonesThreshold = 64 * 1024;
+
+		// Live part of the arena where the scheduler starts to speed up and where it stops to limit slices
+		float PressureLow = 0.5f;
+		float PressureHigh = 0.9f;
+
+		uint32_t NodesBudget = 16 * 1024;
+		std::chrono::microseconds TimeBudget{ 500 };
+
+		// Deeper roots give smaller and more numerous steps
+		uint32_t RootsDepth = 3;
+	};
+
+private:
+	parallel_octree& _octree;
+	settings _settings;
+
+	std::pmr::vector<parallel_octree::gc_root> _roots;
+	size_t _nextRoot;
+	bool _isCollecting;
+
+public:
+	explicit gc_scheduler(parallel_octree& octree);
+	gc_scheduler(parallel_octree& octree, const settings& settings);
+
+	gc_scheduler(const gc_scheduler&) = delete;
+	const gc_scheduler& operator = (const gc_scheduler&) = delete;
+
+	// Must not run concurrently with any other operation on the octree.
+	// Returns true if the cycle is not finished yet.
+	bool run_slice();
+
+	// Finishes the current cycle ignoring the budget
+	void finish();
+
+	bool is_collecting() const;
+
+private:
+	float pressure() const;
+	bool should_start(float pressure) const;
+	void start();
+	void collect(size_t nodesBudget, std::chrono::microseconds timeBudget);
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <bit>
+#include <algorithm>
+
+// Log-linear histogram of call durations in nanoseconds: every power of two is split into SUB_BUCKETS
+// equal buckets, so the relative error stays below 1 / SUB_BUCKETS over the whole range.
+class latency_histogram final
+{
+public:
+	static constexpr uint32_t SUB_BUCKETS_LOG = 5;
+	static constexpr uint32_t SUB_BUCKETS = 1u << SUB_BUCKETS_LOG;
+	// Longer durations fall into the last bucket
+	static constexpr uint32_t MAX_LOG = 40;
+	// Values below SUB_BUCKETS are exact, then one group per power of two up to MAX_LOG
+	static constexpr uint32_t BUCKETS_COUNT = (MAX_LOG - SUB_BUCKETS_LOG + 2) * SUB_BUCKETS;
+
+private:
+	std::atomic<uint64_t> _buckets[BUCKETS_COUNT];
+	std::atomic<uint64_t> _max;
+
+public:
+	latency_histogram()
+		: _max (0)
+	{
+		reset();
+	}
+
+	latency_histogram(const latency_histogram&) = delete;
+	const latency_histogram& operator = (const latency_histogram&) = delete;
+
+	// Without synchronization only one thread may record at a time, reading is allowed from any thread
+	template <bool Synchronized>
+	void record(uint64_t nanoseconds)
+	{
+		std::atomic<uint64_t>& bucket = _buckets[bucket_index(nanoseconds)];
+
+		if constexpr (Synchronized)
+		{
+			bucket.fetch_add(1, std::memory_order_relaxed);
+
+			uint64_t currentMax = _max.load(std::memory_order_relaxed);
+			while (currentMax < nanoseconds && !_max.compare_exchange_weak(currentMax, nanoseconds, std::memory_order_relaxed));
+		}
+		else
+		{
+			bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+			if (_max.load(std::memory_order_relaxed) < nanoseconds)
+			{
+				_max.store(nanoseconds, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Must not run concurrently with recording into this histogram
+	void merge(const latency_histogram& other)
+	{
+		for (uint32_t i = 0; i < BUCKETS_COUNT; ++i)
+		{
+			_buckets[i].store(
+				_buckets[i].load(std::memory_order_relaxed) + other._buckets[i].load(std::memory_order_relaxed),
+				std::memory_order_relaxed
+				);
+		}
+
+		_max.store(std::max(_max.load(std::memory_order_relaxed), other._max.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+	}
+
+	void reset()
+	{
+		for (std::atomic<uint64_t>& bucket : _buckets)
+		{
+			bucket.store(0, std::memory_order_relaxed);
+		}
+
+		_max.store(0, std::memory_order_relaxed);
+	}
+
+	uint64_t count() const
+	{
+		uint64_t result = 0;
+
+		for (const std::atomic<uint64_t>& bucket : _buckets)
+		{
+			result += bucket.load(std::memory_order_relaxed);
+		}
+
+		return result;
+	}
+
+	uint64_t max() const
+	{
+		return _max.load(std::memory_order_relaxed);
+	}
+
+	// Upper bound of the bucket reached by the given fraction of the calls, 0.999 for p99.9
+	uint64_t percentile(double fraction) const
+	{
+		const uint64_t totalCount = count();
+
+		if (totalCount == 0)
+		{
+			return 0;
+		}
+
+		const uint64_t target = std::max(uint64_t(double(totalCount) * fraction + 0.5), uint64_t(1));
+		uint64_t currentCount = 0;
+
+		for (uint32_t i = 0; i < BUCKETS_COUNT; ++i)
+		{
+			currentCount += _buckets[i].load(std::memory_order_relaxed);
+
+			if (currentCount >= target)
+			{
+				return std::min(bucket_upper_bound(i), max());
+			}
+		}
+
+		return max();
+	}
+
+private:
+	static uint32_t bucket_index(uint64_t nanoseconds)
+	{
+		if (nanoseconds < SUB_BUCKETS)
+		{
+			return uint32_t(nanoseconds);
+		}
+
+		const uint32_t log = std::min(uint32_t(std::bit_width(nanoseconds)) - 1, MAX_LOG);
+		const uint32_t shift = log - SUB_BUCKETS_LOG;
+		const uint32_t subBucket = uint32_t(std::min(nanoseconds >> shift, uint64_t(2 * SUB_BUCKETS - 1))) - SUB_BUCKETS;
+
+		return (shift + 1) * SUB_BUCKETS + subBucket;
+	}
+
+	static uint64_t bucket_upper_bound(uint32_t index)
+	{
+		const uint32_t group = index / SUB_BUCKETS;
+		const uint64_t subBucket = index % SUB_BUCKETS;
+
+		if (group == 0)
+		{
+			return subBucket;
+		}
+
+		return ((SUB_BUCKETS + subBucket + 1) << (group - 1)) - 1;
+	}
+};
+
+struct latency_histograms final
+{
+	latency_histogram Add;
+	latency_histogram Remove;
+	latency_histogram Move;
+	// One sample per add_batch call, whatever the size of the batch
+	latency_histogram AddBatch;
+	latency_histogram CollectGarbage;
+
+	void merge(const latency_histograms& other)
+	{
+		Add.merge(other.Add);
+		Remove.merge(other.Remove);
+		Move.merge(other.Move);
+		AddBatch.merge(other.AddBatch);
+		CollectGarbage.merge(other.CollectGarbage);
+	}
+
+	void reset()
+	{
+		Add.reset();
+		Remove.reset();
+		Move.reset();
+		AddBatch.reset();
+		CollectGarbage.reset();
+	}
+};
+
+// Records the lifetime of the object
+template <bool Synchronized>
+class latency_scope final
+{
+private:
+	latency_histogram& _histogram;
+	std::chrono::steady_clock::time_point _start;
+
+public:
+	explicit latency_scope(latency_histogram& histogram)
+		: _histogram (histogram)
+		, _start (std::chrono::steady_clock::now())
+	{
+	}
+
+	~latency_scope()
+	{
+		const std::chrono::nanoseconds duration = std::chrono::steady_clock::now() - _start;
+		_histogram.record<Synchronized>(uint64_t(duration.count()));
+	}
+
+	latency_scope(const latency_scope&) = delete;
+	const latency_scope& operator = (const latency_scope&) = delete;
+};
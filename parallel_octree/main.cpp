@@ -4,9 +4,14 @@
 #include <condition_variable>
 #include <chrono>
 #include <thread>
+#include <memory>
 #include <memory_resource>
+#include <string>
+#include <algorithm>
 
 #include "parallel_octree.h"
+#include "operation_trace.h"
+#include "event_trace.h"
 #include "task_scheduler.h"
 
 static float random_float(std::minstd_rand0& rand)
@@ -41,12 +46,72 @@ struct parallel_task final
 };
 
 constexpr size_t count = 100000;
+constexpr uint32_t gcTargetWork = 4096;
 
-static void parallel_add()
+// A root split by collect_garbage is joined by the task which collects the last of its spawned roots
+struct gc_split final
+{
+	parallel_octree::gc_root Root;
+	std::atomic<size_t> Count;
+	std::shared_ptr<gc_split> Parent;
+};
+
+static void complete_gc_root(parallel_octree& octree, std::shared_ptr<gc_split> split)
+{
+	while (split && --split->Count == 0)
+	{
+		octree.join_garbage_collection(split->Root);
+		split = split->Parent;
+	}
+}
+
+static void schedule_gc_root(task_scheduler& taskScheduler, parallel_task& task, parallel_octree& octree, parallel_octree::gc_root root, std::shared_ptr<gc_split> parent = nullptr)
+{
+	taskScheduler.schedule_task(
+		[&taskScheduler, &task, &octree, root, parent](uint32_t workerIndex)
+		{
+			try
+			{
+				char gcBuffer[1024];
+				std::pmr::monotonic_buffer_resource bufferResource(gcBuffer, sizeof(gcBuffer));
+				std::pmr::vector<parallel_octree::gc_root> spawnedRoots{ std::pmr::polymorphic_allocator<parallel_octree::gc_root>(&bufferResource) };
+
+				octree.collect_garbage(root, gcTargetWork, spawnedRoots);
+
+				if (spawnedRoots.empty())
+				{
+					complete_gc_root(octree, parent);
+				}
+				else
+				{
+					const std::shared_ptr<gc_split> split(new gc_split{ root, spawnedRoots.size(), parent });
+					task.Count += spawnedRoots.size();
+
+					for (const parallel_octree::gc_root& spawnedRoot : spawnedRoots)
+					{
+						schedule_gc_root(taskScheduler, task, octree, spawnedRoot, split);
+					}
+				}
+			}
+			catch (const std::exception& excp)
+			{
+				std::cerr << "Exception: " << excp.what() << std::endl;
+			}
+			if (--task.Count == 0)
+				[[unlikely]]
+			{
+				task.Conditional.notify_one();
+			}
+		}
+	);
+}
+
+static void parallel_add(event_trace* eventTrace = nullptr)
 {
 	task_scheduler taskScheduler(std::thread::hardware_concurrency());
 
 	parallel_octree octree(10, 256 * 1024 * 1024, taskScheduler.threads_count());
+	octree.set_event_trace(eventTrace);
 	std::minstd_rand0 rand;
 
 	std::vector<parallel_octree::shape_data> shapes;
@@ -71,10 +136,12 @@ static void parallel_add()
 		for (size_t i = 0; i < taskCount; ++i)
 		{
 			taskScheduler.schedule_task(
-				[&task, i, &octree, &shapes, chinkSize](uint32_t workerIndex)
+				[&task, i, &octree, &shapes, chinkSize, eventTrace](uint32_t workerIndex)
 				{
 					try
 					{
+						const event_trace::scope traceScope(eventTrace, "add_batch");
+
 						for (size_t j = 0; j < chinkSize; ++j)
 						{
 							const size_t index = i * chinkSize + j;
@@ -112,10 +179,12 @@ static void parallel_add()
 		for (size_t i = 0; i < taskCount; ++i)
 		{
 			taskScheduler.schedule_task(
-				[&task, i, &octree, &shapes, chinkSize](uint32_t workerIndex)
+				[&task, i, &octree, &shapes, chinkSize, eventTrace](uint32_t workerIndex)
 				{
 					try
 					{
+						const event_trace::scope traceScope(eventTrace, "remove_batch");
+
 						for (size_t j = 0; j < chinkSize; ++j)
 						{
 							const size_t index = i * chinkSize + j;
@@ -151,33 +220,16 @@ static void parallel_add()
 	std::pmr::monotonic_buffer_resource bufferResource(gcBuffer, sizeof(gcBuffer));
 	std::pmr::vector<parallel_octree::gc_root> roots{ std::pmr::polymorphic_allocator<parallel_octree::gc_root>(&bufferResource) };
 
-	octree.prepare_garbage_collection(roots);
+	octree.prepare_garbage_collection(roots, 2, gcTargetWork);
 
 	const auto time3 = std::chrono::high_resolution_clock::now();
 
 	{
 		parallel_task task{ roots.size() };
 
-		for (size_t i = 0; i < roots.size(); ++i)
+		for (const parallel_octree::gc_root& root : roots)
 		{
-			taskScheduler.schedule_task(
-				[&task, i, &octree, &roots](uint32_t workerIndex)
-				{
-					try
-					{
-						octree.collect_garbage(roots[i]);
-					}
-					catch (const std::exception& excp)
-					{
-						std::cerr << "Exception: " << excp.what() << std::endl;
-					}
-					if (--task.Count == 0)
-						[[unlikely]]
-					{
-						task.Conditional.notify_one();
-					}
-				}
-			);
+			schedule_gc_root(taskScheduler, task, octree, root);
 		}
 
 		if (task.Count > 0)
@@ -195,10 +247,12 @@ static void parallel_add()
 		for (size_t i = 0; i < taskCount; ++i)
 		{
 			taskScheduler.schedule_task(
-				[&task, i, &octree, &shapes, chinkSize](uint32_t workerIndex)
+				[&task, i, &octree, &shapes, chinkSize, eventTrace](uint32_t workerIndex)
 				{
 					try
 					{
+						const event_trace::scope traceScope(eventTrace, "add_batch");
+
 						for (size_t j = 0; j < chinkSize; ++j)
 						{
 							const size_t index = i * chinkSize + j;
@@ -324,8 +378,54 @@ static void test1()
 	octree.add_exclusive({ { { 1 + 0.4f, 1 + 0.4f, 1 + 0.4f }, { 1 + 0.6f, 1 + 0.6f, 1 + 0.6f } }, 7 });
 }
 
-int main()
+static void replay(const char* path, uint32_t threadsCount)
+{
+	const operation_replay trace(path);
+	const std::unique_ptr<parallel_octree> octree = trace.create_octree(threadsCount);
+
+	const operation_replay::statistics statistics = trace.run(*octree, threadsCount);
+
+	std::cout << "Replay    operations " << statistics.OperationsCount << " threads " << threadsCount << std::endl;
+	std::cout << "Replay    modify " << statistics.ModificationTime.count() * 1000 << " ms." << std::endl;
+	std::cout << "Replay    gc     " << statistics.GCTime.count() * 1000 << " ms." << std::endl;
+}
+
+int main(int argc, char* argv[])
 {
+	// parallel_octree replay <trace> [threads]
+	if (argc >= 3 && std::string(argv[1]) == "replay")
+	{
+		try
+		{
+			replay(argv[2], argc >= 4 ? uint32_t(std::stoul(argv[3])) : std::max(std::thread::hardware_concurrency(), 1u));
+		}
+		catch (const std::exception& excp)
+		{
+			std::cerr << "Exception: " << excp.what() << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// parallel_octree trace <output.json>
+	if (argc >= 3 && std::string(argv[1]) == "trace")
+	{
+		try
+		{
+			event_trace eventTrace;
+			parallel_add(&eventTrace);
+			eventTrace.write_chrome_json(argv[2]);
+		}
+		catch (const std::exception& excp)
+		{
+			std::cerr << "Exception: " << excp.what() << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
 	//test1();
 	exclusive_add();
 	parallel_add();
@@ -0,0 +1,137 @@
+#include "mapped_file.h"
+
+#include <system_error>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#ifdef _WIN32
+
+mapped_file::mapped_file(const std::filesystem::path& path)
+	: _data (nullptr)
+	, _size (0)
+	, _file (INVALID_HANDLE_VALUE)
+	, _mapping (nullptr)
+{
+	_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (_file == INVALID_HANDLE_VALUE)
+	{
+		throw std::system_error(int(GetLastError()), std::system_category(), path.string());
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(_file, &size))
+	{
+		const DWORD error = GetLastError();
+		close();
+		throw std::system_error(int(error), std::system_category(), path.string());
+	}
+	_size = size_t(size.QuadPart);
+
+	if (_size == 0)
+	{
+		return;
+	}
+
+	_mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!_mapping)
+	{
+		const DWORD error = GetLastError();
+		close();
+		throw std::system_error(int(error), std::system_category(), path.string());
+	}
+
+	_data = static_cast<const uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!_data)
+	{
+		const DWORD error = GetLastError();
+		close();
+		throw std::system_error(int(error), std::system_category(), path.string());
+	}
+}
+
+void mapped_file::close() noexcept
+{
+	if (_data)
+	{
+		UnmapViewOfFile(_data);
+		_data = nullptr;
+	}
+	if (_mapping)
+	{
+		CloseHandle(_mapping);
+		_mapping = nullptr;
+	}
+	if (_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(_file);
+		_file = INVALID_HANDLE_VALUE;
+	}
+}
+
+#else
+
+mapped_file::mapped_file(const std::filesystem::path& path)
+	: _data (nullptr)
+	, _size (0)
+	, _file (-1)
+{
+	_file = open(path.c_str(), O_RDONLY);
+	if (_file < 0)
+	{
+		throw std::system_error(errno, std::generic_category(), path.string());
+	}
+
+	struct stat status;
+	if (fstat(_file, &status) != 0)
+	{
+		const int error = errno;
+		close();
+		throw std::system_error(error, std::generic_category(), path.string());
+	}
+	_size = size_t(status.st_size);
+
+	if (_size == 0)
+	{
+		return;
+	}
+
+	void* const data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, _file, 0);
+	if (data == MAP_FAILED)
+	{
+		const int error = errno;
+		close();
+		throw std::system_error(error, std::generic_category(), path.string());
+	}
+	_data = static_cast<const uint8_t*>(data);
+}
+
+void mapped_file::close() noexcept
+{
+	if (_data)
+	{
+		munmap(const_cast<uint8_t*>(_data), _size);
+		_data = nullptr;
+	}
+	if (_file >= 0)
+	{
+		::close(_file);
+		_file = -1;
+	}
+}
+
+#endif
+
+mapped_file::~mapped_file()
+{
+	close();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+// Read-only mapping of a whole file
+class mapped_file final
+{
+private:
+	const uint8_t* _data;
+	size_t _size;
+
+#ifdef _WIN32
+	void* _file;
+	void* _mapping;
+#else
+	int _file;
+#endif
+
+public:
+	explicit mapped_file(const std::filesystem::path& path);
+	~mapped_file();
+
+	mapped_file(const mapped_file&) = delete;
+	const mapped_file& operator = (const mapped_file&) = delete;
+
+	const uint8_t* data() const
+	{
+		return _data;
+	}
+
+	size_t size() const
+	{
+		return _size;
+	}
+
+private:
+	void close() noexcept;
+};
@@ -24,6 +24,8 @@ private:
 	{
 		chunk_pool<false, ChinkSize> Pool;
 		bool PoolsNotEmpty = false;
+		// Chunks handed out by the part minus chunks returned to it, wraps around when other parts free them
+		size_t AllocatedCount = 0;
 	};
 
 private:
@@ -34,6 +36,15 @@ private:
 	std::unique_ptr<local_part_impl[]> _localParts;
 	uint32_t _localPartsCount;
 
+	mutable std::mutex _dynamicPartsMutex;
+	std::vector<std::unique_ptr<local_part_impl>> _dynamicParts;
+	std::vector<local_part_impl*> _freeDynamicParts;
+	std::vector<chunk_pool<false, ChinkSize>> _releasedPools;
+
+	// Chunks in use when the arena was taken and allocated past the parts, and chunks freed by the GC
+	size_t _baseCount;
+	size_t _freedCount;
+
 	alignas(CACHE_LINE_SIZE)
 	size_t _poolOffset;
 
@@ -42,50 +53,167 @@ public:
 		: _chunkAllocator (bufferSize)
 		, _localParts (new local_part_impl[localPartsCount])
 		, _localPartsCount (localPartsCount)
+		, _baseCount (0)
+		, _freedCount (0)
+		, _poolOffset (0)
+	{
+	}
+
+	octree_allocator(size_t bufferSize, size_t usedSize, uint32_t localPartsCount)
+		: _chunkAllocator (bufferSize, usedSize)
+		, _localParts (new local_part_impl[localPartsCount])
+		, _localPartsCount (localPartsCount)
+		, _baseCount (usedSize / ChinkSize)
+		, _freedCount (0)
+		, _poolOffset (0)
+	{
+	}
+
+	octree_allocator(uint8_t* data, size_t size, size_t usedSize, uint32_t localPartsCount)
+		: _chunkAllocator (data, size, usedSize)
+		, _localParts (new local_part_impl[localPartsCount])
+		, _localPartsCount (localPartsCount)
+		, _baseCount (usedSize / ChinkSize)
+		, _freedCount (0)
 		, _poolOffset (0)
 	{
 	}
 
+	uint8_t* data() const
+	{
+		return _chunkAllocator.data();
+	}
+
+	size_t capacity() const
+	{
+		return _chunkAllocator.capacity();
+	}
+
+	size_t used_size() const
+	{
+		return _chunkAllocator.used_size();
+	}
+
+	// Bytes of the chunks in use, chunks freed into the pools are left out unlike in used_size.
+	// Exact only when no operation runs, chunks copied with a used part count as used until the GC frees them.
+	size_t live_size() const
+	{
+		size_t count = _baseCount - _freedCount;
+
+		for (uint32_t i = 0; i < _localPartsCount; ++i)
+		{
+			count += _localParts[i].AllocatedCount;
+		}
+
+		const std::lock_guard<std::mutex> guard(_dynamicPartsMutex);
+
+		for (const std::unique_ptr<local_part_impl>& localPart : _dynamicParts)
+		{
+			count += localPart->AllocatedCount;
+		}
+
+		return count * ChinkSize;
+	}
+
 	local_part& get_local_part(uint32_t index) const
 	{
 		assert(index < _localPartsCount);
 		return _localParts[index];
 	}
 
-	void prepare_gc()
+	// Every chunk which is not allocated from the new arena yet is forgotten, so nothing may be allocated concurrently
+	void replace_arena(chunk_allocator<ChinkSize>& arena)
 	{
-		if (!_poolOffset)
-			[[unlikely]]
+		_chunkAllocator.swap(arena);
+
+		_pools.clear();
+		_poolOffset = 0;
+		_baseCount = _chunkAllocator.used_size() / ChinkSize;
+		_freedCount = 0;
+
+		for (uint32_t i = 0; i < _localPartsCount; ++i)
 		{
-			return;
+			_localParts[i].Pool.template take<false>();
+			_localParts[i].AllocatedCount = 0;
 		}
 
-		const bool poolsNotEmpty = _pools.size() > _poolOffset;
+		const std::lock_guard<std::mutex> guard(_dynamicPartsMutex);
 
-		if (poolsNotEmpty)
-			[[likely]]
+		_releasedPools.clear();
+
+		for (const std::unique_ptr<local_part_impl>& localPart : _dynamicParts)
 		{
-			std::vector<chunk_pool<false, ChinkSize>> newPools;
-			newPools.reserve(_pools.size() - _poolOffset);
-			for (auto iter = _pools.begin() + _poolOffset; iter != _pools.end(); ++iter)
-			{
-				newPools.emplace_back(std::move(*iter));
-			}
-			_pools = std::move(newPools);
-			_poolOffset = 0;
+			localPart->Pool.template take<false>();
+			localPart->AllocatedCount = 0;
+		}
+	}
+
+	// Returns a local part which is not bound to any index. Parts released before are reused first.
+	local_part& acquire_local_part()
+	{
+		const std::lock_guard<std::mutex> guard(_dynamicPartsMutex);
+
+		local_part_impl* localPart;
+
+		if (!_freeDynamicParts.empty())
+		{
+			localPart = _freeDynamicParts.back();
+			_freeDynamicParts.pop_back();
 		}
 		else
 		{
-			_pools.clear();
+			localPart = _dynamicParts.emplace_back(std::make_unique<local_part_impl>()).get();
 		}
 
-		for (uint32_t i = 0; i < _localPartsCount; ++i)
+		// Checking _pools here would race with allocations of other parts, allocate_memory resets the flag itself
+		localPart->PoolsNotEmpty = true;
+		return *localPart;
+	}
+
+	// Chunks cached by the part are returned to the global pools on the next prepare_gc call
+	void release_local_part(local_part& localPart)
+	{
+		local_part_impl& localPartImpl = static_cast<local_part_impl&>(localPart);
+
+		const std::lock_guard<std::mutex> guard(_dynamicPartsMutex);
+
+		if (!localPartImpl.Pool.is_empty())
 		{
-			_localParts[i].PoolsNotEmpty = poolsNotEmpty;
+			_releasedPools.emplace_back(std::move(localPartImpl.Pool));
+		}
+
+		_freeDynamicParts.push_back(&localPartImpl);
+	}
+
+	void prepare_gc()
+	{
+		if (_poolOffset > 0)
+		{
+			if (_pools.size() > _poolOffset)
+				[[likely]]
+			{
+				std::vector<chunk_pool<false, ChinkSize>> newPools;
+				newPools.reserve(_pools.size() - _poolOffset);
+				for (auto iter = _pools.begin() + _poolOffset; iter != _pools.end(); ++iter)
+				{
+					newPools.emplace_back(std::move(*iter));
+				}
+				_pools = std::move(newPools);
+			}
+			else
+			{
+				_pools.clear();
+			}
+
+			_poolOffset = 0;
 		}
+
+		take_released_pools();
+		set_pools_not_empty(!_pools.empty());
 	}
 
-	void add_pools(std::pmr::vector<chunk_pool<false, ChinkSize>>&& pools)
+	// The pools hold chunksCount chunks together
+	void add_pools(std::pmr::vector<chunk_pool<false, ChinkSize>>&& pools, size_t chunksCount)
 	{
 		if (pools.size() == 0)
 			[[unlikely]]
@@ -96,14 +224,12 @@ public:
 		const std::lock_guard<std::mutex> guard(_addPoolsMutex);
 
 		assert(_poolOffset == 0);
+		_freedCount += chunksCount;
 
 		if (_pools.size() == 0)
 			[[unlikely]]
 		{
-			for (uint32_t i = 0; i < _localPartsCount; ++i)
-			{
-				_localParts[i].PoolsNotEmpty = true;
-			}
+			set_pools_not_empty(true);
 		}
 
 		for (chunk_pool<false, ChinkSize>& pool : pools)
@@ -114,10 +240,12 @@ public:
 		pools.clear();
 	}
 
+	// Only for nodes allocated before any operation, like the root
 	template <typename T, bool Synchronized, typename ... TArgs>
 	T* allocate(TArgs... args)
 	{
-		return _chunkAllocator.allocate<T, Synchronized, TArgs...>(std::forward<TArgs>(args)...);
+		++_baseCount;
+		return _chunkAllocator.template allocate<T, Synchronized, TArgs...>(std::forward<TArgs>(args)...);
 	}
 
 	template <typename T, bool Synchronized, typename ... TArgs>
@@ -132,21 +260,29 @@ public:
 	void deallocate(local_part& localPart, T& obj)
 	{
 		local_part_impl& localPartImpl = static_cast<local_part_impl&>(localPart);
-		localPartImpl.Pool.add<false>(obj);
+		localPartImpl.Pool.template add<false>(obj);
+		--localPartImpl.AllocatedCount;
 	}
 
 	template <bool Synchronized>
 	void* allocate_memory()
 	{
-		return _chunkAllocator.allocate_memory<Synchronized>();
+		return _chunkAllocator.template allocate_memory<Synchronized>();
+	}
+
+	// The next allocate_memory with this part takes a pool of the GC or a new array of chunks
+	bool is_pool_empty(const local_part& localPart) const
+	{
+		return static_cast<const local_part_impl&>(localPart).Pool.is_empty();
 	}
 
 	template <bool Synchronized>
 	void* allocate_memory(local_part& localPart)
 	{
 		local_part_impl& localPartImpl = static_cast<local_part_impl&>(localPart);
+		++localPartImpl.AllocatedCount;
 
-		if (void* const memory = localPartImpl.Pool.try_allocate_memory<false>())
+		if (void* const memory = localPartImpl.Pool.template try_allocate_memory<false>())
 		{
 			return memory;
 		}
@@ -157,7 +293,8 @@ public:
 			size_t poolOffset;
 			if constexpr (Synchronized)
 			{
-				poolOffset = reinterpret_cast<std::atomic<size_t>&>(_poolOffset)++;
+				// _pools is filled by prepare_gc before the synchronized operations start
+				poolOffset = std::atomic_ref<size_t>(_poolOffset).fetch_add(1, std::memory_order_relaxed);
 			}
 			else
 			{
@@ -167,8 +304,8 @@ public:
 			if (poolOffset < _pools.size())
 				[[likely]]
 			{
-				localPartImpl.Pool.merge<false>(_pools[poolOffset]);
-				return localPartImpl.Pool.allocate_memory<false>();
+				localPartImpl.Pool.template merge<false>(_pools[poolOffset]);
+				return localPartImpl.Pool.template allocate_memory<false>();
 			}
 			else
 			{
@@ -176,13 +313,41 @@ public:
 			}
 		}
 
-		char* const arrayMemory = static_cast<char*>(_chunkAllocator.allocate_memory<Synchronized>(ARRAY_SIZE));
+		char* const arrayMemory = static_cast<char*>(_chunkAllocator.template allocate_memory<Synchronized>(ARRAY_SIZE));
 
 		for (uint32_t i = 0; i < ARRAY_SIZE; ++i)
 		{
-			localPartImpl.Pool.add<false>(arrayMemory + i * ChinkSize);
+			localPartImpl.Pool.template add<false>(arrayMemory + i * ChinkSize);
 		}
 
-		return localPartImpl.Pool.allocate_memory<false>();
+		return localPartImpl.Pool.template allocate_memory<false>();
+	}
+
+private:
+	void take_released_pools()
+	{
+		const std::lock_guard<std::mutex> guard(_dynamicPartsMutex);
+
+		for (chunk_pool<false, ChinkSize>& pool : _releasedPools)
+		{
+			_pools.emplace_back(std::move(pool));
+		}
+
+		_releasedPools.clear();
+	}
+
+	void set_pools_not_empty(bool poolsNotEmpty)
+	{
+		for (uint32_t i = 0; i < _localPartsCount; ++i)
+		{
+			_localParts[i].PoolsNotEmpty = poolsNotEmpty;
+		}
+
+		const std::lock_guard<std::mutex> guard(_dynamicPartsMutex);
+
+		for (const std::unique_ptr<local_part_impl>& localPart : _dynamicParts)
+		{
+			localPart->PoolsNotEmpty = poolsNotEmpty;
+		}
 	}
 };
@@ -0,0 +1,584 @@
+#include "operation_trace.h"
+
+#include <thread>
+#include <barrier>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <stdexcept>
+#include <memory_resource>
+#include <cstring>
+#include <cassert>
+
+namespace
+{
+	struct trace_header final
+	{
+		static constexpr uint32_t MAGIC = 0x52544F50; // "POTR"
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+		// Shapes are recorded with their tags
+		static constexpr uint32_t VERSION = 0x103;
+#else
+		static constexpr uint32_t VERSION = 3;
+#endif
+
+		uint32_t Magic;
+		uint32_t Version;
+		uint32_t SizeLog;
+		uint32_t WorkersCount;
+		uint64_t BufferSize;
+	};
+
+	constexpr size_t FLUSH_SIZE = 1024 * 1024;
+
+	bool is_synchronized(operation_type type)
+	{
+		return
+			type == operation_type::add_synchronized || type == operation_type::remove_synchronized || type == operation_type::move_synchronized ||
+			type == operation_type::add_point_synchronized || type == operation_type::remove_point_synchronized || type == operation_type::move_point_synchronized;
+	}
+
+	bool is_move(operation_type type)
+	{
+		return
+			type == operation_type::move_synchronized || type == operation_type::move_exclusive ||
+			type == operation_type::move_point_synchronized || type == operation_type::move_point_exclusive;
+	}
+
+	bool is_point(operation_type type)
+	{
+		return type >= operation_type::add_point_synchronized && type <= operation_type::move_point_exclusive;
+	}
+
+	bool has_shape(operation_type type)
+	{
+		return type <= operation_type::move_point_exclusive;
+	}
+
+	bool has_gc_root(operation_type type)
+	{
+		return type == operation_type::collect_gc || type == operation_type::split_gc || type == operation_type::join_gc;
+	}
+
+	parallel_octree::shape_data new_shape(const parallel_octree::shape_move& shapeMove)
+	{
+		parallel_octree::shape_data shapeData{ shapeMove.aabbNew, shapeMove.Index };
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+		shapeData.Tag = shapeMove.Tag;
+#endif
+		return shapeData;
+	}
+
+	parallel_octree::point_data new_point(const parallel_octree::shape_move& shapeMove)
+	{
+		parallel_octree::point_data pointData{ shapeMove.aabbNew.Min, shapeMove.Index };
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+		pointData.Tag = shapeMove.Tag;
+#endif
+		return pointData;
+	}
+
+	parallel_octree::point_move point_move(const parallel_octree::shape_move& shapeMove)
+	{
+		parallel_octree::point_move pointMove{ shapeMove.aabbOld.Min, shapeMove.aabbNew.Min, shapeMove.Index };
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+		pointMove.Tag = shapeMove.Tag;
+#endif
+		return pointMove;
+	}
+}
+
+operation_recorder::operation_recorder(const std::filesystem::path& path)
+	: _stream (path, std::ios::binary | std::ios::trunc)
+	, _hasHeader (false)
+{
+	if (!_stream)
+	{
+		throw std::runtime_error("operation_recorder: cannot open " + path.string());
+	}
+
+	_buffer.reserve(FLUSH_SIZE + sizeof(parallel_octree::shape_move) + 8);
+}
+
+operation_recorder::~operation_recorder()
+{
+	flush();
+}
+
+void operation_recorder::flush()
+{
+	const std::lock_guard<spin_lock> guard(_lock);
+
+	_stream.write(reinterpret_cast<const char*>(_buffer.data()), std::streamsize(_buffer.size()));
+	_stream.flush();
+	_buffer.clear();
+}
+
+void operation_recorder::write_header(uint32_t sizeLog, size_t bufferSize, uint32_t workersCount)
+{
+	assert(!_hasHeader);
+	_hasHeader = true;
+
+	trace_header header = {};
+	header.Magic = trace_header::MAGIC;
+	header.Version = trace_header::VERSION;
+	header.SizeLog = sizeLog;
+	header.WorkersCount = workersCount;
+	header.BufferSize = bufferSize;
+
+	append(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+}
+
+template <typename TShape>
+void operation_recorder::record_shape(operation_type type, uint32_t workerIndex, const TShape& shape)
+{
+	uint8_t record[1 + sizeof(workerIndex) + sizeof(shape)];
+	size_t size = 0;
+
+	record[size++] = uint8_t(type);
+
+	if (is_synchronized(type))
+	{
+		std::memcpy(record + size, &workerIndex, sizeof(workerIndex));
+		size += sizeof(workerIndex);
+	}
+
+	std::memcpy(record + size, &shape, sizeof(shape));
+	size += sizeof(shape);
+
+	append(record, size);
+}
+
+void operation_recorder::record(operation_type type, uint32_t workerIndex, const parallel_octree::shape_data& shapeData)
+{
+	record_shape(type, workerIndex, shapeData);
+}
+
+void operation_recorder::record(operation_type type, uint32_t workerIndex, const parallel_octree::shape_move& shapeMove)
+{
+	record_shape(type, workerIndex, shapeMove);
+}
+
+void operation_recorder::record(operation_type type, uint32_t workerIndex, const parallel_octree::point_data& pointData)
+{
+	record_shape(type, workerIndex, pointData);
+}
+
+void operation_recorder::record(operation_type type, uint32_t workerIndex, const parallel_octree::point_move& pointMove)
+{
+	record_shape(type, workerIndex, pointMove);
+}
+
+void operation_recorder::record_prepare_gc(uint32_t depth, uint32_t targetWork)
+{
+	uint8_t record[1 + sizeof(depth) + sizeof(targetWork)];
+	record[0] = uint8_t(operation_type::prepare_gc);
+	std::memcpy(record + 1, &depth, sizeof(depth));
+	std::memcpy(record + 1 + sizeof(depth), &targetWork, sizeof(targetWork));
+
+	append(record, sizeof(record));
+}
+
+void operation_recorder::record_gc_root(operation_type type, const parallel_octree::gc_root& root, uint32_t targetWork)
+{
+	uint8_t record[1 + sizeof(root.Depth) + sizeof(root.Cell) + sizeof(targetWork)];
+	size_t size = 0;
+
+	record[size++] = uint8_t(type);
+	std::memcpy(record + size, &root.Depth, sizeof(root.Depth));
+	size += sizeof(root.Depth);
+	std::memcpy(record + size, &root.Cell, sizeof(root.Cell));
+	size += sizeof(root.Cell);
+
+	if (type == operation_type::split_gc)
+	{
+		std::memcpy(record + size, &targetWork, sizeof(targetWork));
+		size += sizeof(targetWork);
+	}
+
+	append(record, size);
+}
+
+void operation_recorder::record(operation_type type)
+{
+	const uint8_t record = uint8_t(type);
+	append(&record, sizeof(record));
+}
+
+void operation_recorder::append(const uint8_t* data, size_t size)
+{
+	const std::lock_guard<spin_lock> guard(_lock);
+
+	_buffer.insert(_buffer.end(), data, data + size);
+
+	if (_buffer.size() >= FLUSH_SIZE)
+	{
+		_stream.write(reinterpret_cast<const char*>(_buffer.data()), std::streamsize(_buffer.size()));
+		_buffer.clear();
+	}
+}
+
+operation_replay::operation_replay(const std::filesystem::path& path)
+	: _sizeLog (0)
+	, _bufferSize (0)
+	, _workersCount (0)
+{
+	std::ifstream stream(path, std::ios::binary);
+
+	if (!stream)
+	{
+		throw std::runtime_error("operation_replay: cannot open " + path.string());
+	}
+
+	const std::vector<uint8_t> data{ std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+	trace_header header;
+
+	if (data.size() < sizeof(header))
+	{
+		throw std::runtime_error("operation_replay: " + path.string() + " is not an operation trace");
+	}
+
+	std::memcpy(&header, data.data(), sizeof(header));
+
+	if (header.Magic != trace_header::MAGIC || header.Version != trace_header::VERSION)
+	{
+		throw std::runtime_error("operation_replay: " + path.string() + " is not an operation trace");
+	}
+
+	_sizeLog = header.SizeLog;
+	_bufferSize = size_t(header.BufferSize);
+	_workersCount = header.WorkersCount;
+
+	size_t offset = sizeof(header);
+
+	const auto read = [&data, &offset, &path](void* value, size_t size)
+	{
+		if (size > data.size() - offset)
+		{
+			throw std::runtime_error("operation_replay: " + path.string() + " is truncated");
+		}
+
+		std::memcpy(value, data.data() + offset, size);
+		offset += size;
+	};
+
+	while (offset < data.size())
+	{
+		operation currentOperation = {};
+		currentOperation.Type = operation_type(data[offset++]);
+		currentOperation.WorkerIndex = parallel_octree::InvalidIndex;
+
+		if (currentOperation.Type > operation_type::join_gc)
+		{
+			throw std::runtime_error("operation_replay: " + path.string() + " is corrupted");
+		}
+
+		if (is_synchronized(currentOperation.Type))
+		{
+			read(&currentOperation.WorkerIndex, sizeof(currentOperation.WorkerIndex));
+		}
+
+		if (is_point(currentOperation.Type))
+		{
+			parallel_octree::point_move pointMove = {};
+
+			if (is_move(currentOperation.Type))
+			{
+				read(&pointMove, sizeof(pointMove));
+			}
+			else
+			{
+				parallel_octree::point_data pointData;
+				read(&pointData, sizeof(pointData));
+				pointMove.pointNew = pointData.Point;
+				pointMove.Index = pointData.Index;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+				pointMove.Tag = pointData.Tag;
+#endif
+			}
+
+			currentOperation.Shape.aabbOld = { pointMove.pointOld, pointMove.pointOld };
+			currentOperation.Shape.aabbNew = { pointMove.pointNew, pointMove.pointNew };
+			currentOperation.Shape.Index = pointMove.Index;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+			currentOperation.Shape.Tag = pointMove.Tag;
+#endif
+		}
+		else if (is_move(currentOperation.Type))
+		{
+			read(&currentOperation.Shape, sizeof(currentOperation.Shape));
+		}
+		else if (has_shape(currentOperation.Type))
+		{
+			parallel_octree::shape_data shapeData;
+			read(&shapeData, sizeof(shapeData));
+			currentOperation.Shape.aabbNew = shapeData.AABB;
+			currentOperation.Shape.Index = shapeData.Index;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+			currentOperation.Shape.Tag = shapeData.Tag;
+#endif
+		}
+		else if (currentOperation.Type == operation_type::prepare_gc)
+		{
+			read(&currentOperation.Depth, sizeof(currentOperation.Depth));
+			read(&currentOperation.TargetWork, sizeof(currentOperation.TargetWork));
+		}
+		else if (has_gc_root(currentOperation.Type))
+		{
+			read(&currentOperation.Depth, sizeof(currentOperation.Depth));
+			read(&currentOperation.Cell, sizeof(currentOperation.Cell));
+
+			if (currentOperation.Type == operation_type::split_gc)
+			{
+				read(&currentOperation.TargetWork, sizeof(currentOperation.TargetWork));
+			}
+		}
+
+		_operations.push_back(currentOperation);
+	}
+
+	split_phases();
+}
+
+void operation_replay::split_phases()
+{
+	for (size_t i = 0; i < _operations.size(); ++i)
+	{
+		const operation_type type = _operations[i].Type;
+		phase_type phaseType = phase_type::exclusive;
+
+		if (is_synchronized(type))
+		{
+			phaseType = phase_type::synchronized;
+		}
+		else if (type == operation_type::prepare_gc || type == operation_type::resume_gc)
+		{
+			phaseType = phase_type::prepare_gc;
+		}
+		else if (type == operation_type::collect_gc)
+		{
+			phaseType = phase_type::collect;
+		}
+		else if (type == operation_type::split_gc || type == operation_type::join_gc)
+		{
+			phaseType = phase_type::split;
+		}
+
+		if (_phases.empty() || _phases.back().Type != phaseType)
+		{
+			_phases.push_back({ phaseType, i, i + 1 });
+		}
+		else
+		{
+			_phases.back().End = i + 1;
+		}
+	}
+}
+
+parallel_octree::gc_root operation_replay::find_gc_root(parallel_octree& octree, const operation& currentOperation, bool isMarked)
+{
+	const std::optional<parallel_octree::gc_root> root = octree.find_gc_root(currentOperation.Depth, currentOperation.Cell, isMarked);
+
+	if (!root)
+	{
+		throw std::runtime_error("operation_replay: the octree has no GC root recorded in the trace");
+	}
+
+	return *root;
+}
+
+std::unique_ptr<parallel_octree> operation_replay::create_octree(uint32_t threadsCount) const
+{
+	return std::make_unique<parallel_octree>(_sizeLog, uint32_t(_bufferSize), threadsCount);
+}
+
+operation_replay::statistics operation_replay::run(parallel_octree& octree, uint32_t threadsCount) const
+{
+	assert(threadsCount > 0);
+
+	statistics result;
+	result.OperationsCount = _operations.size();
+
+	std::pmr::vector<parallel_octree::gc_root> roots;
+	std::atomic<size_t> nextOperation = 0;
+
+	std::barrier barrier{ std::ptrdiff_t(threadsCount) };
+	std::mutex exceptionMutex;
+	std::exception_ptr exception;
+
+	const auto execute = [&](uint32_t threadIndex, const phase& currentPhase)
+	{
+		switch (currentPhase.Type)
+		{
+		case phase_type::synchronized:
+			for (size_t i = currentPhase.Begin; i < currentPhase.End; ++i)
+			{
+				const operation& currentOperation = _operations[i];
+
+				if (currentOperation.Shape.Index % threadsCount != threadIndex)
+				{
+					continue;
+				}
+
+				const parallel_octree::shape_data shapeData = new_shape(currentOperation.Shape);
+
+				switch (currentOperation.Type)
+				{
+				case operation_type::add_synchronized:
+					octree.add_synchronized(shapeData, threadIndex);
+					break;
+				case operation_type::remove_synchronized:
+					octree.remove_synchronized(shapeData, threadIndex);
+					break;
+				case operation_type::move_synchronized:
+					octree.move_synchronized(currentOperation.Shape, threadIndex);
+					break;
+				case operation_type::add_point_synchronized:
+					octree.add_point_synchronized(new_point(currentOperation.Shape), threadIndex);
+					break;
+				case operation_type::remove_point_synchronized:
+					octree.remove_point_synchronized(new_point(currentOperation.Shape), threadIndex);
+					break;
+				default:
+					octree.move_point_synchronized(point_move(currentOperation.Shape), threadIndex);
+					break;
+				}
+			}
+			break;
+
+		case phase_type::collect:
+			for (size_t i = nextOperation++; i < currentPhase.End; i = nextOperation++)
+			{
+				octree.collect_garbage(find_gc_root(octree, _operations[i], true));
+			}
+			break;
+
+		case phase_type::split:
+			if (threadIndex != 0)
+			{
+				break;
+			}
+
+			for (size_t i = currentPhase.Begin; i < currentPhase.End; ++i)
+			{
+				const operation& currentOperation = _operations[i];
+
+				if (currentOperation.Type == operation_type::split_gc)
+				{
+					// The spawned roots are collected by the recorded collect calls
+					octree.collect_garbage(find_gc_root(octree, currentOperation, true), currentOperation.TargetWork, roots);
+					roots.clear();
+				}
+				else
+				{
+					octree.join_garbage_collection(find_gc_root(octree, currentOperation, false));
+				}
+			}
+			break;
+
+		case phase_type::exclusive:
+		case phase_type::prepare_gc:
+			if (threadIndex != 0)
+			{
+				break;
+			}
+
+			for (size_t i = currentPhase.Begin; i < currentPhase.End; ++i)
+			{
+				const operation& currentOperation = _operations[i];
+				const parallel_octree::shape_data shapeData = new_shape(currentOperation.Shape);
+
+				switch (currentOperation.Type)
+				{
+				case operation_type::add_exclusive:
+					octree.add_exclusive(shapeData);
+					break;
+				case operation_type::remove_exclusive:
+					octree.remove_exclusive(shapeData);
+					break;
+				case operation_type::move_exclusive:
+					octree.move_exclusive(currentOperation.Shape);
+					break;
+				case operation_type::add_point_exclusive:
+					octree.add_point_exclusive(new_point(currentOperation.Shape));
+					break;
+				case operation_type::remove_point_exclusive:
+					octree.remove_point_exclusive(new_point(currentOperation.Shape));
+					break;
+				case operation_type::move_point_exclusive:
+					octree.move_point_exclusive(point_move(currentOperation.Shape));
+					break;
+				case operation_type::prepare_gc:
+					// The roots are found again by the collect calls
+					octree.prepare_garbage_collection(roots, currentOperation.Depth, currentOperation.TargetWork);
+					roots.clear();
+					break;
+				default:
+					octree.resume_garbage_collection();
+					break;
+				}
+			}
+			break;
+		}
+	};
+
+	const auto runThread = [&](uint32_t threadIndex)
+	{
+		for (const phase& currentPhase : _phases)
+		{
+			const auto time0 = std::chrono::high_resolution_clock::now();
+
+			if (threadIndex == 0 && currentPhase.Type == phase_type::collect)
+			{
+				nextOperation = currentPhase.Begin;
+			}
+
+			barrier.arrive_and_wait();
+
+			try
+			{
+				execute(threadIndex, currentPhase);
+			}
+			catch (...)
+			{
+				const std::lock_guard<std::mutex> guard(exceptionMutex);
+				if (!exception)
+				{
+					exception = std::current_exception();
+				}
+			}
+
+			barrier.arrive_and_wait();
+
+			if (threadIndex == 0)
+			{
+				const auto time1 = std::chrono::high_resolution_clock::now();
+				const bool isGC = currentPhase.Type != phase_type::synchronized && currentPhase.Type != phase_type::exclusive;
+				(isGC ? result.GCTime : result.ModificationTime) += time1 - time0;
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(threadsCount - 1);
+
+	for (uint32_t i = 1; i < threadsCount; ++i)
+	{
+		threads.emplace_back(runThread, i);
+	}
+
+	runThread(0);
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	if (exception)
+	{
+		std::rethrow_exception(exception);
+	}
+
+	return result;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+
+#include "parallel_octree.h"
+#include "spin_lock.h"
+
+enum class operation_type : uint8_t
+{
+	add_synchronized,
+	remove_synchronized,
+	move_synchronized,
+	add_exclusive,
+	remove_exclusive,
+	move_exclusive,
+	add_point_synchronized,
+	remove_point_synchronized,
+	move_point_synchronized,
+	add_point_exclusive,
+	remove_point_exclusive,
+	move_point_exclusive,
+	prepare_gc,
+	resume_gc,
+	collect_gc,
+	split_gc,
+	join_gc
+};
+
+// Writes every modification and GC call of the octree it is attached to into a binary file.
+// Synchronized operations from different threads are serialized by a spin lock, so recording slows them down.
+class operation_recorder final
+{
+private:
+	std::ofstream _stream;
+	std::vector<uint8_t> _buffer;
+	spin_lock _lock;
+	bool _hasHeader;
+
+public:
+	explicit operation_recorder(const std::filesystem::path& path);
+	~operation_recorder();
+
+	operation_recorder(const operation_recorder&) = delete;
+	const operation_recorder& operator = (const operation_recorder&) = delete;
+
+	// Writes the buffered operations to the file, must not run concurrently with the octree operations
+	void flush();
+
+	void record(operation_type type, uint32_t workerIndex, const parallel_octree::shape_data& shapeData);
+	void record(operation_type type, uint32_t workerIndex, const parallel_octree::shape_move& shapeMove);
+	void record(operation_type type, uint32_t workerIndex, const parallel_octree::point_data& pointData);
+	void record(operation_type type, uint32_t workerIndex, const parallel_octree::point_move& pointMove);
+	void record_prepare_gc(uint32_t depth, uint32_t targetWork);
+	// Collect, split and join calls keep the position of their root
+	void record_gc_root(operation_type type, const parallel_octree::gc_root& root, uint32_t targetWork);
+	void record(operation_type type);
+
+private:
+	// Called when the recorder is attached to the octree
+	void write_header(uint32_t sizeLog, size_t bufferSize, uint32_t workersCount);
+	template <typename TShape>
+	void record_shape(operation_type type, uint32_t workerIndex, const TShape& shape);
+	void append(const uint8_t* data, size_t size);
+
+	friend class parallel_octree;
+};
+
+// Runs a recorded trace against a new octree. Synchronized operations between two exclusive operations
+// or GC calls are spread over the threads by shape index, so every shape keeps the recorded order of its
+// operations. Consecutive collect calls are spread over the threads as well and find their roots by position.
+// Splits and joins of GC roots run on a single thread between them, so spawned roots are collected after
+// their split and joined after their collection as recorded.
+class operation_replay final
+{
+public:
+	struct operation final
+	{
+		operation_type Type;
+		uint32_t WorkerIndex;
+		// Add and remove use aabbNew only, point operations keep their points in Min of the boxes
+		parallel_octree::shape_move Shape;
+		uint32_t Depth;
+		uint32_t TargetWork;
+		// Position of the root of collect, split and join
+		parallel_octree::cell Cell;
+	};
+
+	struct statistics final
+	{
+		size_t OperationsCount = 0;
+		std::chrono::duration<double> ModificationTime{ 0 };
+		std::chrono::duration<double> GCTime{ 0 };
+	};
+
+private:
+	enum class phase_type : uint8_t
+	{
+		synchronized,
+		exclusive,
+		prepare_gc,
+		collect,
+		split
+	};
+
+	struct phase final
+	{
+		phase_type Type;
+		size_t Begin;
+		size_t End;
+	};
+
+private:
+	uint32_t _sizeLog;
+	size_t _bufferSize;
+	uint32_t _workersCount;
+	std::vector<operation> _operations;
+	std::vector<phase> _phases;
+
+public:
+	explicit operation_replay(const std::filesystem::path& path);
+
+	operation_replay(const operation_replay&) = delete;
+	const operation_replay& operator = (const operation_replay&) = delete;
+
+	// Octree of the recorded size with enough workers for threadsCount
+	std::unique_ptr<parallel_octree> create_octree(uint32_t threadsCount) const;
+
+	// The octree must be created by create_octree with at least the same threadsCount
+	statistics run(parallel_octree& octree, uint32_t threadsCount) const;
+
+	const std::vector<operation>& operations() const
+	{
+		return _operations;
+	}
+
+	uint32_t recorded_workers_count() const
+	{
+		return _workersCount;
+	}
+
+private:
+	void split_phases();
+
+	static parallel_octree::gc_root find_gc_root(parallel_octree& octree, const operation& currentOperation, bool isMarked);
+};
@@ -0,0 +1,273 @@
+#include "pair_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+// Fewer touched shapes per part do not pay for handing it to another thread
+static constexpr size_t MIN_SHAPES_PER_PART = 256;
+
+static bool are_overlapped(const parallel_octree::aabb& left, const parallel_octree::aabb& right)
+{
+	return
+		left.Min.X <= right.Max.X && right.Min.X <= left.Max.X &&
+		left.Min.Y <= right.Max.Y && right.Min.Y <= left.Max.Y &&
+		left.Min.Z <= right.Max.Z && right.Min.Z <= left.Max.Z;
+}
+
+pair_cache::pair_cache(parallel_octree& octree, uint32_t workersCount)
+	: _octree (octree)
+	, _workers (new worker[std::max(workersCount, 1u)])
+	, _workersCount (std::max(workersCount, 1u))
+	, _partSize (0)
+{
+}
+
+void pair_cache::reserve(uint32_t count)
+{
+	if (count > _shapes.size())
+	{
+		parallel_octree::shape_data removed{};
+		removed.Index = parallel_octree::InvalidIndex;
+
+		_shapes.resize(count, removed);
+		_partners.resize(count);
+		_isTouched.resize(count, 0);
+	}
+}
+
+void pair_cache::add(const parallel_octree::shape_data& shapeData)
+{
+	assert(shapeData.Index != parallel_octree::InvalidIndex);
+
+	reserve(shapeData.Index + 1);
+	assert(!is_alive(shapeData.Index));
+
+	_octree.add_exclusive(shapeData);
+	_shapes[shapeData.Index] = shapeData;
+	touch(shapeData.Index);
+}
+
+void pair_cache::remove(uint32_t index)
+{
+	assert(is_alive(index));
+
+	_octree.remove_exclusive(_shapes[index]);
+	_shapes[index].Index = parallel_octree::InvalidIndex;
+	touch(index);
+}
+
+void pair_cache::move(uint32_t index, const parallel_octree::aabb& aabbNew)
+{
+	assert(is_alive(index));
+
+	parallel_octree::shape_data& shapeData = _shapes[index];
+
+	parallel_octree::shape_move shapeMove{ shapeData.AABB, aabbNew, index };
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+	shapeMove.Tag = shapeData.Tag;
+#endif
+
+	_octree.move_exclusive(shapeMove);
+	shapeData.AABB = aabbNew;
+	touch(index);
+}
+
+void pair_cache::add_synchronized(const parallel_octree::shape_data& shapeData, uint32_t workerIndex)
+{
+	assert(shapeData.Index < _shapes.size() && workerIndex < _workersCount);
+	assert(!is_alive(shapeData.Index));
+
+	_octree.add_synchronized(shapeData, workerIndex);
+	_shapes[shapeData.Index] = shapeData;
+	_workers[workerIndex].Touched.push_back(shapeData.Index);
+}
+
+void pair_cache::remove_synchronized(uint32_t index, uint32_t workerIndex)
+{
+	assert(is_alive(index) && workerIndex < _workersCount);
+
+	_octree.remove_synchronized(_shapes[index], workerIndex);
+	_shapes[index].Index = parallel_octree::InvalidIndex;
+	_workers[workerIndex].Touched.push_back(index);
+}
+
+void pair_cache::move_synchronized(uint32_t index, const parallel_octree::aabb& aabbNew, uint32_t workerIndex)
+{
+	assert(is_alive(index) && workerIndex < _workersCount);
+
+	parallel_octree::shape_data& shapeData = _shapes[index];
+
+	parallel_octree::shape_move shapeMove{ shapeData.AABB, aabbNew, index };
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+	shapeMove.Tag = shapeData.Tag;
+#endif
+
+	_octree.move_synchronized(shapeMove, workerIndex);
+	shapeData.AABB = aabbNew;
+	_workers[workerIndex].Touched.push_back(index);
+}
+
+void pair_cache::update(std::pmr::vector<pair>& begun, std::pmr::vector<pair>& ended)
+{
+	prepare_update(1);
+	update_part(0);
+	finish_update(begun, ended);
+}
+
+size_t pair_cache::prepare_update(size_t partsCount)
+{
+	for (uint32_t i = 0; i < _workersCount; ++i)
+	{
+		for (const uint32_t index : _workers[i].Touched)
+		{
+			touch(index);
+		}
+
+		_workers[i].Touched.clear();
+	}
+
+	const size_t touchedCount = _touched.size();
+	partsCount = std::max(std::min(partsCount, touchedCount / MIN_SHAPES_PER_PART), size_t(1));
+
+	_partSize = (touchedCount + partsCount - 1) / partsCount;
+	_parts.resize(partsCount);
+
+	return partsCount;
+}
+
+void pair_cache::update_part(size_t partIndex)
+{
+	assert(partIndex < _parts.size());
+
+	const size_t touchedCount = _touched.size();
+	find_partners(std::min(partIndex * _partSize, touchedCount), std::min((partIndex + 1) * _partSize, touchedCount), _parts[partIndex]);
+}
+
+void pair_cache::finish_update(std::pmr::vector<pair>& begun, std::pmr::vector<pair>& ended)
+{
+	// Lists of untouched partners are patched here, so the pass stays on one thread
+	size_t touchedIndex = 0;
+
+	for (const part& currentPart : _parts)
+	{
+		for (size_t i = 0; i + 1 < currentPart.Offsets.size(); ++i)
+		{
+			const uint32_t* const partners = currentPart.Partners.data();
+			apply_partners(_touched[touchedIndex++], partners + currentPart.Offsets[i], partners + currentPart.Offsets[i + 1], begun, ended);
+		}
+	}
+
+	assert(touchedIndex == _touched.size());
+
+	for (const uint32_t index : _touched)
+	{
+		_isTouched[index] = 0;
+	}
+
+	_touched.clear();
+}
+
+const std::vector<uint32_t>& pair_cache::partners(uint32_t index) const
+{
+	static const std::vector<uint32_t> empty;
+	return index < _partners.size() ? _partners[index] : empty;
+}
+
+bool pair_cache::is_alive(uint32_t index) const
+{
+	return index < _shapes.size() && _shapes[index].Index != parallel_octree::InvalidIndex;
+}
+
+void pair_cache::touch(uint32_t index)
+{
+	if (!_isTouched[index])
+	{
+		_isTouched[index] = 1;
+		_touched.push_back(index);
+	}
+}
+
+void pair_cache::find_partners(size_t begin, size_t end, part& result) const
+{
+	result.Partners.clear();
+	result.Offsets.clear();
+
+	std::pmr::vector<uint32_t>& candidates = result.Candidates;
+
+	for (size_t i = begin; i < end; ++i)
+	{
+		const uint32_t index = _touched[i];
+		result.Offsets.push_back(result.Partners.size());
+
+		if (!is_alive(index))
+		{
+			continue;
+		}
+
+		const parallel_octree::aabb& aabb = _shapes[index].AABB;
+		_octree.query(aabb, candidates);
+
+		// Candidates are sorted, so are the partners
+		for (const uint32_t candidate : candidates)
+		{
+			if (candidate != index && is_alive(candidate) && are_overlapped(aabb, _shapes[candidate].AABB))
+			{
+				result.Partners.push_back(candidate);
+			}
+		}
+	}
+
+	result.Offsets.push_back(result.Partners.size());
+}
+
+void pair_cache::apply_partners(uint32_t index, const uint32_t* first, const uint32_t* last, std::pmr::vector<pair>& begun, std::pmr::vector<pair>& ended)
+{
+	std::vector<uint32_t>& oldPartners = _partners[index];
+
+	// A pair of two touched shapes is seen from both sides and reported by the one with the smaller index
+	const auto report = [this, index](std::pmr::vector<pair>& events, uint32_t partner)
+	{
+		if (!_isTouched[partner] || index < partner)
+		{
+			events.push_back({ std::min(index, partner), std::max(index, partner) });
+		}
+	};
+
+	const uint32_t* newPartner = first;
+	auto oldPartner = oldPartners.cbegin();
+
+	while (newPartner != last || oldPartner != oldPartners.cend())
+	{
+		if (oldPartner == oldPartners.cend() || (newPartner != last && *newPartner < *oldPartner))
+		{
+			report(begun, *newPartner);
+
+			if (!_isTouched[*newPartner])
+			{
+				std::vector<uint32_t>& partners = _partners[*newPartner];
+				partners.insert(std::lower_bound(partners.begin(), partners.end(), index), index);
+			}
+
+			++newPartner;
+		}
+		else if (newPartner == last || *oldPartner < *newPartner)
+		{
+			report(ended, *oldPartner);
+
+			if (!_isTouched[*oldPartner])
+			{
+				std::vector<uint32_t>& partners = _partners[*oldPartner];
+				partners.erase(std::lower_bound(partners.begin(), partners.end(), index));
+			}
+
+			++oldPartner;
+		}
+		else
+		{
+			++newPartner;
+			++oldPartner;
+		}
+	}
+
+	oldPartners.assign(first, last);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+#include "parallel_octree.h"
+
+// Keeps the overlapping pairs of shapes between updates. Shapes are added, moved and removed through the cache,
+// which applies the change to the octree and remembers the box; update queries just the shapes touched since
+// the previous update and reports the pairs which began and ended overlapping. Boxes touching each other overlap.
+class pair_cache final
+{
+public:
+	// First < Second
+	struct pair final
+	{
+		uint32_t First, Second;
+	};
+
+private:
+	// Partners of a range of touched shapes found by one thread
+	struct part final
+	{
+		std::vector<uint32_t> Partners;
+		std::vector<size_t> Offsets;
+		std::pmr::vector<uint32_t> Candidates;
+	};
+
+	// Shapes touched by the synchronized calls of one worker, duplicates are dropped by prepare_update
+	struct alignas(CACHE_LINE_SIZE) worker final
+	{
+		std::vector<uint32_t> Touched;
+	};
+
+private:
+	parallel_octree& _octree;
+
+	// Indexed by shape index, removed shapes have InvalidIndex
+	std::vector<parallel_octree::shape_data> _shapes;
+	// Sorted indices of the overlapping shapes
+	std::vector<std::vector<uint32_t>> _partners;
+	std::vector<uint8_t> _isTouched;
+	std::vector<uint32_t> _touched;
+
+	std::unique_ptr<worker[]> _workers;
+	uint32_t _workersCount;
+
+	std::vector<part> _parts;
+	size_t _partSize;
+
+public:
+	// Synchronized calls take worker indices in [0, workersCount) of the octree. Indices of shapes added to
+	// the octree past the cache are skipped.
+	explicit pair_cache(parallel_octree& octree, uint32_t workersCount = 0);
+
+	pair_cache(const pair_cache&) = delete;
+	const pair_cache& operator = (const pair_cache&) = delete;
+
+	// Synchronized adds need indices below count, the exclusive ones grow the cache themselves
+	void reserve(uint32_t count);
+
+	// These modify the octree through its exclusive operations
+	void add(const parallel_octree::shape_data& shapeData);
+	void remove(uint32_t index);
+	void move(uint32_t index, const parallel_octree::aabb& aabbNew);
+
+	// These go through the synchronized operations and may run concurrently for different shapes
+	void add_synchronized(const parallel_octree::shape_data& shapeData, uint32_t workerIndex);
+	void remove_synchronized(uint32_t index, uint32_t workerIndex);
+	void move_synchronized(uint32_t index, const parallel_octree::aabb& aabbNew, uint32_t workerIndex);
+
+	// Appends the pairs which changed since the previous update, on the calling thread.
+	// Must not run concurrently with modifications of the octree.
+	void update(std::pmr::vector<pair>& begun, std::pmr::vector<pair>& ended);
+
+	// The same in steps for the caller's threads: prepare_update splits the touched shapes into at most partsCount
+	// parts and returns their number, update_part may then run concurrently for every part, and finish_update
+	// reports the changes on one thread
+	size_t prepare_update(size_t partsCount);
+	void update_part(size_t partIndex);
+	void finish_update(std::pmr::vector<pair>& begun, std::pmr::vector<pair>& ended);
+
+	// Sorted, as of the last update
+	const std::vector<uint32_t>& partners(uint32_t index) const;
+
+private:
+	bool is_alive(uint32_t index) const;
+	void touch(uint32_t index);
+	void find_partners(size_t begin, size_t end, part& result) const;
+	void apply_partners(uint32_t index, const uint32_t* first, const uint32_t* last, std::pmr::vector<pair>& begun, std::pmr::vector<pair>& ended);
+};
@@ -1,55 +1,449 @@
 #include "parallel_octree.h"
 
 #include "relative_ptr.h"
+#include "mapped_file.h"
+#include "operation_trace.h"
+#include "event_trace.h"
 
 #include <span>
+#include <bit>
+#include <atomic>
 #include <memory_resource>
-
+#include <mutex>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <cmath>
+#include <iterator>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _MSC_VER
 #define NOINLINE __declspec(noinline)
-static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+#ifdef _MSC_VER
+#define PREFETCH(address) _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0)
+#else
+#define PREFETCH(address) __builtin_prefetch(address)
+#endif
+
+#ifdef PARALLEL_OCTREE_LATENCY_HISTOGRAMS
+#define LATENCY_SCOPE(synchronized, histogram) const latency_scope<synchronized> latencyScope(histogram)
+#else
+#define LATENCY_SCOPE(synchronized, histogram)
+#endif
+
+static_assert(std::atomic_ref<uint32_t>::is_always_lock_free && std::atomic_ref<uint32_t>::required_alignment <= alignof(uint32_t));
+static_assert(std::atomic_ref<size_t>::is_always_lock_free && std::atomic_ref<size_t>::required_alignment <= alignof(size_t));
 static constexpr uint32_t GC_HINT_FLAG = 0x80000000u;
+// An exclusive remove compacts the leaf once at least 1 / LEAF_COMPACTION_RATIO of its entries are tombstones
+static constexpr uint32_t LEAF_COMPACTION_RATIO = 2;
+// Arena bytes per thread below which whole-arena passes are not worth starting threads for
+static constexpr size_t MIN_THREAD_SIZE = 16 * 1024 * 1024;
+// Shapes of an add batch descending together, their nodes of one level should stay in L1 until they are visited
+static constexpr size_t BATCH_GROUP_SIZE = 32;
+// Fewer queries of a batch per part do not pay for handing it to another thread
+static constexpr size_t MIN_QUERIES_PER_PART = 256;
+// Levels of the Morton key batched queries are sorted by
+static constexpr uint32_t MORTON_LEVELS = 10;
+// Coordinates stay exact in float up to 2^24, traversals are instantiated for every size up to it
+static constexpr uint32_t MAX_SIZE_LOG = 24;
+// Options changing the node layout, saved with snapshots and shared segments
+static constexpr uint32_t LAYOUT_LEAF_TAGS = 1;
+static constexpr uint32_t LAYOUT_DIRTY_LEAVES = 2;
+static constexpr uint32_t LAYOUT_OCCUPANCY_COUNTS = 4;
+
+// Calls func with std::integral_constant<uint32_t, sizeLog>, so the depth of the traversal is a compile-time constant
+template <typename TFunc, uint32_t ... SizeLogs>
+static void dispatch_size_log(uint32_t sizeLog, TFunc&& func, std::integer_sequence<uint32_t, SizeLogs ...>)
+{
+	using call = void (*)(TFunc&);
+	static constexpr call CALLS[] = { [](TFunc& f) { f(std::integral_constant<uint32_t, SizeLogs>()); } ... };
+
+	assert(sizeLog < std::size(CALLS));
+	CALLS[sizeLog](func);
+}
+
+template <typename TFunc>
+static void dispatch_size_log(uint32_t sizeLog, TFunc&& func)
+{
+	dispatch_size_log(sizeLog, func, std::make_integer_sequence<uint32_t, MAX_SIZE_LOG + 1>());
+}
+
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+
+// Leaf c touches a shape if c <= Max and c + 1 >= Min, so the shape touches leaves [ceil(Min) - 1, floor(Max)] on every axis
+static parallel_octree::aabb touched_leaves(const parallel_octree::aabb& aabbShape)
+{
+	return {
+		{ std::ceil(aabbShape.Min.X) - 1.0f, std::ceil(aabbShape.Min.Y) - 1.0f, std::ceil(aabbShape.Min.Z) - 1.0f },
+		{ std::floor(aabbShape.Max.X), std::floor(aabbShape.Max.Y), std::floor(aabbShape.Max.Z) }
+	};
+}
+
+// Number of the leaves of touched_leaves under the node, that is the leaves an add or remove of the shape visits there
+static uint32_t touched_leaves_count(const parallel_octree::aabb& leaves, const parallel_octree::aabb& aabbNode)
+{
+	const auto axis = [](float leavesMin, float leavesMax, float nodeMin, float nodeMax)
+	{
+		const float first = std::max(nodeMin, leavesMin);
+		const float last = std::min(nodeMax - 1.0f, leavesMax);
+		return last >= first ? uint32_t(last - first) + 1 : 0u;
+	};
+
+	return
+		axis(leaves.Min.X, leaves.Max.X, aabbNode.Min.X, aabbNode.Max.X) *
+		axis(leaves.Min.Y, leaves.Max.Y, aabbNode.Min.Y, aabbNode.Max.Y) *
+		axis(leaves.Min.Z, leaves.Max.Z, aabbNode.Min.Z, aabbNode.Max.Z);
+}
+
+#endif
 
 struct parallel_octree::node
 {
 };
 
+struct parallel_octree::snapshot_header final
+{
+	static constexpr uint32_t MAGIC = 0x54434F50u;
+	static constexpr uint32_t VERSION = 2;
+
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t SizeLog;
+	uint32_t LeafCapacity;
+	uint64_t RootOffset;
+	uint64_t UsedSize;
+	uint64_t Capacity;
+	// layout_flags of the writer, builds with equal leaf capacities may still differ in node layouts
+	uint32_t LayoutFlags;
+	uint8_t Reserved[CACHE_LINE_SIZE - 44];
+};
+
 struct parallel_octree::tree final : public node
 {
 	relative_ptr<node> Children[8];
 	uint32_t GCHint = 0;
+	// Number of leaf updates which left tombstones in the subtree since the last GC, the root does not count them
+	uint32_t DirtyCount = 0;
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+	// Live entries in the leaves of the subtree
+	uint32_t LiveCount = 0;
+#endif
 };
 
-struct parallel_octree::leaf final : public node
+#if defined(PARALLEL_OCTREE_LEAF_TAGS)
+// Every entry takes an index and a tag, so 4 bytes of each chunk stay unused, the dirty epoch of a leaf fits there
+static constexpr uint32_t LEAF_CAPACITY = 6;
+static constexpr uint32_t LEAF_EXTENSION_CAPACITY = 7;
+#elif defined(PARALLEL_OCTREE_DIRTY_LEAVES)
+// The dirty epoch takes the place of one entry
+static constexpr uint32_t LEAF_CAPACITY = 12;
+static constexpr uint32_t LEAF_EXTENSION_CAPACITY = 15;
+#else
+static constexpr uint32_t LEAF_CAPACITY = 13;
+static constexpr uint32_t LEAF_EXTENSION_CAPACITY = 15;
+#endif
+
+struct alignas(CACHE_LINE_SIZE) parallel_octree::leaf final : public node
 {
 	uint32_t Count = 0;
+	// Number of tombstones, unlike trees leaves do not need the depth
 	uint32_t GCHint = 0;
-	uint32_t Indices[13] = {};
+	uint32_t Indices[LEAF_CAPACITY] = {};
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+	uint32_t Tags[LEAF_CAPACITY] = {};
+#endif
 	relative_ptr<leaf_extension> Next;
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+	// Epoch of the dirty log the leaf was last appended to, zero is never current
+	uint32_t DirtyEpoch = 0;
+#endif
+
+	// Moves live entries to the front and passes the extensions past the new count to recycle
+	template <typename TRecycle>
+	void compact(TRecycle&& recycle);
+
+	// Calls func(chunk, position) for every entry which is not a tombstone, chunk is the leaf or one of its extensions
+	template <typename TFunc>
+	void for_each_entry(TFunc&& func) const;
+
+	// Calls func for every index which is not a tombstone
+	template <typename TFunc>
+	void for_each_index(TFunc&& func) const;
 };
 
-struct parallel_octree::leaf_extension final
+struct alignas(CACHE_LINE_SIZE) parallel_octree::leaf_extension final
 {
-	uint32_t Indices[15] = {};
+	uint32_t Indices[LEAF_EXTENSION_CAPACITY] = {};
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+	uint32_t Tags[LEAF_EXTENSION_CAPACITY] = {};
+#endif
 	relative_ptr<leaf_extension> Next;
 };
 
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+
+template <typename TChunk>
+static bool has_tag(const TChunk& chunk, uint32_t position, uint32_t tagMask)
+{
+	return (chunk.Tags[position] & tagMask) != 0;
+}
+
+template <typename TChunk, typename TShape>
+static void set_tag(TChunk& chunk, uint32_t position, const TShape& shape)
+{
+	chunk.Tags[position] = shape.Tag;
+}
+
+template <typename TDestination, typename TSource>
+static void copy_entry(TDestination& destination, uint32_t destinationPosition, const TSource& source, uint32_t sourcePosition)
+{
+	destination.Indices[destinationPosition] = source.Indices[sourcePosition];
+	destination.Tags[destinationPosition] = source.Tags[sourcePosition];
+}
+
+#else
+
+template <typename TChunk>
+static bool has_tag(const TChunk&, uint32_t, uint32_t)
+{
+	return true;
+}
+
+template <typename TChunk, typename TShape>
+static void set_tag(TChunk&, uint32_t, const TShape&)
+{
+}
+
+template <typename TDestination, typename TSource>
+static void copy_entry(TDestination& destination, uint32_t destinationPosition, const TSource& source, uint32_t sourcePosition)
+{
+	destination.Indices[destinationPosition] = source.Indices[sourcePosition];
+}
+
+#endif
+
+template <typename TFunc>
+void parallel_octree::leaf::for_each_entry(TFunc&& func) const
+{
+	uint32_t count = Count;
+
+	for (uint32_t i = 0, max = std::min(count, LEAF_CAPACITY); i < max; ++i)
+	{
+		if (Indices[i] != InvalidIndex)
+		{
+			func(*this, i);
+		}
+	}
+
+	if (count <= LEAF_CAPACITY)
+		[[likely]]
+	{
+		return;
+	}
+
+	count -= LEAF_CAPACITY;
+
+	for (const leaf_extension* extension = Next.get(); extension && count > 0; extension = extension->Next.get())
+	{
+		for (uint32_t i = 0, max = std::min(count, LEAF_EXTENSION_CAPACITY); i < max; ++i)
+		{
+			if (extension->Indices[i] != InvalidIndex)
+			{
+				func(*extension, i);
+			}
+		}
+
+		count -= std::min(count, LEAF_EXTENSION_CAPACITY);
+	}
+}
+
+template <typename TFunc>
+void parallel_octree::leaf::for_each_index(TFunc&& func) const
+{
+	for_each_entry([&func](const auto& chunk, uint32_t position) { func(chunk.Indices[position]); });
+}
+
+template <typename TRecycle>
+void parallel_octree::leaf::compact(TRecycle&& recycle)
+{
+	GCHint = 0;
+
+	// Entries only move towards the front, so none is overwritten before it is read
+	relative_ptr<leaf_extension>* nextPtr = &Next;
+	leaf_extension* destination = nullptr;
+	uint32_t offset = 0;
+	uint32_t newCount = 0;
+
+	for_each_entry([this, &nextPtr, &destination, &offset, &newCount](const auto& chunk, uint32_t position)
+	{
+		if (offset == (destination ? LEAF_EXTENSION_CAPACITY : LEAF_CAPACITY))
+			[[unlikely]]
+		{
+			assert(*nextPtr);
+			destination = nextPtr->get();
+			nextPtr = &destination->Next;
+			offset = 0;
+		}
+
+		if (destination)
+		{
+			copy_entry(*destination, offset++, chunk, position);
+		}
+		else
+		{
+			copy_entry(*this, offset++, chunk, position);
+		}
+
+		++newCount;
+	});
+
+	Count = newCount;
+
+	leaf_extension* extension = nextPtr->get();
+	*nextPtr = nullptr;
+
+	while (extension)
+	{
+		leaf_extension* const next = extension->Next.get();
+		recycle(*extension);
+		extension = next;
+	}
+}
+
+struct parallel_octree::batch_node final
+{
+	node* Node;
+	aabb AABB;
+	uint32_t Shape;
+};
+
+struct parallel_octree::worker final
+{
+	octree_allocator<>::local_part* LocalPart = nullptr;
+
+	// Levels of add batches, kept to reuse their memory
+	std::vector<batch_node> BatchLevel;
+	std::vector<batch_node> BatchNextLevel;
+
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+	// Cells of the leaves this worker changed first in the current epoch
+	std::vector<cell> DirtyCells;
+#endif
+
+#ifdef PARALLEL_OCTREE_LATENCY_HISTOGRAMS
+	latency_histograms Latency;
+#endif
+};
+
+struct parallel_octree::worker_registry final
+{
+	std::mutex Mutex;
+	parallel_octree* Owner;
+	std::vector<std::unique_ptr<worker>> Workers;
+	std::vector<worker*> FreeWorkers;
+
+	explicit worker_registry(parallel_octree& owner)
+		: Owner (&owner)
+	{
+	}
+
+	bool is_alive()
+	{
+		const std::lock_guard<std::mutex> guard(Mutex);
+		return Owner != nullptr;
+	}
+
+	void release(worker& currentWorker)
+	{
+		const std::lock_guard<std::mutex> guard(Mutex);
+
+		if (Owner)
+		{
+			Owner->_allocator.release_local_part(*currentWorker.LocalPart);
+			currentWorker.LocalPart = nullptr;
+			FreeWorkers.push_back(&currentWorker);
+		}
+	}
+};
+
+struct parallel_octree::thread_workers final
+{
+	struct entry final
+	{
+		std::shared_ptr<worker_registry> Registry;
+		worker* Worker;
+	};
+
+	std::vector<entry> Entries;
+
+	~thread_workers()
+	{
+		for (entry& currentEntry : Entries)
+		{
+			currentEntry.Registry->release(*currentEntry.Worker);
+		}
+	}
+};
+
+thread_local parallel_octree::thread_workers parallel_octree::_threadWorkers;
+
 template <bool Synchronized>
 class parallel_octree::traverser_common
 {
 private:
 	octree_allocator<>& _allocator;
 	octree_allocator<>::local_part& _allocatorLocalPart;
+	event_trace* const _eventTrace;
+	uint32_t _tombstonesCount;
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+	std::vector<cell>& _dirtyCells;
+	const uint32_t _dirtyEpoch;
+#endif
 
 protected:
-	traverser_common(parallel_octree& owner, uint32_t workerIndex)
+	traverser_common(parallel_octree& owner, worker& currentWorker)
 		: _allocator (owner._allocator)
-		, _allocatorLocalPart (owner._allocator.get_local_part(workerIndex))
+		, _allocatorLocalPart (*currentWorker.LocalPart)
+		, _eventTrace (owner._eventTrace)
+		, _tombstonesCount (0)
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+		, _dirtyCells (currentWorker.DirtyCells)
+		, _dirtyEpoch (owner._dirtyEpoch)
+#endif
+	{
+		assert(!owner._isReadOnly);
+	}
+
+public:
+	// Negative in two's complement when exclusive compactions dropped more tombstones than were added
+	uint32_t tombstones_count() const
 	{
+		return _tombstonesCount;
 	}
 
+protected:
+
 	template <typename TNode>
 	TNode* allocate_node()
 	{
+		if (_eventTrace && _allocator.is_pool_empty(_allocatorLocalPart))
+			[[unlikely]]
+		{
+			const event_trace::scope traceScope(_eventTrace, "allocator_refill");
+			return _allocator.allocate<TNode, Synchronized>(_allocatorLocalPart);
+		}
+
 		return _allocator.allocate<TNode, Synchronized>(_allocatorLocalPart);
 	}
 
@@ -64,13 +458,56 @@ protected:
 		return isTree ? static_cast<node*>(allocate_node<tree>()) : static_cast<node*>(allocate_node<leaf>());
 	}
 
-	void add_item(leaf& currentLeaf, uint32_t index)
+	// Unit cells start at integer coordinates, so the minimum of the leaf box is its cell
+	static cell leaf_cell(const aabb& aabbLeaf)
+	{
+		return { uint32_t(aabbLeaf.Min.X), uint32_t(aabbLeaf.Min.Y), uint32_t(aabbLeaf.Min.Z) };
+	}
+
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+	void mark_dirty(leaf& currentLeaf, const cell& leafCell)
+	{
+		if constexpr (Synchronized)
+		{
+			// The exchange lets only one of the workers changing the leaf log it
+			std::atomic_ref<uint32_t> dirtyEpoch(currentLeaf.DirtyEpoch);
+
+			if (dirtyEpoch.load(std::memory_order_relaxed) == _dirtyEpoch || dirtyEpoch.exchange(_dirtyEpoch, std::memory_order_relaxed) == _dirtyEpoch)
+				[[likely]]
+			{
+				return;
+			}
+		}
+		else
+		{
+			if (currentLeaf.DirtyEpoch == _dirtyEpoch)
+				[[likely]]
+			{
+				return;
+			}
+
+			currentLeaf.DirtyEpoch = _dirtyEpoch;
+		}
+
+		_dirtyCells.push_back(leafCell);
+	}
+#else
+	static void mark_dirty(leaf&, const cell&)
+	{
+	}
+#endif
+
+	template <typename TShape>
+	void add_item(leaf& currentLeaf, const cell& leafCell, const TShape& shape)
 	{
+		mark_dirty(currentLeaf, leafCell);
+
 		uint32_t offset;
 
 		if constexpr (Synchronized)
 		{
-			offset = reinterpret_cast<std::atomic<uint32_t>&>(currentLeaf.Count)++;
+			// Only reserves the slot, the slot is published by the index stored into it
+			offset = std::atomic_ref<uint32_t>(currentLeaf.Count).fetch_add(1, std::memory_order_relaxed);
 		}
 		else
 		{
@@ -80,7 +517,8 @@ protected:
 		if (offset < uint32_t(std::size(currentLeaf.Indices)))
 			[[likely]]
 		{
-			currentLeaf.Indices[offset] = index;
+			set_tag(currentLeaf, offset, shape);
+			store_index(currentLeaf.Indices[offset], shape.Index);
 			return;
 		}
 
@@ -116,7 +554,8 @@ protected:
 			if (offset < uint32_t(std::size(extension->Indices)))
 				[[likely]]
 			{
-				extension->Indices[offset] = index;
+				set_tag(*extension, offset, shape);
+				store_index(extension->Indices[offset], shape.Index);
 				break;
 			}
 
@@ -125,12 +564,37 @@ protected:
 		}
 	}
 
+	// Concurrent adds and removes of other shapes may write other slots of the same leaf the scan goes over
+	static uint32_t load_index(uint32_t& slot)
+	{
+		if constexpr (Synchronized)
+		{
+			return std::atomic_ref<uint32_t>(slot).load(std::memory_order_relaxed);
+		}
+		else
+		{
+			return slot;
+		}
+	}
+
+	static void store_index(uint32_t& slot, uint32_t index)
+	{
+		if constexpr (Synchronized)
+		{
+			std::atomic_ref<uint32_t>(slot).store(index, std::memory_order_relaxed);
+		}
+		else
+		{
+			slot = index;
+		}
+	}
+
 	static void set_gc_hint(uint32_t& value, uint32_t depth)
 	{
 		const uint32_t gcHint = GC_HINT_FLAG + depth;
 		if constexpr (Synchronized)
 		{
-			reinterpret_cast<std::atomic<uint32_t>&>(value).store(gcHint);
+			std::atomic_ref<uint32_t>(value).store(gcHint, std::memory_order_relaxed);
 		}
 		else
 		{
@@ -138,27 +602,109 @@ protected:
 		}
 	}
 
-	void remove_item(leaf& currentLeaf, uint32_t index, uint32_t depth)
+	// Exclusive compactions pass the tombstones they dropped as a negative count in two's complement. The GC may have
+	// reset the count since those tombstones were added, so it stops at zero.
+	static void add_dirty_count(tree& currentTree, uint32_t depth, uint32_t count)
+	{
+		if (depth == 0)
+		{
+			return;
+		}
+
+		if constexpr (Synchronized)
+		{
+			std::atomic_ref<uint32_t>(currentTree.DirtyCount).fetch_add(count, std::memory_order_relaxed);
+		}
+		else if (int32_t(count) < 0 && currentTree.DirtyCount < 0u - count)
+		{
+			currentTree.DirtyCount = 0;
+		}
+		else
+		{
+			currentTree.DirtyCount += count;
+		}
+	}
+
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+	// Counts wrap around, so a negative count is passed as its two's complement
+	static void add_live_count(tree& currentTree, uint32_t count)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+
+		if constexpr (Synchronized)
+		{
+			std::atomic_ref<uint32_t>(currentTree.LiveCount).fetch_add(count, std::memory_order_relaxed);
+		}
+		else
+		{
+			currentTree.LiveCount += count;
+		}
+	}
+#endif
+
+	// Returns the change of the dirty counts of the ancestors: 1 for the new tombstone, or, once a compaction dropped
+	// the tombstones, minus the earlier updates in two's complement plus 1 if the empty leaf is left to the GC
+	uint32_t remove_item(leaf& currentLeaf, const cell& leafCell, uint32_t index)
+	{
+		mark_dirty(currentLeaf, leafCell);
+
+		const uint32_t count = tombstone_item(currentLeaf, index);
+
+		if constexpr (Synchronized)
+		{
+			std::atomic_ref<uint32_t>(currentLeaf.GCHint).fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			// Every earlier update counted by the hint went into the dirty counts, an empty leaf left to the GC included
+			const uint32_t previousDirtyCount = currentLeaf.GCHint++;
+
+			// Nobody else can touch the leaf, so it is compacted in place and only an empty leaf is left to the GC
+			if (currentLeaf.GCHint * LEAF_COMPACTION_RATIO >= count)
+			{
+				currentLeaf.compact([this](leaf_extension& extension) { deallocate_node(extension); });
+				// The new tombstone was never counted
+				_tombstonesCount -= count - currentLeaf.Count - 1;
+
+				if (currentLeaf.Count > 0)
+				{
+					return 0u - previousDirtyCount;
+				}
+
+				currentLeaf.GCHint = 1;
+				return 1u - previousDirtyCount;
+			}
+		}
+
+		++_tombstonesCount;
+		return 1;
+	}
+
+	// Replaces the index with InvalidIndex and returns the leaf count
+	static uint32_t tombstone_item(leaf& currentLeaf, uint32_t index)
 	{
 		uint32_t count;
 
 		if constexpr (Synchronized)
 		{
-			count = reinterpret_cast<std::atomic<uint32_t>&>(currentLeaf.Count).load();
+			count = std::atomic_ref<uint32_t>(currentLeaf.Count).load(std::memory_order_relaxed);
 		}
 		else
 		{
 			count = currentLeaf.Count;
 		}
 
-		set_gc_hint(currentLeaf.GCHint, depth);
+		const uint32_t leafCount = count;
 
 		for (uint32_t i = 0, max = std::min(uint32_t(std::size(currentLeaf.Indices)), count); i < max; ++i)
 		{
-			if (currentLeaf.Indices[i] == index)
+			if (load_index(currentLeaf.Indices[i]) == index)
 			{
-				currentLeaf.Indices[i] = InvalidIndex;
-				return;
+				store_index(currentLeaf.Indices[i], InvalidIndex);
+				return leafCount;
 			}
 		}
 
@@ -172,10 +718,10 @@ protected:
 		{
 			for (uint32_t i = 0, max = std::min(uint32_t(std::size(extension->Indices)), count); i < max; ++i)
 			{
-				if (extension->Indices[i] == index)
+				if (load_index(extension->Indices[i]) == index)
 				{
-					extension->Indices[i] = InvalidIndex;
-					return;
+					store_index(extension->Indices[i], InvalidIndex);
+					return leafCount;
 				}
 			}
 
@@ -187,7 +733,7 @@ protected:
 		}
 	}
 
-	node* add_octant(uint32_t sizeLog, uint32_t depth, tree& currentTree, uint32_t octantIndex)
+	node* add_octant(bool isTree, tree& currentTree, uint32_t octantIndex)
 	{
 		relative_ptr<node>& child = currentTree.Children[octantIndex];
 		node* currentNode = child.get();
@@ -198,7 +744,7 @@ protected:
 			return currentNode;
 		}
 
-		return allocate_octant(child, depth != sizeLog);
+		return allocate_octant(child, isTree);
 	}
 
 private:
@@ -239,46 +785,53 @@ class parallel_octree::traverser_add final : private traverser_common<Synchroniz
 private:
 	shape_data _shapeData;
 	uint32_t _sizeLog;
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+	aabb _leaves;
+#endif
 
 public:
-	traverser_add(parallel_octree& owner, uint32_t workerIndex, const shape_data& shapeData)
-		: traverser_common<Synchronized> (owner, workerIndex)
+	traverser_add(parallel_octree& owner, worker& currentWorker, const shape_data& shapeData)
+		: traverser_common<Synchronized> (owner, currentWorker)
 		, _shapeData (shapeData)
 		, _sizeLog (owner._sizeLog)
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+		, _leaves (touched_leaves(shapeData.AABB))
+#endif
 	{
 	}
 
-	void traverse(const aabb& aabbNode, uint32_t depth, node& currentNode)
+	void traverse(const aabb& aabbRoot, node& root)
 	{
-		if (depth == _sizeLog)
-			[[unlikely]]
-		{
-			traverser_common<Synchronized>::add_item(static_cast<leaf&>(currentNode), _shapeData.Index);
-			return;
-		}
-
-		tree& currentTree = static_cast<tree&>(currentNode);
-		const point centre = calculate_centre(aabbNode);
-
-		depth += 1;
-
-		traverse(aabb_0(aabbNode, centre), depth, currentTree, 0);
-		traverse(aabb_1(aabbNode, centre), depth, currentTree, 1);
-		traverse(aabb_2(aabbNode, centre), depth, currentTree, 2);
-		traverse(aabb_3(aabbNode, centre), depth, currentTree, 3);
-		traverse(aabb_4(aabbNode, centre), depth, currentTree, 4);
-		traverse(aabb_5(aabbNode, centre), depth, currentTree, 5);
-		traverse(aabb_6(aabbNode, centre), depth, currentTree, 6);
-		traverse(aabb_7(aabbNode, centre), depth, currentTree, 7);
+		dispatch_size_log(_sizeLog, [&](auto sizeLog) { traverse<decltype(sizeLog)::value>(aabbRoot, root); });
 	}
 
 private:
-	void traverse(const aabb& aabbNode, uint32_t depth, tree& currentTree, uint32_t octantIndex)
+	// Levels is the number of levels below the node, so the leaf is known at compile time
+	template <uint32_t Levels>
+	void traverse(const aabb& aabbNode, node& currentNode)
 	{
-		if (are_intersected(_shapeData, aabbNode))
-			[[unlikely]]
+		if constexpr (Levels == 0)
+		{
+			traverser_common<Synchronized>::add_item(static_cast<leaf&>(currentNode), traverser_common<Synchronized>::leaf_cell(aabbNode), _shapeData);
+		}
+		else
 		{
-			traverse(aabbNode, depth, *traverser_common<Synchronized>::add_octant(_sizeLog, depth, currentTree, octantIndex));
+			tree& currentTree = static_cast<tree&>(currentNode);
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+			traverser_common<Synchronized>::add_live_count(currentTree, touched_leaves_count(_leaves, aabbNode));
+#endif
+
+			aabb octants[8];
+			split_aabb(aabbNode, octants);
+
+			uint32_t mask = intersected_octants(_shapeData.AABB, octants);
+			prefetch_children(currentTree, mask);
+
+			for (; mask != 0; mask &= mask - 1)
+			{
+				const uint32_t octantIndex = uint32_t(std::countr_zero(mask));
+				traverse<Levels - 1>(octants[octantIndex], *traverser_common<Synchronized>::add_octant(Levels > 1, currentTree, octantIndex));
+			}
 		}
 	}
 };
@@ -289,420 +842,2295 @@ class parallel_octree::traverser_remove final : private traverser_common<Synchro
 private:
 	shape_data _shapeData;
 	uint32_t _sizeLog;
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+	aabb _leaves;
+#endif
 
 public:
-	traverser_remove(parallel_octree& owner, uint32_t workerIndex, const shape_data& shapeData)
-		: traverser_common<Synchronized> (owner, workerIndex)
+	using traverser_common<Synchronized>::tombstones_count;
+
+	traverser_remove(parallel_octree& owner, worker& currentWorker, const shape_data& shapeData)
+		: traverser_common<Synchronized> (owner, currentWorker)
 		, _shapeData (shapeData)
 		, _sizeLog (owner._sizeLog)
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+		, _leaves (touched_leaves(shapeData.AABB))
+#endif
 	{
 	}
 
-	bool traverse(const aabb& aabbNode, uint32_t depth, node& currentNode)
+	void traverse(const aabb& aabbRoot, node& root)
 	{
-		if (depth == _sizeLog)
-			[[unlikely]]
+		dispatch_size_log(_sizeLog, [&](auto sizeLog) { traverse<decltype(sizeLog)::value>(aabbRoot, root); });
+	}
+
+private:
+	template <uint32_t Levels>
+	uint32_t traverse(const aabb& aabbNode, node& currentNode)
+	{
+		if constexpr (Levels == 0)
 		{
-			traverser_common<Synchronized>::remove_item(static_cast<leaf&>(currentNode), _shapeData.Index, depth);
-			return true;
+			return traverser_common<Synchronized>::remove_item(static_cast<leaf&>(currentNode), traverser_common<Synchronized>::leaf_cell(aabbNode), _shapeData.Index);
 		}
+		else
+		{
+			tree& currentTree = static_cast<tree&>(currentNode);
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+			traverser_common<Synchronized>::add_live_count(currentTree, 0u - touched_leaves_count(_leaves, aabbNode));
+#endif
 
-		tree& currentTree = static_cast<tree&>(currentNode);
-		const point centre = calculate_centre(aabbNode);
+			aabb octants[8];
+			split_aabb(aabbNode, octants);
 
-		depth += 1;
+			uint32_t mask = intersected_octants(_shapeData.AABB, octants);
+			prefetch_children(currentTree, mask);
+
+			uint32_t dirtyCount = 0;
+
+			for (; mask != 0; mask &= mask - 1)
+			{
+				const uint32_t octantIndex = uint32_t(std::countr_zero(mask));
+				node* const child = currentTree.Children[octantIndex].get();
+				assert(child);
+
+				// Never false for shapes which were added, the check keeps release builds from following a null child
+				if (child)
+					[[likely]]
+				{
+					dirtyCount += traverse<Levels - 1>(octants[octantIndex], *child);
+				}
+			}
+
+			if (dirtyCount != 0)
+			{
+				const uint32_t depth = _sizeLog - Levels;
+				traverser_common<Synchronized>::set_gc_hint(currentTree.GCHint, depth);
+				traverser_common<Synchronized>::add_dirty_count(currentTree, depth, dirtyCount);
+			}
+
+			return dirtyCount;
+		}
+	}
+};
 
-		bool markForGC = false;
+template <bool Synchronized>
+class parallel_octree::traverser_move final : private traverser_common<Synchronized>
+{
+private:
+	shape_move _shapeMove;
+	uint32_t _sizeLog;
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+	aabb _leavesOld, _leavesNew;
+#endif
+
+public:
+	using traverser_common<Synchronized>::tombstones_count;
 
-		markForGC |= traverse(aabb_0(aabbNode, centre), depth, currentTree, 0);
-		markForGC |= traverse(aabb_1(aabbNode, centre), depth, currentTree, 1);
-		markForGC |= traverse(aabb_2(aabbNode, centre), depth, currentTree, 2);
-		markForGC |= traverse(aabb_3(aabbNode, centre), depth, currentTree, 3);
-		markForGC |= traverse(aabb_4(aabbNode, centre), depth, currentTree, 4);
-		markForGC |= traverse(aabb_5(aabbNode, centre), depth, currentTree, 5);
-		markForGC |= traverse(aabb_6(aabbNode, centre), depth, currentTree, 6);
-		markForGC |= traverse(aabb_7(aabbNode, centre), depth, currentTree, 7);
+	traverser_move(parallel_octree& owner, worker& currentWorker, const shape_move& shapeMove)
+		: traverser_common<Synchronized> (owner, currentWorker)
+		, _shapeMove (shapeMove)
+		, _sizeLog (owner._sizeLog)
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+		, _leavesOld (touched_leaves(shapeMove.aabbOld))
+		, _leavesNew (touched_leaves(shapeMove.aabbNew))
+#endif
+	{
+	}
+
+	void traverse(const aabb& aabbRoot, node& root)
+	{
+		const bool intersectsOld = are_intersected(_shapeMove.aabbOld, aabbRoot);
+		const bool intersectsNew = are_intersected(_shapeMove.aabbNew, aabbRoot);
+
+		dispatch_size_log(_sizeLog, [&](auto sizeLog) { traverse<decltype(sizeLog)::value>(aabbRoot, root, intersectsOld, intersectsNew); });
+	}
 
-		if (markForGC)
+private:
+	template <uint32_t Levels>
+	uint32_t traverse(const aabb& aabbNode, node& currentNode, bool intersectsOld, bool intersectsNew)
+	{
+		if constexpr (Levels == 0)
 		{
-			traverser_common<Synchronized>::set_gc_hint(currentTree.GCHint, depth - 1);
+			if (intersectsOld && !intersectsNew)
+			{
+				return traverser_common<Synchronized>::remove_item(static_cast<leaf&>(currentNode), traverser_common<Synchronized>::leaf_cell(aabbNode), _shapeMove.Index);
+			}
+			else if (intersectsNew && !intersectsOld)
+			{
+				traverser_common<Synchronized>::add_item(static_cast<leaf&>(currentNode), traverser_common<Synchronized>::leaf_cell(aabbNode), _shapeMove);
+			}
+			return 0;
 		}
+		else
+		{
+			tree& currentTree = static_cast<tree&>(currentNode);
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+			traverser_common<Synchronized>::add_live_count(currentTree, touched_leaves_count(_leavesNew, aabbNode) - touched_leaves_count(_leavesOld, aabbNode));
+#endif
+
+			aabb octants[8];
+			split_aabb(aabbNode, octants);
+
+			const uint32_t maskOld = intersected_octants(_shapeMove.aabbOld, octants);
+			const uint32_t maskNew = intersected_octants(_shapeMove.aabbNew, octants);
+			prefetch_children(currentTree, maskOld | maskNew);
+
+			uint32_t dirtyCount = 0;
+
+			for (uint32_t mask = maskOld | maskNew; mask != 0; mask &= mask - 1)
+			{
+				const uint32_t octantIndex = uint32_t(std::countr_zero(mask));
+
+				dirtyCount += traverse<Levels - 1>(
+					octants[octantIndex],
+					*traverser_common<Synchronized>::add_octant(Levels > 1, currentTree, octantIndex),
+					((maskOld >> octantIndex) & 1) != 0,
+					((maskNew >> octantIndex) & 1) != 0
+					);
+			}
 
-		return markForGC;
+			if (dirtyCount != 0)
+			{
+				const uint32_t depth = _sizeLog - Levels;
+				traverser_common<Synchronized>::set_gc_hint(currentTree.GCHint, depth);
+				traverser_common<Synchronized>::add_dirty_count(currentTree, depth, dirtyCount);
+			}
+
+			return dirtyCount;
+		}
 	}
+};
 
+template <bool Synchronized>
+class parallel_octree::traverser_add_batch final : private traverser_common<Synchronized>
+{
 private:
-	bool traverse(const aabb& aabbNode, uint32_t depth, tree& currentTree, uint32_t octantIndex)
+	std::span<const shape_data> _shapes;
+	uint32_t _sizeLog;
+	std::vector<batch_node>& _level;
+	std::vector<batch_node>& _nextLevel;
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+	// Of the shapes of the current group
+	aabb _leaves[BATCH_GROUP_SIZE];
+#endif
+
+public:
+	traverser_add_batch(parallel_octree& owner, worker& currentWorker, std::span<const shape_data> shapes)
+		: traverser_common<Synchronized> (owner, currentWorker)
+		, _shapes (shapes)
+		, _sizeLog (owner._sizeLog)
+		, _level (currentWorker.BatchLevel)
+		, _nextLevel (currentWorker.BatchNextLevel)
 	{
-		if (are_intersected(_shapeData, aabbNode))
-			[[unlikely]]
+	}
+
+	void traverse(const aabb& aabbRoot, node& root)
+	{
+		for (size_t first = 0; first < _shapes.size(); first += BATCH_GROUP_SIZE)
 		{
-			node* currentNode = currentTree.Children[octantIndex].get();
-			assert(currentNode);
+			traverse_group(aabbRoot, root, uint32_t(first), uint32_t(std::min(first + BATCH_GROUP_SIZE, _shapes.size())));
+		}
+	}
+
+private:
+	// Every level is visited in the order of the shapes, so leaves get their entries in the same order as by single adds
+	void traverse_group(const aabb& aabbRoot, node& root, uint32_t first, uint32_t last)
+	{
+		_level.clear();
+
+		for (uint32_t i = first; i < last; ++i)
+		{
+			_level.push_back({ &root, aabbRoot, i });
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+			_leaves[i - first] = touched_leaves(_shapes[i].AABB);
+#endif
+		}
+
+		for (uint32_t depth = 0; depth < _sizeLog; ++depth)
+		{
+			const bool isTree = depth + 1 < _sizeLog;
+			_nextLevel.clear();
+
+			for (const batch_node& current : _level)
+			{
+				tree& currentTree = static_cast<tree&>(*current.Node);
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+				traverser_common<Synchronized>::add_live_count(currentTree, touched_leaves_count(_leaves[current.Shape - first], current.AABB));
+#endif
+
+				aabb octants[8];
+				split_aabb(current.AABB, octants);
+
+				for (uint32_t mask = intersected_octants(_shapes[current.Shape].AABB, octants); mask != 0; mask &= mask - 1)
+				{
+					const uint32_t octantIndex = uint32_t(std::countr_zero(mask));
+					node* const child = traverser_common<Synchronized>::add_octant(isTree, currentTree, octantIndex);
+
+					PREFETCH(child);
+					_nextLevel.push_back({ child, octants[octantIndex], current.Shape });
+				}
+			}
+
+			_level.swap(_nextLevel);
+		}
 
-			return traverse(aabbNode, depth, *currentNode);
+		for (const batch_node& current : _level)
+		{
+			traverser_common<Synchronized>::add_item(static_cast<leaf&>(*current.Node), traverser_common<Synchronized>::leaf_cell(current.AABB), _shapes[current.Shape]);
 		}
-		return false;
 	}
 };
 
 template <bool Synchronized>
-class parallel_octree::traverser_move final : private traverser_common<Synchronized>
+class parallel_octree::traverser_point final : private traverser_common<Synchronized>
 {
 private:
-	shape_move _shapeMove;
+	node& _root;
 	uint32_t _sizeLog;
 
 public:
-	traverser_move(parallel_octree& owner, uint32_t workerIndex, const shape_move& shapeMove)
-		: traverser_common<Synchronized> (owner, workerIndex)
-		, _shapeMove (shapeMove)
+	using traverser_common<Synchronized>::tombstones_count;
+
+	traverser_point(parallel_octree& owner, worker& currentWorker)
+		: traverser_common<Synchronized> (owner, currentWorker)
+		, _root (*owner._root)
 		, _sizeLog (owner._sizeLog)
 	{
 	}
 
-	bool traverse(const aabb& aabbNode, uint32_t depth, node& currentNode, bool intersectsOld, bool intersectsNew)
+	template <typename TPoint>
+	void add(const point& pointAdd, const TPoint& pointData)
 	{
-		if (depth == _sizeLog)
+		cell currentCell;
+
+		if (find_cell(pointAdd, currentCell))
+			[[likely]]
+		{
+			add(currentCell, pointData);
+		}
+	}
+
+	void remove(const point& pointRemove, uint32_t index)
+	{
+		cell currentCell;
+
+		if (find_cell(pointRemove, currentCell))
+			[[likely]]
+		{
+			remove(currentCell, index);
+		}
+	}
+
+	void move(const point_move& pointMove)
+	{
+		cell cellOld;
+		cell cellNew;
+
+		const bool hasOld = find_cell(pointMove.pointOld, cellOld);
+		const bool hasNew = find_cell(pointMove.pointNew, cellNew);
+
+		if (hasOld && hasNew && cellOld.X == cellNew.X && cellOld.Y == cellNew.Y && cellOld.Z == cellNew.Z)
+			[[likely]]
+		{
+			return;
+		}
+
+		if (hasOld)
+		{
+			remove(cellOld, pointMove.Index);
+		}
+
+		if (hasNew)
+		{
+			add(cellNew, pointMove);
+		}
+	}
+
+private:
+	// Leaves are unit cells, points outside the field are not stored just like shapes outside it
+	bool find_cell(const point& currentPoint, cell& result) const
+	{
+		const float size = float(1u << _sizeLog);
+
+		if (!(currentPoint.X >= 0.0f && currentPoint.X <= size && currentPoint.Y >= 0.0f && currentPoint.Y <= size && currentPoint.Z >= 0.0f && currentPoint.Z <= size))
 			[[unlikely]]
 		{
-			if (intersectsOld && !intersectsNew)
+			return false;
+		}
+
+		const uint32_t maxCell = (1u << _sizeLog) - 1;
+		result = { std::min(uint32_t(currentPoint.X), maxCell), std::min(uint32_t(currentPoint.Y), maxCell), std::min(uint32_t(currentPoint.Z), maxCell) };
+		return true;
+	}
+
+	// Same numbering as aabb_0 - aabb_7, a child takes the upper half when the coordinate is not below the centre
+	uint32_t octant_index(const cell& currentCell, uint32_t depth) const
+	{
+		const uint32_t shift = _sizeLog - 1 - depth;
+		return ((currentCell.Y >> shift) & 1) | (((currentCell.X >> shift) & 1) << 1) | (((currentCell.Z >> shift) & 1) << 2);
+	}
+
+	template <typename TPoint>
+	void add(const cell& currentCell, const TPoint& pointData)
+	{
+		node* currentNode = &_root;
+
+		for (uint32_t depth = 0; depth < _sizeLog; ++depth)
+		{
+			tree& currentTree = static_cast<tree&>(*currentNode);
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+			traverser_common<Synchronized>::add_live_count(currentTree, 1);
+#endif
+			currentNode = traverser_common<Synchronized>::add_octant(depth + 1 < _sizeLog, currentTree, octant_index(currentCell, depth));
+		}
+
+		traverser_common<Synchronized>::add_item(static_cast<leaf&>(*currentNode), currentCell, pointData);
+	}
+
+	void remove(const cell& currentCell, uint32_t index)
+	{
+		node* currentNode = &_root;
+
+		for (uint32_t depth = 0; depth < _sizeLog; ++depth)
+		{
+			currentNode = static_cast<tree&>(*currentNode).Children[octant_index(currentCell, depth)].get();
+			assert(currentNode);
+
+			// Never null for points which were added, the check keeps release builds from following a null child
+			if (!currentNode)
+				[[unlikely]]
 			{
-				traverser_common<Synchronized>::remove_item(static_cast<leaf&>(currentNode), _shapeMove.Index, depth);
-				return true;
+				return;
 			}
-			else if (intersectsNew && !intersectsOld)
+		}
+
+		const uint32_t dirtyCount = traverser_common<Synchronized>::remove_item(static_cast<leaf&>(*currentNode), currentCell, index);
+
+#ifndef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+		if (dirtyCount == 0)
+		{
+			return;
+		}
+#endif
+
+		// Counts are updated by a second walk once the leaf is found, its nodes are still in the cache
+		currentNode = &_root;
+
+		for (uint32_t depth = 0; depth < _sizeLog; ++depth)
+		{
+			tree& currentTree = static_cast<tree&>(*currentNode);
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+			traverser_common<Synchronized>::add_live_count(currentTree, 0u - 1u);
+#endif
+
+			if (dirtyCount != 0)
 			{
-				traverser_common<Synchronized>::add_item(static_cast<leaf&>(currentNode), _shapeMove.Index);
-				return false;
+				traverser_common<Synchronized>::set_gc_hint(currentTree.GCHint, depth);
+				traverser_common<Synchronized>::add_dirty_count(currentTree, depth, dirtyCount);
 			}
+
+			currentNode = currentTree.Children[octant_index(currentCell, depth)].get();
 		}
+	}
+};
 
-		tree& currentTree = static_cast<tree&>(currentNode);
-		const point centre = calculate_centre(aabbNode);
+class parallel_octree::traverser_gc_roots final
+{
+private:
+	uint32_t _depth;
+	uint32_t _targetWork;
+	std::pmr::vector<gc_root>& _roots;
 
-		depth += 1;
+public:
+	traverser_gc_roots(uint32_t depth, uint32_t targetWork, std::pmr::vector<gc_root>& roots)
+		: _depth (depth)
+		, _targetWork (targetWork)
+		, _roots (roots)
+	{
+	}
 
-		bool markForGC = false;
+	void traverse(node& currentNode, uint32_t depth, const cell& currentCell)
+	{
+		tree& currentTree = static_cast<tree&>(currentNode);
 
-		markForGC |= traverse(aabb_0(aabbNode, centre), depth, currentTree, 0);
-		markForGC |= traverse(aabb_1(aabbNode, centre), depth, currentTree, 1);
-		markForGC |= traverse(aabb_2(aabbNode, centre), depth, currentTree, 2);
-		markForGC |= traverse(aabb_3(aabbNode, centre), depth, currentTree, 3);
-		markForGC |= traverse(aabb_4(aabbNode, centre), depth, currentTree, 4);
-		markForGC |= traverse(aabb_5(aabbNode, centre), depth, currentTree, 5);
-		markForGC |= traverse(aabb_6(aabbNode, centre), depth, currentTree, 6);
-		markForGC |= traverse(aabb_7(aabbNode, centre), depth, currentTree, 7);
+		if (currentTree.GCHint == 0)
+			[[likely]]
+		{
+			return;
+		}
 
-		if (markForGC)
+		if (depth == _depth || (depth > 0 && currentTree.DirtyCount <= _targetWork))
+			[[unlikely]]
 		{
-			traverser_common<Synchronized>::set_gc_hint(currentTree.GCHint, depth - 1);
+			_roots.emplace_back(gc_root{ currentTree, currentTree.DirtyCount, depth, currentCell });
+			return;
 		}
 
-		return markForGC;
+		split(currentTree, depth, currentCell);
+	}
+
+	void split(tree& currentTree, uint32_t depth, const cell& currentCell)
+	{
+		currentTree.GCHint = 0;
+		currentTree.DirtyCount = 0;
+		depth += 1;
+
+		for (uint32_t i = 0; i < std::size(currentTree.Children); ++i)
+		{
+			if (node* const child = currentTree.Children[i].get())
+			{
+				// Bits of the octant index as in traverser_point::octant_index
+				const cell childCell{ currentCell.X << 1 | (i >> 1 & 1), currentCell.Y << 1 | (i & 1), currentCell.Z << 1 | (i >> 2 & 1) };
+				traverse(*child, depth, childCell);
+			}
+		}
 	}
+};
 
+class parallel_octree::traverser_gc final
+{
 private:
-	bool traverse(const aabb& aabbNode, uint32_t depth, tree& currentTree, uint32_t octantIndex)
+	std::pmr::vector<chunk_pool<false>>& _pools;
+	chunk_pool<false> _pool;
+	uint32_t _sizeLog;
+	uint32_t _count;
+	uint32_t _visitedCount;
+	size_t _recycledCount;
+
+public:
+	traverser_gc(parallel_octree& owner, std::pmr::vector<chunk_pool<false>>& pools)
+		: _pools (pools)
+		, _sizeLog (owner._sizeLog)
+		, _count (0)
+		, _visitedCount (0)
+		, _recycledCount (0)
+	{
+	}
+
+	uint32_t visited_count() const
+	{
+		return _visitedCount;
+	}
+
+	bool traverse(node& currentNode, uint32_t depth)
 	{
-		const bool intersectsOld = are_intersected(_shapeMove.aabbOld, aabbNode);
-		const bool intersectsNew = are_intersected(_shapeMove.aabbNew, aabbNode);
+		++_visitedCount;
 
-		if (intersectsOld || intersectsNew)
+		if (depth == _sizeLog)
 			[[unlikely]]
 		{
-			return traverse(
-				aabbNode, depth,
-				*traverser_common<Synchronized>::add_octant(_sizeLog, depth, currentTree, octantIndex),
-				intersectsOld, intersectsNew
-				);
+			leaf& currentLeaf = static_cast<leaf&>(currentNode);
+			if (currentLeaf.GCHint == 0)
+			{
+				return false;
+			}
+			return process_leaf(currentLeaf);
+		}
+
+		tree& currentTree = static_cast<tree&>(currentNode);
+
+		if (currentTree.GCHint == 0)
+		{
+			return false;
+		}
+
+		depth += 1;
+		currentTree.GCHint = 0;
+		currentTree.DirtyCount = 0;
+		bool needGC = true;
+
+		for (size_t i = 0; i < std::size(currentTree.Children); ++i)
+		{
+			relative_ptr<node>& childPtr = currentTree.Children[i];
+
+			if (node* const child = childPtr.get())
+				[[unlikely]]
+			{
+				if (!traverse(*child, depth))
+					[[likely]]
+				{
+					needGC = false;
+					continue;
+				}
+
+				childPtr = nullptr;
+
+				if (depth == _sizeLog)
+				{
+					recycle(*static_cast<leaf*>(child));
+				}
+				else
+				{
+					recycle(*static_cast<tree*>(child));
+				}
+			}
 		}
-		return false;
+
+		return needGC;
 	}
-};
 
-class parallel_octree::traverser_gc_roots final
+	// Children of a split root are collected as roots of their own, which cannot unlink themselves
+	void unlink_empty_children(tree& currentTree)
+	{
+		for (relative_ptr<node>& childPtr : currentTree.Children)
+		{
+			tree* const child = static_cast<tree*>(childPtr.get());
+
+			if (child && std::none_of(std::begin(child->Children), std::end(child->Children), [](const relative_ptr<node>& grandChild) { return grandChild.get() != nullptr; }))
+			{
+				childPtr = nullptr;
+				recycle(*child);
+			}
+		}
+	}
+
+	void finalize(parallel_octree& owner)
+	{
+		if (_count > 0)
+		{
+			_pools.emplace_back(std::move(_pool));
+			_count = 0;
+		}
+		if (_pools.size() > 0)
+		{
+			owner._allocator.add_pools(std::move(_pools), _recycledCount);
+			_recycledCount = 0;
+			assert(_pools.size() == 0);
+		}
+	}
+
+private:
+	bool process_leaf(leaf& currentLeaf)
+	{
+		currentLeaf.compact([this](leaf_extension& extension) { recycle(extension); });
+		return currentLeaf.Count == 0;
+	}
+
+	template <typename TNode>
+	void recycle(TNode& currentNode)
+	{
+		if (_count == octree_allocator<>::ARRAY_SIZE)
+		{
+			_pools.emplace_back(std::move(_pool));
+			assert(_pool.is_empty());
+			_count = 0;
+		}
+
+		++_count;
+		++_recycledCount;
+		_pool.add<false>(currentNode);
+	}
+};
+
+template <uint32_t Levels>
+bool parallel_octree::is_empty([[maybe_unused]] const node& currentNode)
+{
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+	if constexpr (Levels > 0)
+	{
+		return static_cast<const tree&>(currentNode).LiveCount == 0;
+	}
+#endif
+	return false;
+}
+
+class parallel_octree::traverser_query final
+{
+private:
+	aabb _aabb;
+	uint32_t _tagMask;
+	// Untagged queries take entries with tag 0 as well
+	bool _isFiltered;
+	uint32_t _sizeLog;
+	std::pmr::vector<uint32_t>& _result;
+
+public:
+	traverser_query(const parallel_octree& owner, const aabb& aabbQuery, std::pmr::vector<uint32_t>& result)
+		: _aabb (aabbQuery)
+		, _tagMask (0)
+		, _isFiltered (false)
+		, _sizeLog (owner._sizeLog)
+		, _result (result)
+	{
+	}
+
+	traverser_query(const parallel_octree& owner, const aabb& aabbQuery, uint32_t tagMask, std::pmr::vector<uint32_t>& result)
+		: _aabb (aabbQuery)
+		, _tagMask (tagMask)
+		, _isFiltered (true)
+		, _sizeLog (owner._sizeLog)
+		, _result (result)
+	{
+	}
+
+	void traverse(const aabb& aabbRoot, const node& root)
+	{
+		dispatch_size_log(_sizeLog, [&](auto sizeLog) { traverse<decltype(sizeLog)::value>(aabbRoot, root); });
+	}
+
+private:
+	template <uint32_t Levels>
+	void traverse(const aabb& aabbNode, const node& currentNode)
+	{
+		if constexpr (Levels == 0)
+		{
+			static_cast<const leaf&>(currentNode).for_each_entry(
+				[this](const auto& chunk, uint32_t position)
+				{
+					if (!_isFiltered || has_tag(chunk, position, _tagMask))
+					{
+						_result.push_back(chunk.Indices[position]);
+					}
+				});
+		}
+		else
+		{
+			const tree& currentTree = static_cast<const tree&>(currentNode);
+
+			aabb octants[8];
+			split_aabb(aabbNode, octants);
+
+			uint32_t mask = intersected_octants(_aabb, octants);
+			prefetch_children(currentTree, mask);
+
+			for (; mask != 0; mask &= mask - 1)
+			{
+				const uint32_t octantIndex = uint32_t(std::countr_zero(mask));
+
+				const node* const child = currentTree.Children[octantIndex].get();
+
+				if (child && !is_empty<Levels - 1>(*child))
+				{
+					traverse<Levels - 1>(octants[octantIndex], *child);
+				}
+			}
+		}
+	}
+};
+
+// Descends a group of queries level by level like traverser_add_batch, so the misses on the nodes of one level overlap
+class parallel_octree::traverser_query_batch final
+{
+private:
+	using visit = batch_result::visit;
+
+private:
+	std::span<const aabb> _queries;
+	// Sorted Morton keys above the query indices
+	std::span<const uint64_t> _order;
+	std::pmr::vector<uint32_t>& _indices;
+	batch_result::range* _ranges;
+	uint32_t _sizeLog;
+	std::vector<visit>& _level;
+	std::vector<visit>& _nextLevel;
+	aabb _group[BATCH_GROUP_SIZE];
+
+public:
+	traverser_query_batch(const parallel_octree& owner, batch_result& result, size_t partIndex)
+		: _queries (result._queries)
+		, _order (part_order(result, partIndex))
+		, _indices (partIndex == 0 ? result.Indices : result._parts[partIndex].Indices)
+		, _ranges (result.Ranges.data())
+		, _sizeLog (owner._sizeLog)
+		, _level (result._parts[partIndex].Level)
+		, _nextLevel (result._parts[partIndex].NextLevel)
+	{
+	}
+
+	void traverse(const aabb& aabbRoot, const node& root)
+	{
+		for (size_t first = 0; first < _order.size(); first += BATCH_GROUP_SIZE)
+		{
+			traverse_group(aabbRoot, root, first, std::min(first + BATCH_GROUP_SIZE, _order.size()));
+		}
+	}
+
+private:
+	static std::span<const uint64_t> part_order(const batch_result& result, size_t partIndex)
+	{
+		const size_t begin = std::min(partIndex * result._partSize, result._order.size());
+		const size_t end = std::min(begin + result._partSize, result._order.size());
+		return std::span<const uint64_t>(result._order).subspan(begin, end - begin);
+	}
+
+	// Levels keep the visits of every query together and in the order of the queries
+	void traverse_group(const aabb& aabbRoot, const node& root, size_t first, size_t last)
+	{
+		const uint32_t groupSize = uint32_t(last - first);
+		_level.clear();
+
+		for (uint32_t i = 0; i < groupSize; ++i)
+		{
+			_group[i] = _queries[uint32_t(_order[first + i])];
+			_level.push_back({ &root, aabbRoot, i });
+		}
+
+		for (uint32_t depth = 0; depth < _sizeLog; ++depth)
+		{
+			_nextLevel.clear();
+
+			for (const visit& current : _level)
+			{
+				if (depth > 0 && is_empty<1>(*current.Node))
+				{
+					continue;
+				}
+
+				const tree& currentTree = static_cast<const tree&>(*current.Node);
+
+				aabb octants[8];
+				split_aabb(current.AABB, octants);
+
+				for (uint32_t mask = intersected_octants(_group[current.Query], octants); mask != 0; mask &= mask - 1)
+				{
+					const uint32_t octantIndex = uint32_t(std::countr_zero(mask));
+					const node* const child = currentTree.Children[octantIndex].get();
+
+					if (child)
+					{
+						PREFETCH(child);
+						_nextLevel.push_back({ child, octants[octantIndex], current.Query });
+					}
+				}
+			}
+
+			_level.swap(_nextLevel);
+		}
+
+		size_t visitIndex = 0;
+
+		for (uint32_t i = 0; i < groupSize; ++i)
+		{
+			const size_t begin = _indices.size();
+
+			for (; visitIndex < _level.size() && _level[visitIndex].Query == i; ++visitIndex)
+			{
+				static_cast<const leaf&>(*_level[visitIndex].Node).for_each_entry(
+					[this](const auto& chunk, uint32_t position)
+					{
+						_indices.push_back(chunk.Indices[position]);
+					});
+			}
+
+			std::sort(_indices.begin() + begin, _indices.end());
+			_indices.erase(std::unique(_indices.begin() + begin, _indices.end()), _indices.end());
+
+			_ranges[uint32_t(_order[first + i])] = { begin, _indices.size() };
+		}
+	}
+};
+
+class parallel_octree::traverser_count final
+{
+private:
+	aabb _aabb;
+	uint32_t _sizeLog;
+	size_t _result;
+
+public:
+	traverser_count(const parallel_octree& owner, const aabb& aabbQuery)
+		: _aabb (aabbQuery)
+		, _sizeLog (owner._sizeLog)
+		, _result (0)
+	{
+	}
+
+	size_t traverse(const aabb& aabbRoot, const node& root)
+	{
+		dispatch_size_log(_sizeLog, [&](auto sizeLog) { traverse<decltype(sizeLog)::value>(aabbRoot, root); });
+		return _result;
+	}
+
+private:
+	template <uint32_t Levels>
+	void traverse(const aabb& aabbNode, const node& currentNode)
+	{
+		if constexpr (Levels == 0)
+		{
+			static_cast<const leaf&>(currentNode).for_each_index([this](uint32_t) { ++_result; });
+		}
+		else
+		{
+			const tree& currentTree = static_cast<const tree&>(currentNode);
+
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+			// Every leaf of a node inside the box touches it
+			if (is_inside(aabbNode))
+			{
+				_result += currentTree.LiveCount;
+				return;
+			}
+#endif
+
+			aabb octants[8];
+			split_aabb(aabbNode, octants);
+
+			uint32_t mask = intersected_octants(_aabb, octants);
+			prefetch_children(currentTree, mask);
+
+			for (; mask != 0; mask &= mask - 1)
+			{
+				const uint32_t octantIndex = uint32_t(std::countr_zero(mask));
+				const node* const child = currentTree.Children[octantIndex].get();
+
+				if (child && !is_empty<Levels - 1>(*child))
+				{
+					traverse<Levels - 1>(octants[octantIndex], *child);
+				}
+			}
+		}
+	}
+
+	bool is_inside(const aabb& aabbNode) const
+	{
+		return
+			aabbNode.Min.X >= _aabb.Min.X && aabbNode.Max.X <= _aabb.Max.X &&
+			aabbNode.Min.Y >= _aabb.Min.Y && aabbNode.Max.Y <= _aabb.Max.Y &&
+			aabbNode.Min.Z >= _aabb.Min.Z && aabbNode.Max.Z <= _aabb.Max.Z;
+	}
+};
+
+class parallel_octree::traverser_statistics final
+{
+private:
+	uint32_t _sizeLog;
+	uint32_t _rootsDepth;
+	statistics& _result;
+	std::vector<uint32_t>& _indices;
+	std::vector<const node*>* _roots;
+
+public:
+	// Subtrees at rootsDepth are passed to roots instead of being visited when roots is not null
+	traverser_statistics(const parallel_octree& owner, statistics& result, std::vector<uint32_t>& indices, uint32_t rootsDepth, std::vector<const node*>* roots)
+		: _sizeLog (owner._sizeLog)
+		, _rootsDepth (rootsDepth)
+		, _result (result)
+		, _indices (indices)
+		, _roots (roots)
+	{
+	}
+
+	void traverse(const node& currentNode, uint32_t depth)
+	{
+		if (_roots && depth == _rootsDepth)
+		{
+			_roots->push_back(&currentNode);
+			return;
+		}
+
+		increment(_result.NodesPerLevel, depth);
+
+		if (depth == _sizeLog)
+			[[unlikely]]
+		{
+			visit(static_cast<const leaf&>(currentNode));
+			return;
+		}
+
+		const tree& currentTree = static_cast<const tree&>(currentNode);
+
+		for (const relative_ptr<node>& child : currentTree.Children)
+		{
+			if (const node* const childNode = child.get())
+			{
+				traverse(*childNode, depth + 1);
+			}
+		}
+	}
+
+private:
+	void visit(const leaf& currentLeaf)
+	{
+		uint32_t liveCount = 0;
+		currentLeaf.for_each_index(
+			[this, &liveCount](uint32_t index)
+			{
+				_indices.push_back(index);
+				++liveCount;
+			});
+
+		size_t extensionsCount = 0;
+		for (const leaf_extension* extension = currentLeaf.Next.get(); extension; extension = extension->Next.get())
+		{
+			++extensionsCount;
+		}
+
+		increment(_result.LeafCounts, currentLeaf.Count);
+		increment(_result.ExtensionChainLengths, extensionsCount);
+
+		_result.EntriesCount += currentLeaf.Count;
+		_result.TombstonesCount += currentLeaf.Count - liveCount;
+		_result.LiveBytes += extensionsCount * sizeof(leaf_extension);
+	}
+
+	static void increment(std::vector<size_t>& values, size_t index)
+	{
+		if (values.size() <= index)
+		{
+			values.resize(index + 1);
+		}
+
+		++values[index];
+	}
+};
+
+class parallel_octree::traverser_occupancy final
+{
+public:
+	struct root final
+	{
+		const node* Node;
+		uint64_t Code;
+	};
+
+private:
+	uint32_t _sizeLog;
+	uint32_t _level;
+	uint8_t* _bytes;
+	uint32_t _rootsDepth;
+	std::vector<root>* _roots;
+
+public:
+	// Subtrees at rootsDepth are passed to roots instead of being visited when roots is not null
+	traverser_occupancy(const parallel_octree& owner, uint32_t level, uint8_t* bytes, uint32_t rootsDepth, std::vector<root>* roots)
+		: _sizeLog (owner._sizeLog)
+		, _level (level)
+		, _bytes (bytes)
+		, _rootsDepth (rootsDepth)
+		, _roots (roots)
+	{
+	}
+
+	// Code holds the octant indices of the path, returns whether the subtree has live entries
+	bool traverse(const node& currentNode, uint32_t depth, uint64_t code)
+	{
+		if (_roots && depth == _rootsDepth)
+		{
+			_roots->push_back({ &currentNode, code });
+			return false;
+		}
+
+		if (depth == _sizeLog)
+			[[unlikely]]
+		{
+			bool hasEntries = false;
+			static_cast<const leaf&>(currentNode).for_each_index([&hasEntries](uint32_t) { hasEntries = true; });
+			return hasEntries;
+		}
+
+		const tree& currentTree = static_cast<const tree&>(currentNode);
+
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+		if (depth >= _level || currentTree.LiveCount == 0)
+		{
+			return currentTree.LiveCount != 0;
+		}
+#endif
+
+		// The byte of the children is written once, the subtrees of other bytes are not touched
+		uint32_t mask = 0;
+
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			if (const node* const child = currentTree.Children[i].get())
+			{
+				if (traverse(*child, depth + 1, code << 3 | i))
+				{
+					mask |= 1u << i;
+
+					if (depth >= _level)
+					{
+						return true;
+					}
+				}
+			}
+		}
+
+		if (depth + 1 == _level)
+		{
+			_bytes[code] = uint8_t(mask);
+		}
+
+		return mask != 0;
+	}
+};
+
+class parallel_octree::traverser_relocate final
+{
+private:
+	chunk_allocator<>& _arena;
+	uint32_t _sizeLog;
+
+public:
+	traverser_relocate(parallel_octree& owner, chunk_allocator<>& arena)
+		: _arena (arena)
+		, _sizeLog (owner._sizeLog)
+	{
+	}
+
+	node* relocate_root(node& root)
+	{
+		if (_sizeLog == 0)
+		{
+			return copy_leaf(static_cast<leaf&>(root));
+		}
+
+		tree& newRoot = copy_tree(static_cast<tree&>(root));
+		traverse(static_cast<tree&>(root), newRoot, 0);
+		return &newRoot;
+	}
+
+private:
+	void traverse(tree& sourceTree, tree& destinationTree, uint32_t depth)
+	{
+		depth += 1;
+
+		// Siblings are placed next to each other first, then every child subtree goes right after them
+		for (size_t i = 0; i < std::size(sourceTree.Children); ++i)
+		{
+			if (node* const child = sourceTree.Children[i].get())
+			{
+				destinationTree.Children[i] = depth == _sizeLog
+					? static_cast<node*>(copy_leaf(static_cast<leaf&>(*child)))
+					: static_cast<node*>(&copy_tree(static_cast<tree&>(*child)));
+			}
+		}
+
+		for (size_t i = 0; i < std::size(sourceTree.Children); ++i)
+		{
+			if (node* const child = sourceTree.Children[i].get())
+			{
+				if (depth == _sizeLog)
+				{
+					copy_extensions(static_cast<leaf&>(*child), static_cast<leaf&>(*destinationTree.Children[i].get()));
+				}
+				else
+				{
+					traverse(static_cast<tree&>(*child), static_cast<tree&>(*destinationTree.Children[i].get()), depth);
+				}
+			}
+		}
+	}
+
+	tree& copy_tree(tree& sourceTree)
+	{
+		tree& destinationTree = *_arena.allocate<tree, false>();
+		destinationTree.GCHint = sourceTree.GCHint;
+		destinationTree.DirtyCount = sourceTree.DirtyCount;
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+		destinationTree.LiveCount = sourceTree.LiveCount;
+#endif
+		return destinationTree;
+	}
+
+	// Only live indices are copied, so the leaf stays dirty just when it has to be unlinked by the GC
+	leaf* copy_leaf(leaf& sourceLeaf)
+	{
+		leaf& destinationLeaf = *_arena.allocate<leaf, false>();
+
+		sourceLeaf.for_each_entry([&destinationLeaf](const auto& chunk, uint32_t position)
+		{
+			if (destinationLeaf.Count < LEAF_CAPACITY)
+			{
+				copy_entry(destinationLeaf, destinationLeaf.Count, chunk, position);
+			}
+			++destinationLeaf.Count;
+		});
+
+		destinationLeaf.GCHint = destinationLeaf.Count == 0 ? 1 : 0;
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+		destinationLeaf.DirtyEpoch = sourceLeaf.DirtyEpoch;
+#endif
+		return &destinationLeaf;
+	}
+
+	void copy_extensions(leaf& sourceLeaf, leaf& destinationLeaf)
+	{
+		if (destinationLeaf.Count <= LEAF_CAPACITY)
+			[[likely]]
+		{
+			return;
+		}
+
+		uint32_t offset = 0;
+		uint32_t extensionOffset = LEAF_EXTENSION_CAPACITY;
+		relative_ptr<leaf_extension>* nextPtr = &destinationLeaf.Next;
+		leaf_extension* extension = nullptr;
+
+		sourceLeaf.for_each_entry([&](const auto& chunk, uint32_t position)
+		{
+			if (offset++ < LEAF_CAPACITY)
+			{
+				return;
+			}
+
+			if (extensionOffset == LEAF_EXTENSION_CAPACITY)
+			{
+				extension = _arena.allocate<leaf_extension, false>();
+				*nextPtr = extension;
+				nextPtr = &extension->Next;
+				extensionOffset = 0;
+			}
+
+			copy_entry(*extension, extensionOffset++, chunk, position);
+		});
+	}
+};
+
+parallel_octree::parallel_octree(uint32_t sizeLog, uint32_t bufferSize, uint32_t workersCount)
+	: _allocator (bufferSize, std::max(workersCount, 1u))
+	, _root (sizeLog > 0 ? static_cast<node*>(_allocator.allocate<tree, false>()) : static_cast<node*>(_allocator.allocate<leaf, false>()))
+	, _sizeLog (sizeLog)
+	, _workers (new worker[std::max(workersCount, 1u)])
+	, _workersCount (std::max(workersCount, 1u))
+	, _workerRegistry (std::make_shared<worker_registry>(*this))
+	, _isReadOnly (false)
+	, _originalCapacity (bufferSize)
+	, _recorder (nullptr)
+	, _eventTrace (nullptr)
+	, _tombstonesCount (0)
+{
+	static_assert(sizeof(snapshot_header) == CACHE_LINE_SIZE);
+	static_assert(sizeof(tree) <= CACHE_LINE_SIZE);
+	static_assert(sizeof(leaf) == CACHE_LINE_SIZE);
+	static_assert(sizeof(leaf_extension) == CACHE_LINE_SIZE);
+
+	if (sizeLog > MAX_SIZE_LOG)
+	{
+		throw std::runtime_error("parallel_octree: sizeLog is larger than " + std::to_string(MAX_SIZE_LOG));
+	}
+
+	for (uint32_t i = 0; i < _workersCount; ++i)
+	{
+		_workers[i].LocalPart = &_allocator.get_local_part(i);
+	}
+}
+
+parallel_octree::parallel_octree(const uint8_t* data, size_t size, uint32_t sizeLog, size_t rootOffset, size_t originalCapacity)
+	: _allocator (const_cast<uint8_t*>(data), size, size, 1)
+	, _root (reinterpret_cast<node*>(_allocator.data() + rootOffset))
+	, _sizeLog (sizeLog)
+	, _workers (new worker[1])
+	, _workersCount (1)
+	, _workerRegistry (std::make_shared<worker_registry>(*this))
+	, _isReadOnly (true)
+	, _originalCapacity (std::max(originalCapacity, size))
+	, _recorder (nullptr)
+	, _eventTrace (nullptr)
+	, _tombstonesCount (0)
+{
+	_workers[0].LocalPart = &_allocator.get_local_part(0);
+}
+
+parallel_octree::parallel_octree(uint32_t sizeLog, size_t bufferSize, size_t usedSize, uint32_t workersCount, size_t rootOffset)
+	: _allocator (bufferSize, usedSize, workersCount)
+	, _root (reinterpret_cast<node*>(_allocator.data() + rootOffset))
+	, _sizeLog (sizeLog)
+	, _workers (new worker[workersCount])
+	, _workersCount (workersCount)
+	, _workerRegistry (std::make_shared<worker_registry>(*this))
+	, _isReadOnly (false)
+	, _originalCapacity (bufferSize)
+	, _recorder (nullptr)
+	, _eventTrace (nullptr)
+	, _tombstonesCount (0)
+{
+	for (uint32_t i = 0; i < _workersCount; ++i)
+	{
+		_workers[i].LocalPart = &_allocator.get_local_part(i);
+	}
+}
+
+std::unique_ptr<parallel_octree> parallel_octree::open_mapped(const std::filesystem::path& path)
+{
+	std::unique_ptr<mapped_file> file = std::make_unique<mapped_file>(path);
+
+	snapshot_header header;
+
+	if (file->size() < sizeof(header))
+	{
+		throw std::runtime_error("parallel_octree: " + path.string() + " is not an octree snapshot");
+	}
+
+	std::memcpy(&header, file->data(), sizeof(header));
+
+	if (header.Magic != snapshot_header::MAGIC)
+	{
+		throw std::runtime_error("parallel_octree: " + path.string() + " is not an octree snapshot");
+	}
+
+	if (header.Version != snapshot_header::VERSION || header.LeafCapacity != leaf_capacity() || header.LayoutFlags != layout_flags() || header.SizeLog > MAX_SIZE_LOG)
+	{
+		throw std::runtime_error("parallel_octree: " + path.string() + " has an incompatible format");
+	}
+
+	if (header.UsedSize > file->size() - sizeof(header) || header.RootOffset + CACHE_LINE_SIZE > header.UsedSize)
+	{
+		throw std::runtime_error("parallel_octree: " + path.string() + " is truncated");
+	}
+
+	std::unique_ptr<parallel_octree> octree(
+		new parallel_octree(file->data() + sizeof(header), size_t(header.UsedSize), header.SizeLog, size_t(header.RootOffset), size_t(header.Capacity))
+		);
+	octree->_mappedFile = std::move(file);
+
+	return octree;
+}
+
+void parallel_octree::save(const std::filesystem::path& path) const
+{
+	snapshot_header header = {};
+	header.Magic = snapshot_header::MAGIC;
+	header.Version = snapshot_header::VERSION;
+	header.SizeLog = _sizeLog;
+	header.LeafCapacity = leaf_capacity();
+	header.LayoutFlags = layout_flags();
+	header.RootOffset = uint64_t(reinterpret_cast<const uint8_t*>(_root) - _allocator.data());
+	header.UsedSize = _allocator.used_size();
+	header.Capacity = _originalCapacity;
+
+	std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+
+	if (!stream)
+	{
+		throw std::runtime_error("parallel_octree: cannot open " + path.string());
+	}
+
+	stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	stream.write(reinterpret_cast<const char*>(_allocator.data()), std::streamsize(header.UsedSize));
+
+	if (!stream)
+	{
+		throw std::runtime_error("parallel_octree: cannot write " + path.string());
+	}
+}
+
+parallel_octree::~parallel_octree()
+{
+	const std::lock_guard<std::mutex> guard(_workerRegistry->Mutex);
+	_workerRegistry->Owner = nullptr;
+}
+
+void parallel_octree::add_synchronized(const shape_data& shapeData, uint32_t workerIndex)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::add_synchronized, workerIndex, shapeData);
+	}
+
+	worker& currentWorker = get_worker(workerIndex);
+	LATENCY_SCOPE(false, currentWorker.Latency.Add);
+
+	traverser_add<true>(*this, currentWorker, shapeData).traverse(initial_aabb(), *_root);
+}
+
+void parallel_octree::remove_synchronized(const shape_data& shapeData, uint32_t workerIndex)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::remove_synchronized, workerIndex, shapeData);
+	}
+
+	worker& currentWorker = get_worker(workerIndex);
+	LATENCY_SCOPE(false, currentWorker.Latency.Remove);
+
+	traverser_remove<true> traverser(*this, currentWorker, shapeData);
+	traverser.traverse(initial_aabb(), *_root);
+	add_tombstones<true>(traverser.tombstones_count());
+}
+
+void parallel_octree::move_synchronized(const shape_move& shapeMove, uint32_t workerIndex)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::move_synchronized, workerIndex, shapeMove);
+	}
+
+	worker& currentWorker = get_worker(workerIndex);
+	LATENCY_SCOPE(false, currentWorker.Latency.Move);
+
+	traverser_move<true> traverser(*this, currentWorker, shapeMove);
+	traverser.traverse(initial_aabb(), *_root);
+	add_tombstones<true>(traverser.tombstones_count());
+}
+
+void parallel_octree::add_synchronized(const shape_data& shapeData)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::add_synchronized, InvalidIndex, shapeData);
+	}
+
+	worker& currentWorker = get_thread_worker();
+	LATENCY_SCOPE(false, currentWorker.Latency.Add);
+
+	traverser_add<true>(*this, currentWorker, shapeData).traverse(initial_aabb(), *_root);
+}
+
+void parallel_octree::remove_synchronized(const shape_data& shapeData)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::remove_synchronized, InvalidIndex, shapeData);
+	}
+
+	worker& currentWorker = get_thread_worker();
+	LATENCY_SCOPE(false, currentWorker.Latency.Remove);
+
+	traverser_remove<true> traverser(*this, currentWorker, shapeData);
+	traverser.traverse(initial_aabb(), *_root);
+	add_tombstones<true>(traverser.tombstones_count());
+}
+
+void parallel_octree::move_synchronized(const shape_move& shapeMove)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::move_synchronized, InvalidIndex, shapeMove);
+	}
+
+	worker& currentWorker = get_thread_worker();
+	LATENCY_SCOPE(false, currentWorker.Latency.Move);
+
+	traverser_move<true> traverser(*this, currentWorker, shapeMove);
+	traverser.traverse(initial_aabb(), *_root);
+	add_tombstones<true>(traverser.tombstones_count());
+}
+
+void parallel_octree::add_exclusive(const shape_data& shapeData)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::add_exclusive, 0, shapeData);
+	}
+
+	traverser_add<false>(*this, get_worker(0), shapeData).traverse(initial_aabb(), *_root);
+}
+
+void parallel_octree::remove_exclusive(const shape_data& shapeData)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::remove_exclusive, 0, shapeData);
+	}
+
+	traverser_remove<false> traverser(*this, get_worker(0), shapeData);
+	traverser.traverse(initial_aabb(), *_root);
+	add_tombstones<false>(traverser.tombstones_count());
+}
+
+void parallel_octree::move_exclusive(const shape_move& shapeMove)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::move_exclusive, 0, shapeMove);
+	}
+
+	traverser_move<false> traverser(*this, get_worker(0), shapeMove);
+	traverser.traverse(initial_aabb(), *_root);
+	add_tombstones<false>(traverser.tombstones_count());
+}
+
+void parallel_octree::add_batch_synchronized(std::span<const shape_data> shapes, uint32_t workerIndex)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		for (const shape_data& shapeData : shapes)
+		{
+			_recorder->record(operation_type::add_synchronized, workerIndex, shapeData);
+		}
+	}
+
+	worker& currentWorker = get_worker(workerIndex);
+	LATENCY_SCOPE(false, currentWorker.Latency.AddBatch);
+	const event_trace::scope traceScope(_eventTrace, "add_batch");
+
+	traverser_add_batch<true>(*this, currentWorker, shapes).traverse(initial_aabb(), *_root);
+}
+
+void parallel_octree::add_batch_synchronized(std::span<const shape_data> shapes)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		for (const shape_data& shapeData : shapes)
+		{
+			_recorder->record(operation_type::add_synchronized, InvalidIndex, shapeData);
+		}
+	}
+
+	worker& currentWorker = get_thread_worker();
+	LATENCY_SCOPE(false, currentWorker.Latency.AddBatch);
+	const event_trace::scope traceScope(_eventTrace, "add_batch");
+
+	traverser_add_batch<true>(*this, currentWorker, shapes).traverse(initial_aabb(), *_root);
+}
+
+void parallel_octree::add_batch_exclusive(std::span<const shape_data> shapes)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		for (const shape_data& shapeData : shapes)
+		{
+			_recorder->record(operation_type::add_exclusive, 0, shapeData);
+		}
+	}
+
+	worker& currentWorker = get_worker(0);
+	LATENCY_SCOPE(false, currentWorker.Latency.AddBatch);
+	const event_trace::scope traceScope(_eventTrace, "add_batch");
+
+	traverser_add_batch<false>(*this, currentWorker, shapes).traverse(initial_aabb(), *_root);
+}
+
+void parallel_octree::add_point_synchronized(const point_data& pointData, uint32_t workerIndex)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::add_point_synchronized, workerIndex, pointData);
+	}
+
+	worker& currentWorker = get_worker(workerIndex);
+	LATENCY_SCOPE(false, currentWorker.Latency.Add);
+
+	traverser_point<true>(*this, currentWorker).add(pointData.Point, pointData);
+}
+
+void parallel_octree::remove_point_synchronized(const point_data& pointData, uint32_t workerIndex)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::remove_point_synchronized, workerIndex, pointData);
+	}
+
+	worker& currentWorker = get_worker(workerIndex);
+	LATENCY_SCOPE(false, currentWorker.Latency.Remove);
+
+	traverser_point<true> traverser(*this, currentWorker);
+	traverser.remove(pointData.Point, pointData.Index);
+	add_tombstones<true>(traverser.tombstones_count());
+}
+
+void parallel_octree::move_point_synchronized(const point_move& pointMove, uint32_t workerIndex)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::move_point_synchronized, workerIndex, pointMove);
+	}
+
+	worker& currentWorker = get_worker(workerIndex);
+	LATENCY_SCOPE(false, currentWorker.Latency.Move);
+
+	traverser_point<true> traverser(*this, currentWorker);
+	traverser.move(pointMove);
+	add_tombstones<true>(traverser.tombstones_count());
+}
+
+void parallel_octree::add_point_synchronized(const point_data& pointData)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::add_point_synchronized, InvalidIndex, pointData);
+	}
+
+	worker& currentWorker = get_thread_worker();
+	LATENCY_SCOPE(false, currentWorker.Latency.Add);
+
+	traverser_point<true>(*this, currentWorker).add(pointData.Point, pointData);
+}
+
+void parallel_octree::remove_point_synchronized(const point_data& pointData)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::remove_point_synchronized, InvalidIndex, pointData);
+	}
+
+	worker& currentWorker = get_thread_worker();
+	LATENCY_SCOPE(false, currentWorker.Latency.Remove);
+
+	traverser_point<true> traverser(*this, currentWorker);
+	traverser.remove(pointData.Point, pointData.Index);
+	add_tombstones<true>(traverser.tombstones_count());
+}
+
+void parallel_octree::move_point_synchronized(const point_move& pointMove)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::move_point_synchronized, InvalidIndex, pointMove);
+	}
+
+	worker& currentWorker = get_thread_worker();
+	LATENCY_SCOPE(false, currentWorker.Latency.Move);
+
+	traverser_point<true> traverser(*this, currentWorker);
+	traverser.move(pointMove);
+	add_tombstones<true>(traverser.tombstones_count());
+}
+
+void parallel_octree::add_point_exclusive(const point_data& pointData)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::add_point_exclusive, 0, pointData);
+	}
+
+	traverser_point<false>(*this, get_worker(0)).add(pointData.Point, pointData);
+}
+
+void parallel_octree::remove_point_exclusive(const point_data& pointData)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::remove_point_exclusive, 0, pointData);
+	}
+
+	traverser_point<false> traverser(*this, get_worker(0));
+	traverser.remove(pointData.Point, pointData.Index);
+	add_tombstones<false>(traverser.tombstones_count());
+}
+
+void parallel_octree::move_point_exclusive(const point_move& pointMove)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::move_point_exclusive, 0, pointMove);
+	}
+
+	traverser_point<false> traverser(*this, get_worker(0));
+	traverser.move(pointMove);
+	add_tombstones<false>(traverser.tombstones_count());
+}
+
+void parallel_octree::prepare_garbage_collection(std::pmr::vector<gc_root>& roots, uint32_t depth)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record_prepare_gc(depth, 0);
+	}
+
+	const event_trace::scope traceScope(_eventTrace, "gc_roots");
+
+	assert(depth < _sizeLog);
+	_allocator.prepare_gc();
+	_tombstonesCount = 0;
+	roots.clear();
+	traverser_gc_roots(depth, 0, roots).traverse(*_root, 0, {});
+}
+
+void parallel_octree::prepare_garbage_collection(std::pmr::vector<gc_root>& roots, uint32_t depth, uint32_t targetWork)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record_prepare_gc(depth, targetWork);
+	}
+
+	const event_trace::scope traceScope(_eventTrace, "gc_roots");
+
+	assert(depth < _sizeLog);
+	_allocator.prepare_gc();
+	_tombstonesCount = 0;
+	roots.clear();
+	traverser_gc_roots(depth, targetWork, roots).traverse(*_root, 0, {});
+}
+
+void parallel_octree::resume_garbage_collection()
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record(operation_type::resume_gc);
+	}
+
+	_allocator.prepare_gc();
+}
+
+uint32_t parallel_octree::collect_garbage(gc_root root)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record_gc_root(operation_type::collect_gc, root, 0);
+	}
+
+	LATENCY_SCOPE(true, _collectGarbageLatency);
+	const event_trace::scope traceScope(_eventTrace, "collect_garbage");
+
+	tree& currentTree = root.Tree;
+	assert(currentTree.GCHint != 0);
+
+	const uint32_t depth = currentTree.GCHint & ~GC_HINT_FLAG;
+	assert(depth < _sizeLog);
+
+	char gcBuffer[8 * 1024];
+	std::pmr::monotonic_buffer_resource bufferResource(gcBuffer, sizeof(gcBuffer));
+	std::pmr::vector<chunk_pool<false>> pools{ std::pmr::polymorphic_allocator<chunk_pool<false>>(&bufferResource) };
+
+	traverser_gc traverser(*this, pools);
+	traverser.traverse(currentTree, depth);
+	traverser.finalize(*this);
+
+	return traverser.visited_count();
+}
+
+uint32_t parallel_octree::collect_garbage(gc_root root, uint32_t targetWork, std::pmr::vector<gc_root>& spawnedRoots)
+{
+	check_writable();
+	tree& currentTree = root.Tree;
+	assert(currentTree.GCHint != 0);
+
+	const uint32_t depth = currentTree.GCHint & ~GC_HINT_FLAG;
+	assert(depth < _sizeLog);
+
+	if (root.Work <= targetWork || depth + 1 == _sizeLog)
+	{
+		return collect_garbage(root);
+	}
+
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record_gc_root(operation_type::split_gc, root, targetWork);
+	}
+
+	const event_trace::scope traceScope(_eventTrace, "split_gc_root");
+	traverser_gc_roots(depth + 1, targetWork, spawnedRoots).split(currentTree, depth, root.Cell);
+	return 1;
+}
+
+void parallel_octree::join_garbage_collection(gc_root root)
+{
+	check_writable();
+	if (_recorder)
+		[[unlikely]]
+	{
+		_recorder->record_gc_root(operation_type::join_gc, root, 0);
+	}
+
+	const event_trace::scope traceScope(_eventTrace, "join_gc_root");
+
+	char gcBuffer[1024];
+	std::pmr::monotonic_buffer_resource bufferResource(gcBuffer, sizeof(gcBuffer));
+	std::pmr::vector<chunk_pool<false>> pools{ std::pmr::polymorphic_allocator<chunk_pool<false>>(&bufferResource) };
+
+	traverser_gc traverser(*this, pools);
+	traverser.unlink_empty_children(root.Tree);
+	traverser.finalize(*this);
+}
+
+void parallel_octree::query(const aabb& aabbQuery, std::pmr::vector<uint32_t>& result) const
+{
+	result.clear();
+	traverser_query(*this, aabbQuery, result).traverse(initial_aabb(), *_root);
+
+	std::sort(result.begin(), result.end());
+	result.erase(std::unique(result.begin(), result.end()), result.end());
+}
+
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+
+void parallel_octree::query(const aabb& aabbQuery, uint32_t tagMask, std::pmr::vector<uint32_t>& result) const
+{
+	result.clear();
+	traverser_query(*this, aabbQuery, tagMask, result).traverse(initial_aabb(), *_root);
+
+	std::sort(result.begin(), result.end());
+	result.erase(std::unique(result.begin(), result.end()), result.end());
+}
+
+#endif
+
+// Spreads the lower 10 bits of value to every third bit
+static uint64_t spread_bits(uint64_t value)
+{
+	value &= 0x3FFu;
+	value = (value | (value << 16)) & 0x30000FFu;
+	value = (value | (value << 8)) & 0x300F00Fu;
+	value = (value | (value << 4)) & 0x30C30C3u;
+	value = (value | (value << 2)) & 0x9249249u;
+	return value;
+}
+
+void parallel_octree::query_batch(std::span<const aabb> queries, batch_result& result) const
+{
+	prepare_query_batch(queries, result, 1);
+	query_batch_part(result, 0);
+	finish_query_batch(result);
+}
+
+size_t parallel_octree::prepare_query_batch(std::span<const aabb> queries, batch_result& result, size_t partsCount) const
+{
+	// Centres are taken to cells of at most 10 levels, so the key fits above the query index
+	const float maxCell = float((1u << _sizeLog) - 1);
+	const uint32_t shift = _sizeLog > MORTON_LEVELS ? _sizeLog - MORTON_LEVELS : 0;
+
+	result._queries = queries;
+	result._order.resize(queries.size());
+
+	for (size_t i = 0; i < queries.size(); ++i)
+	{
+		const point centre = calculate_centre(queries[i]);
+		const auto coordinate = [maxCell, shift](float value) { return uint64_t(std::clamp(value, 0.0f, maxCell)) >> shift; };
+
+		result._order[i] = (spread_bits(coordinate(centre.X)) << 2 | spread_bits(coordinate(centre.Y)) << 1 | spread_bits(coordinate(centre.Z))) << 32 | i;
+	}
+
+	std::sort(result._order.begin(), result._order.end());
+
+	result.Indices.clear();
+	result.Ranges.resize(queries.size());
+
+	// Every part takes a contiguous piece of the curve
+	partsCount = std::max(std::min(partsCount, queries.size() / MIN_QUERIES_PER_PART), size_t(1));
+
+	result._partSize = (queries.size() + partsCount - 1) / partsCount;
+	result._parts.resize(partsCount);
+
+	return partsCount;
+}
+
+void parallel_octree::query_batch_part(batch_result& result, size_t partIndex) const
+{
+	assert(partIndex < result._parts.size());
+
+	if (partIndex > 0)
+	{
+		result._parts[partIndex].Indices.clear();
+	}
+
+	traverser_query_batch(*this, result, partIndex).traverse(initial_aabb(), *_root);
+}
+
+void parallel_octree::finish_query_batch(batch_result& result) const
+{
+	// Ranges of the other parts are moved past the ones before them
+	for (size_t partIndex = 1; partIndex < result._parts.size(); ++partIndex)
+	{
+		const std::pmr::vector<uint32_t>& indices = result._parts[partIndex].Indices;
+		const size_t offset = result.Indices.size();
+
+		result.Indices.insert(result.Indices.end(), indices.begin(), indices.end());
+
+		for (size_t i = partIndex * result._partSize, end = std::min((partIndex + 1) * result._partSize, result._order.size()); i < end; ++i)
+		{
+			batch_result::range& range = result.Ranges[uint32_t(result._order[i])];
+			range.Begin += offset;
+			range.End += offset;
+		}
+	}
+
+	result._queries = {};
+}
+
+size_t parallel_octree::count_in_aabb(const aabb& aabbQuery) const
+{
+	return traverser_count(*this, aabbQuery).traverse(initial_aabb(), *_root);
+}
+
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+
+void parallel_octree::consume_dirty(std::pmr::vector<cell>& result)
+{
+	const auto take = [&result](worker& currentWorker)
+	{
+		result.insert(result.end(), currentWorker.DirtyCells.begin(), currentWorker.DirtyCells.end());
+		currentWorker.DirtyCells.clear();
+	};
+
+	for (uint32_t i = 0; i < _workersCount; ++i)
+	{
+		take(_workers[i]);
+	}
+
+	{
+		const std::lock_guard<std::mutex> guard(_workerRegistry->Mutex);
+
+		for (const std::unique_ptr<worker>& currentWorker : _workerRegistry->Workers)
+		{
+			take(*currentWorker);
+		}
+	}
+
+	// Every stamp is stale in the next epoch, zero is kept for leaves which were never logged
+	if (++_dirtyEpoch == 0)
+		[[unlikely]]
+	{
+		_dirtyEpoch = 1;
+	}
+}
+
+#endif
+
+void parallel_octree::defragment()
+{
+	check_writable();
+
+	chunk_allocator<> arena(_allocator.capacity());
+	_root = traverser_relocate(*this, arena).relocate_root(*_root);
+	_allocator.replace_arena(arena);
+}
+
+std::unique_ptr<parallel_octree> parallel_octree::clone(size_t bufferSize) const
+{
+	const size_t usedSize = _allocator.used_size();
+	const size_t rootOffset = size_t(reinterpret_cast<const uint8_t*>(_root) - _allocator.data());
+
+	if (bufferSize == 0)
+	{
+		bufferSize = _originalCapacity;
+	}
+
+	if (bufferSize < usedSize)
+	{
+		throw std::runtime_error("parallel_octree: bufferSize is smaller than the used part of the arena");
+	}
+
+	std::unique_ptr<parallel_octree> octree(new parallel_octree(_sizeLog, bufferSize, usedSize, _workersCount, rootOffset));
+	copy_memory(octree->_allocator.data(), _allocator.data(), usedSize);
+	octree->_tombstonesCount = tombstones_count();
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+	// The copied leaves are logged again by the copy
+	octree->_dirtyEpoch = _dirtyEpoch + 1 != 0 ? _dirtyEpoch + 1 : 1;
+#endif
+
+	return octree;
+}
+
+void parallel_octree::copy_memory(uint8_t* destination, const uint8_t* source, size_t size)
+{
+	// A single thread does not saturate the memory bandwidth
+	const size_t threadsCount = std::min(size_t(std::max(std::thread::hardware_concurrency(), 1u)), size / MIN_THREAD_SIZE);
+
+	if (threadsCount <= 1)
+	{
+		std::memcpy(destination, source, size);
+		return;
+	}
+
+	const size_t partSize = (size / threadsCount + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+	std::vector<std::thread> threads;
+	threads.reserve(threadsCount - 1);
+
+	for (size_t i = 1; i < threadsCount; ++i)
+	{
+		const size_t offset = i * partSize;
+		threads.emplace_back([=]() { std::memcpy(destination + offset, source + offset, std::min(partSize, size - offset)); });
+	}
+
+	std::memcpy(destination, source, partSize);
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+void parallel_octree::set_recorder(operation_recorder* recorder)
+{
+	if (recorder)
+	{
+		recorder->write_header(_sizeLog, _allocator.capacity(), _workersCount);
+	}
+
+	_recorder = recorder;
+}
+
+void parallel_octree::set_event_trace(event_trace* trace)
+{
+	_eventTrace = trace;
+}
+
+#ifdef PARALLEL_OCTREE_LATENCY_HISTOGRAMS
+
+void parallel_octree::merge_latency_histograms(latency_histograms& result) const
+{
+	for (uint32_t i = 0; i < _workersCount; ++i)
+	{
+		result.merge(_workers[i].Latency);
+	}
+
+	{
+		const std::lock_guard<std::mutex> guard(_workerRegistry->Mutex);
+
+		for (const std::unique_ptr<worker>& currentWorker : _workerRegistry->Workers)
+		{
+			result.merge(currentWorker->Latency);
+		}
+	}
+
+	result.CollectGarbage.merge(_collectGarbageLatency);
+}
+
+void parallel_octree::reset_latency_histograms()
 {
-private:
-	uint32_t _depth;
-	std::pmr::vector<gc_root>& _roots;
-
-public:
-	traverser_gc_roots(uint32_t depth, std::pmr::vector<gc_root>& roots)
-		: _depth(depth)
-		, _roots(roots)
+	for (uint32_t i = 0; i < _workersCount; ++i)
 	{
+		_workers[i].Latency.reset();
 	}
 
-	void traverse(node& currentNode, uint32_t depth)
 	{
-		tree& currentTree = static_cast<tree&>(currentNode);
+		const std::lock_guard<std::mutex> guard(_workerRegistry->Mutex);
 
-		if (currentTree.GCHint == 0)
-			[[likely]]
+		for (const std::unique_ptr<worker>& currentWorker : _workerRegistry->Workers)
 		{
-			return;
+			currentWorker->Latency.reset();
 		}
+	}
 
-		if (depth == _depth)
-			[[unlikely]]
-		{
-			_roots.emplace_back(gc_root{ currentTree });
-			return;
-		}
+	_collectGarbageLatency.reset();
+}
 
-		currentTree.GCHint = 0;
-		depth += 1;
+#endif
 
-		for (size_t i = 0; i < std::size(currentTree.Children); ++i)
+parallel_octree::statistics parallel_octree::compute_statistics() const
+{
+	const auto addValues = [](std::vector<size_t>& to, const std::vector<size_t>& from)
+	{
+		to.resize(std::max(to.size(), from.size()));
+
+		for (size_t i = 0; i < from.size(); ++i)
 		{
-			if (node* const child = currentTree.Children[i].get())
-			{
-				traverse(*child, depth);
-			}
+			to[i] += from[i];
 		}
-	}
-};
+	};
 
-class parallel_octree::traverser_gc final
-{
-private:
-	std::pmr::vector<chunk_pool<false>>& _pools;
-	chunk_pool<false> _pool;
-	uint32_t _sizeLog;
-	uint32_t _count;
+	statistics result;
+	std::vector<uint32_t> indices;
 
-public:
-	traverser_gc(parallel_octree& owner, std::pmr::vector<chunk_pool<false>>& pools)
-		: _pools (pools)
-		, _sizeLog (owner._sizeLog)
-		, _count (0)
+	const size_t usedSize = _allocator.used_size();
+	const uint32_t threadsCount = uint32_t(std::min(size_t(std::max(std::thread::hardware_concurrency(), 1u)), usedSize / MIN_THREAD_SIZE));
+
+	if (threadsCount <= 1 || _sizeLog < 2)
 	{
+		traverser_statistics(*this, result, indices, 0, nullptr).traverse(*_root, 0);
 	}
-
-	bool traverse(node& currentNode, uint32_t depth)
+	else
 	{
-		if (depth == _sizeLog)
-			[[unlikely]]
+		// Up to 64 subtrees are shared between the threads
+		std::vector<const node*> roots;
+		traverser_statistics(*this, result, indices, 2, &roots).traverse(*_root, 0);
+
+		std::vector<statistics> partialResults(threadsCount);
+		std::vector<std::vector<uint32_t>> partialIndices(threadsCount);
+		std::atomic<size_t> nextRoot = 0;
+
+		const auto traverseRoots = [this, &roots, &nextRoot, &partialResults, &partialIndices](uint32_t threadIndex)
 		{
-			leaf& currentLeaf = static_cast<leaf&>(currentNode);
-			if (currentLeaf.GCHint == 0)
+			traverser_statistics traverser(*this, partialResults[threadIndex], partialIndices[threadIndex], 0, nullptr);
+
+			for (size_t i = nextRoot++; i < roots.size(); i = nextRoot++)
 			{
-				return false;
+				traverser.traverse(*roots[i], 2);
 			}
-			return process_leaf(currentLeaf);
-		}
+		};
 
-		tree& currentTree = static_cast<tree&>(currentNode);
+		std::vector<std::thread> threads;
+		threads.reserve(threadsCount - 1);
 
-		if (currentTree.GCHint == 0)
+		for (uint32_t i = 1; i < threadsCount; ++i)
 		{
-			return false;
+			threads.emplace_back(traverseRoots, i);
 		}
 
-		depth += 1;
-		currentTree.GCHint = 0;
-		bool needGC = true;
+		traverseRoots(0);
 
-		for (size_t i = 0; i < std::size(currentTree.Children); ++i)
+		for (std::thread& thread : threads)
 		{
-			relative_ptr<node>& childPtr = currentTree.Children[i];
-
-			if (node* const child = childPtr.get())
-				[[unlikely]]
-			{
-				if (!traverse(*child, depth))
-					[[likely]]
-				{
-					needGC = false;
-					continue;
-				}
+			thread.join();
+		}
 
-				if (_count == octree_allocator<>::ARRAY_SIZE)
-				{
-					_pools.emplace_back(std::move(_pool));
-					assert(_pool.is_empty());
-					_count = 0;
-				}
+		for (uint32_t i = 0; i < threadsCount; ++i)
+		{
+			const statistics& partialResult = partialResults[i];
 
-				++_count;
-				childPtr = nullptr;
+			addValues(result.NodesPerLevel, partialResult.NodesPerLevel);
+			addValues(result.LeafCounts, partialResult.LeafCounts);
+			addValues(result.ExtensionChainLengths, partialResult.ExtensionChainLengths);
+			result.EntriesCount += partialResult.EntriesCount;
+			result.TombstonesCount += partialResult.TombstonesCount;
+			result.LiveBytes += partialResult.LiveBytes;
 
-				if (depth == _sizeLog)
-				{
-					_pool.add<false>(*static_cast<leaf*>(child));
-				}
-				else
-				{
-					_pool.add<false>(*static_cast<tree*>(child));
-				}
-			}
+			indices.insert(indices.end(), partialIndices[i].begin(), partialIndices[i].end());
 		}
-
-		return needGC;
 	}
 
-	void finalize(parallel_octree& owner)
+	std::sort(indices.begin(), indices.end());
+	result.ShapesCount = size_t(std::unique(indices.begin(), indices.end()) - indices.begin());
+
+	for (const size_t nodesCount : result.NodesPerLevel)
 	{
-		if (_count > 0)
-		{
-			_pools.emplace_back(std::move(_pool));
-			_count = 0;
-		}
-		if (_pools.size() > 0)
-		{
-			owner._allocator.add_pools(std::move(_pools));
-			assert(_pools.size() == 0);
-		}
+		result.LiveBytes += nodesCount * CACHE_LINE_SIZE;
 	}
 
-private:
-	bool process_leaf(leaf& currentLeaf)
+	result.UsedBytes = usedSize;
+
+	return result;
+}
+
+void parallel_octree::rasterize_occupancy(uint32_t level, occupancy_bitmap& result) const
+{
+	// Byte indices take three bits per level
+	if (level > std::min(_sizeLog, 21u))
 	{
-		currentLeaf.GCHint = 0;
+		throw std::runtime_error("parallel_octree: no occupancy bitmap for level " + std::to_string(level));
+	}
 
-		relative_ptr<leaf_extension>* nextPtr = &currentLeaf.Next;
-		std::span<uint32_t> span(currentLeaf.Indices);
-		uint32_t offset = 0;
+	result.Level = level;
+	result.Bytes.assign(level > 0 ? size_t(1) << (3 * (level - 1)) : 1, 0);
+
+	uint8_t* const bytes = result.Bytes.data();
+
+	const size_t usedSize = _allocator.used_size();
+	const uint32_t threadsCount = uint32_t(std::min(size_t(std::max(std::thread::hardware_concurrency(), 1u)), usedSize / MIN_THREAD_SIZE));
+
+	if (level == 0)
+	{
+		bytes[0] = uint8_t(traverser_occupancy(*this, level, bytes, 0, nullptr).traverse(*_root, 0, 0));
+	}
+	else if (threadsCount <= 1 || level < 3)
+	{
+		traverser_occupancy(*this, level, bytes, 0, nullptr).traverse(*_root, 0, 0);
+	}
+	else
+	{
+		// Up to 64 subtrees are shared between the threads, each of them writes its own range of bytes
+		std::vector<traverser_occupancy::root> roots;
+		traverser_occupancy(*this, level, bytes, 2, &roots).traverse(*_root, 0, 0);
 
-		uint32_t count = currentLeaf.Count;
-		uint32_t newCount = 0;
+		std::atomic<size_t> nextRoot = 0;
 
-		const auto processIndex = [&offset, &span, &nextPtr, &newCount](uint32_t currentIndex)
+		const auto traverseRoots = [this, level, bytes, &roots, &nextRoot]()
 		{
-			if (currentIndex == InvalidIndex)
-				[[unlikely]]
-			{
-				return;
-			}
+			traverser_occupancy traverser(*this, level, bytes, 0, nullptr);
 
-			if (offset == span.size())
-				[[unlikely]]
+			for (size_t i = nextRoot++; i < roots.size(); i = nextRoot++)
 			{
-				assert(*nextPtr);
-				leaf_extension& extension = *nextPtr->get();
-				nextPtr = &extension.Next;
-				span = std::span<uint32_t>(extension.Indices);
+				traverser.traverse(*roots[i].Node, 2, roots[i].Code);
 			}
-
-			span[offset++] = currentIndex;
-			++newCount;
 		};
 
-		for (uint32_t i = 0, max = std::min(count, uint32_t(std::size(currentLeaf.Indices))); i < max; ++i)
+		std::vector<std::thread> threads;
+		threads.reserve(threadsCount - 1);
+
+		for (uint32_t i = 1; i < threadsCount; ++i)
 		{
-			processIndex(currentLeaf.Indices[i]);
+			threads.emplace_back(traverseRoots);
 		}
 
-		if (count > uint32_t(std::size(currentLeaf.Indices)))
-			[[unlikely]]
+		traverseRoots();
+
+		for (std::thread& thread : threads)
 		{
-			assert(currentLeaf.Next);
-			count -= uint32_t(std::size(currentLeaf.Indices));
+			thread.join();
+		}
+	}
+}
 
-			leaf_extension* extension = currentLeaf.Next.get();
+bool parallel_octree::occupancy_bitmap::is_occupied(uint32_t x, uint32_t y, uint32_t z) const
+{
+	uint64_t code = 0;
 
-			while (true)
-			{
-				for (uint32_t i = 0, max = std::min(count, uint32_t(std::size(extension->Indices))); i < max; ++i)
-				{
-					processIndex(extension->Indices[i]);
-				}
+	for (uint32_t shift = Level; shift-- > 0; )
+	{
+		code = code << 3 | ((y >> shift) & 1) | (((x >> shift) & 1) << 1) | (((z >> shift) & 1) << 2);
+	}
 
-				if (count <= uint32_t(std::size(extension->Indices)))
-					[[likely]]
-				{
-					break;
-				}
+	return (Bytes[code >> 3] >> (code & 7)) & 1;
+}
 
-				count -= uint32_t(std::size(extension->Indices));
-				assert(extension->Next);
-				extension = extension->Next.get();
-			}
-		}
+float parallel_octree::statistics::tombstone_ratio() const
+{
+	return EntriesCount > 0 ? float(double(TombstonesCount) / double(EntriesCount)) : 0.0f;
+}
 
-		currentLeaf.Count = newCount;
-		return newCount == 0;
-	}
-};
+float parallel_octree::statistics::leaves_per_shape() const
+{
+	return ShapesCount > 0 ? float(double(EntriesCount - TombstonesCount) / double(ShapesCount)) : 0.0f;
+}
 
-parallel_octree::parallel_octree(uint32_t sizeLog, uint32_t bufferSize, uint32_t workersCount)
-	: _allocator (bufferSize, workersCount)
-	, _root (sizeLog > 0 ? static_cast<node*>(_allocator.allocate<tree, false>()) : static_cast<node*>(_allocator.allocate<leaf, false>()))
-	, _sizeLog (sizeLog)
+size_t parallel_octree::tombstones_count() const
 {
-	static_assert(sizeof(tree) <= CACHE_LINE_SIZE);
-	static_assert(sizeof(leaf) == CACHE_LINE_SIZE);
-	static_assert(sizeof(leaf_extension) == CACHE_LINE_SIZE);
+	return std::atomic_ref<size_t>(const_cast<size_t&>(_tombstonesCount)).load(std::memory_order_relaxed);
 }
 
-parallel_octree::~parallel_octree()
+void parallel_octree::check_writable() const
 {
+	if (_isReadOnly)
+		[[unlikely]]
+	{
+		throw std::logic_error("parallel_octree: the octree is read-only");
+	}
 }
 
-void parallel_octree::add_synchronized(const shape_data& shapeData, uint32_t workerIndex)
+float parallel_octree::memory_usage() const
 {
-	traverser_add<true>(*this, workerIndex, shapeData).traverse(initial_aabb(), 0, *_root);
+	return float(double(_allocator.used_size()) / double(_allocator.capacity()));
 }
 
-void parallel_octree::remove_synchronized(const shape_data& shapeData, uint32_t workerIndex)
+float parallel_octree::live_memory_usage() const
 {
-	traverser_remove<true>(*this, workerIndex, shapeData).traverse(initial_aabb(), 0, *_root);
+	return float(double(_allocator.live_size()) / double(_allocator.capacity()));
 }
 
-void parallel_octree::move_synchronized(const shape_move& shapeMove, uint32_t workerIndex)
+size_t parallel_octree::pending_gc_work() const
 {
-	const aabb aabbInitial = initial_aabb();
-	traverser_move<true>(*this, workerIndex, shapeMove).traverse(
-		aabbInitial, 0, *_root,
-		are_intersected(shapeMove.aabbOld, aabbInitial),
-		are_intersected(shapeMove.aabbNew, aabbInitial)
-		);
+	if (_sizeLog == 0)
+	{
+		return 0;
+	}
+
+	const tree& root = static_cast<const tree&>(*_root);
+	size_t work = 0;
+
+	for (const relative_ptr<node>& child : root.Children)
+	{
+		const node* const childNode = child.get();
+
+		if (!childNode)
+		{
+			continue;
+		}
+
+		// Hints of leaves count their tombstones, marked trees count the removed entries below them
+		if (_sizeLog == 1)
+		{
+			work += static_cast<const leaf*>(childNode)->GCHint;
+		}
+		else if (static_cast<const tree*>(childNode)->GCHint != 0)
+		{
+			work += static_cast<const tree*>(childNode)->DirtyCount;
+		}
+	}
+
+	return work;
 }
 
-void parallel_octree::add_exclusive(const shape_data& shapeData)
+uint32_t parallel_octree::size_log() const
 {
-	traverser_add<false>(*this, 0, shapeData).traverse(initial_aabb(), 0, *_root);
+	return _sizeLog;
 }
 
-void parallel_octree::remove_exclusive(const shape_data& shapeData)
+template <bool Synchronized>
+void parallel_octree::add_tombstones(uint32_t count)
 {
-	traverser_remove<false>(*this, 0, shapeData).traverse(initial_aabb(), 0, *_root);
+	if (count == 0)
+	{
+		return;
+	}
+
+	if constexpr (Synchronized)
+	{
+		std::atomic_ref<size_t>(_tombstonesCount).fetch_add(count, std::memory_order_relaxed);
+	}
+	else if (int32_t(count) < 0)
+	{
+		// Compactions may drop tombstones added before the last prepare_garbage_collection reset the count
+		_tombstonesCount -= std::min(_tombstonesCount, size_t(0u - count));
+	}
+	else
+	{
+		_tombstonesCount += count;
+	}
 }
 
-void parallel_octree::move_exclusive(const shape_move& shapeMove)
+parallel_octree::worker& parallel_octree::get_worker(uint32_t workerIndex) const
 {
-	const aabb aabbInitial = initial_aabb();
-	traverser_move<false>(*this, 0, shapeMove).traverse(
-		aabbInitial, 0, *_root,
-		are_intersected(shapeMove.aabbOld, aabbInitial),
-		are_intersected(shapeMove.aabbNew, aabbInitial)
-		);
+	assert(workerIndex < _workersCount);
+	return _workers[workerIndex];
 }
 
-void parallel_octree::prepare_garbage_collection(std::pmr::vector<gc_root>& roots, uint32_t depth)
+parallel_octree::worker& parallel_octree::get_thread_worker()
 {
-	assert(depth < _sizeLog);
-	_allocator.prepare_gc();
-	roots.clear();
-	traverser_gc_roots(depth, roots).traverse(*_root, 0);
+	for (const thread_workers::entry& currentEntry : _threadWorkers.Entries)
+	{
+		if (currentEntry.Registry == _workerRegistry)
+			[[likely]]
+		{
+			return *currentEntry.Worker;
+		}
+	}
+
+	return register_thread_worker();
 }
 
-void parallel_octree::collect_garbage(gc_root root)
+NOINLINE parallel_octree::worker& parallel_octree::register_thread_worker()
 {
-	tree& currentTree = root.Tree;
-	assert(currentTree.GCHint != 0);
+	std::vector<thread_workers::entry>& entries = _threadWorkers.Entries;
 
-	const uint32_t depth = currentTree.GCHint & ~GC_HINT_FLAG;
-	assert(depth < _sizeLog);
+	entries.erase(
+		std::remove_if(entries.begin(), entries.end(), [](thread_workers::entry& currentEntry) { return !currentEntry.Registry->is_alive(); }),
+		entries.end()
+		);
 
-	char gcBuffer[8 * 1024];
-	std::pmr::monotonic_buffer_resource bufferResource(gcBuffer, sizeof(gcBuffer));
-	std::pmr::vector<chunk_pool<false>> pools{ std::pmr::polymorphic_allocator<chunk_pool<false>>(&bufferResource) };
+	worker* currentWorker;
 
-	traverser_gc traverser(*this, pools);
-	traverser.traverse(currentTree, depth);
-	traverser.finalize(*this);
+	{
+		const std::lock_guard<std::mutex> guard(_workerRegistry->Mutex);
+
+		if (!_workerRegistry->FreeWorkers.empty())
+		{
+			currentWorker = _workerRegistry->FreeWorkers.back();
+			_workerRegistry->FreeWorkers.pop_back();
+		}
+		else
+		{
+			currentWorker = _workerRegistry->Workers.emplace_back(std::make_unique<worker>()).get();
+		}
+
+		currentWorker->LocalPart = &_allocator.acquire_local_part();
+	}
+
+	entries.push_back({ _workerRegistry, currentWorker });
+	return *currentWorker;
 }
 
 float parallel_octree::field_size() const
@@ -780,6 +3208,43 @@ parallel_octree::aabb parallel_octree::aabb_7(const aabb& aabb, const point& cen
 	};
 }
 
+void parallel_octree::split_aabb(const aabb& aabb, parallel_octree::aabb (&octants)[8])
+{
+	const point centre = calculate_centre(aabb);
+
+	octants[0] = aabb_0(aabb, centre);
+	octants[1] = aabb_1(aabb, centre);
+	octants[2] = aabb_2(aabb, centre);
+	octants[3] = aabb_3(aabb, centre);
+	octants[4] = aabb_4(aabb, centre);
+	octants[5] = aabb_5(aabb, centre);
+	octants[6] = aabb_6(aabb, centre);
+	octants[7] = aabb_7(aabb, centre);
+}
+
+uint32_t parallel_octree::intersected_octants(const aabb& aabb, const parallel_octree::aabb (&octants)[8])
+{
+	uint32_t mask = 0;
+
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		mask |= uint32_t(are_intersected(aabb, octants[i])) << i;
+	}
+
+	return mask;
+}
+
+void parallel_octree::prefetch_children(const tree& currentTree, uint32_t mask)
+{
+	for (; mask != 0; mask &= mask - 1)
+	{
+		if (const node* const child = currentTree.Children[std::countr_zero(mask)].get())
+		{
+			PREFETCH(child);
+		}
+	}
+}
+
 bool parallel_octree::are_intersected(const aabb& left, const aabb& right)
 {
 	const auto intersects = [](float min0, float max0, float min1, float max1)
@@ -810,3 +3275,54 @@ parallel_octree::point parallel_octree::calculate_centre(const aabb& aabb)
 {
 	return { (aabb.Min.X + aabb.Max.X) * 0.5f, (aabb.Min.Y + aabb.Max.Y) * 0.5f, (aabb.Min.Z + aabb.Max.Z) * 0.5f };
 }
+
+uint32_t parallel_octree::leaf_capacity()
+{
+	return LEAF_CAPACITY;
+}
+
+uint32_t parallel_octree::layout_flags()
+{
+	uint32_t flags = 0;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+	flags |= LAYOUT_LEAF_TAGS;
+#endif
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+	flags |= LAYOUT_DIRTY_LEAVES;
+#endif
+#ifdef PARALLEL_OCTREE_OCCUPANCY_COUNTS
+	flags |= LAYOUT_OCCUPANCY_COUNTS;
+#endif
+	return flags;
+}
+
+std::optional<parallel_octree::gc_root> parallel_octree::find_gc_root(uint32_t depth, const cell& rootCell, bool isMarked)
+{
+	if (depth >= _sizeLog)
+	{
+		return std::nullopt;
+	}
+
+	node* currentNode = _root;
+
+	for (uint32_t level = 0; level < depth && currentNode; ++level)
+	{
+		const uint32_t shift = depth - 1 - level;
+		const uint32_t octant = ((rootCell.Y >> shift) & 1) | (((rootCell.X >> shift) & 1) << 1) | (((rootCell.Z >> shift) & 1) << 2);
+		currentNode = static_cast<tree*>(currentNode)->Children[octant].get();
+	}
+
+	if (!currentNode)
+	{
+		return std::nullopt;
+	}
+
+	tree& currentTree = static_cast<tree&>(*currentNode);
+
+	if (isMarked && currentTree.GCHint != (depth | GC_HINT_FLAG))
+	{
+		return std::nullopt;
+	}
+
+	return gc_root{ currentTree, currentTree.DirtyCount, depth, rootCell };
+}
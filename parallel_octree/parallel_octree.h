@@ -2,9 +2,22 @@
 
 #include <cstdint>
 #include <memory>
+#include <memory_resource>
+#include <vector>
+#include <span>
+#include <optional>
+#include <filesystem>
 
 #include "octree_allocator.h"
 
+#ifdef PARALLEL_OCTREE_LATENCY_HISTOGRAMS
+#include "latency_histogram.h"
+#endif
+
+class mapped_file;
+class operation_recorder;
+class event_trace;
+
 class parallel_octree final
 {
 private:
@@ -13,6 +26,13 @@ private:
 	struct leaf;
 	struct leaf_extension;
 
+	struct snapshot_header;
+	struct batch_node;
+
+	struct worker;
+	struct worker_registry;
+	struct thread_workers;
+
 	template <bool Synchronized>
 	class traverser_common;
 
@@ -25,8 +45,20 @@ private:
 	template <bool Synchronized>
 	class traverser_move;
 
+	template <bool Synchronized>
+	class traverser_add_batch;
+
+	template <bool Synchronized>
+	class traverser_point;
+
 	class traverser_gc_roots;
 	class traverser_gc;
+	class traverser_query;
+	class traverser_query_batch;
+	class traverser_count;
+	class traverser_statistics;
+	class traverser_occupancy;
+	class traverser_relocate;
 
 public:
 	static constexpr uint32_t InvalidIndex = 0xFFFFFFFFu;
@@ -41,51 +73,313 @@ public:
 		point Min, Max;
 	};
 
+	// Integer coordinates of a leaf, the leaf covers [X, X + 1) x [Y, Y + 1) x [Z, Z + 1)
+	struct cell final
+	{
+		uint32_t X, Y, Z;
+	};
+
 	struct shape_data final
 	{
 		aabb AABB;
 		uint32_t Index;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+		// Stored next to every entry of the shape and matched against query masks, a zero tag never matches one.
+		// Queries without a mask take every entry.
+		uint32_t Tag = 0xFFFFFFFFu;
+#endif
 	};
 
 	struct shape_move final
 	{
 		aabb aabbOld, aabbNew;
 		uint32_t Index;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+		// Must be the tag the shape was added with, leaves the shape stays in keep their entries
+		uint32_t Tag = 0xFFFFFFFFu;
+#endif
+	};
+
+	struct point_data final
+	{
+		point Point;
+		uint32_t Index;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+		uint32_t Tag = 0xFFFFFFFFu;
+#endif
+	};
+
+	struct point_move final
+	{
+		point pointOld, pointNew;
+		uint32_t Index;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+		uint32_t Tag = 0xFFFFFFFFu;
+#endif
+	};
+
+	struct statistics final
+	{
+		// Indexed by depth, leaves are at depth size_log()
+		std::vector<size_t> NodesPerLevel;
+		// Number of leaves with the given Count, tombstones included
+		std::vector<size_t> LeafCounts;
+		// Number of leaves with the given number of linked extensions
+		std::vector<size_t> ExtensionChainLengths;
+
+		size_t EntriesCount = 0;
+		size_t TombstonesCount = 0;
+		// Distinct indices with at least one live entry
+		size_t ShapesCount = 0;
+
+		size_t UsedBytes = 0;
+		// Bytes of the nodes reachable from the root, the rest is free or waits for the GC
+		size_t LiveBytes = 0;
+
+		float tombstone_ratio() const;
+		// Live entries per distinct index
+		float leaves_per_shape() const;
+	};
+
+	// Filled by query_batch, the memory is reused by the following calls
+	struct batch_result final
+	{
+		struct range final
+		{
+			size_t Begin, End;
+		};
+
+		std::pmr::vector<uint32_t> Indices;
+		// Candidates of query i are Indices[Ranges[i].Begin, Ranges[i].End), sorted and without duplicates
+		std::vector<range> Ranges;
+
+	private:
+		struct visit final
+		{
+			const node* Node;
+			aabb AABB;
+			uint32_t Query;
+		};
+
+		// The first part collects its candidates into Indices directly
+		struct part final
+		{
+			std::pmr::vector<uint32_t> Indices;
+			std::vector<visit> Level;
+			std::vector<visit> NextLevel;
+		};
+
+		std::span<const aabb> _queries;
+		// Sorted Morton keys above the query indices
+		std::vector<uint64_t> _order;
+		std::vector<part> _parts;
+		size_t _partSize = 0;
+
+		friend class parallel_octree;
+		friend class traverser_query_batch;
+	};
+
+	// Filled by rasterize_occupancy, the memory is reused by the following calls
+	struct occupancy_bitmap final
+	{
+		uint32_t Level = 0;
+		// Byte j holds the children of node j at Level - 1 as bits in the octant order, j takes three such bits
+		// per level from the root down. The cells are in Morton order then, level 0 is bit 0 of the only byte.
+		std::vector<uint8_t> Bytes;
+
+		// Coordinates of a cell at Level, in [0, 2^Level)
+		bool is_occupied(uint32_t x, uint32_t y, uint32_t z) const;
 	};
 
 	struct gc_root final
 	{
 		tree& Tree;
+		// Number of leaf updates with tombstones in the subtree
+		uint32_t Work;
+		// Position of the tree among the nodes at its depth, coordinates are in [0, 2^Depth)
+		uint32_t Depth;
+		cell Cell;
 	};
 
 private:
+	std::unique_ptr<mapped_file> _mappedFile;
 	octree_allocator<> _allocator;
 
 	node* _root;
 	uint32_t _sizeLog;
 
+	std::unique_ptr<worker[]> _workers;
+	uint32_t _workersCount;
+	std::shared_ptr<worker_registry> _workerRegistry;
+	bool _isReadOnly;
+	// Arena size of the octree a read-only one was saved from, clones get it back
+	size_t _originalCapacity;
+	operation_recorder* _recorder;
+	event_trace* _eventTrace;
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+	uint32_t _dirtyEpoch = 1;
+#endif
+
+	alignas(CACHE_LINE_SIZE)
+	size_t _tombstonesCount;
+
+#ifdef PARALLEL_OCTREE_LATENCY_HISTOGRAMS
+	// Collect calls have no worker
+	latency_histogram _collectGarbageLatency;
+#endif
+
+	static thread_local thread_workers _threadWorkers;
+
 public:
-	explicit parallel_octree(uint32_t sizeLog, uint32_t bufferSize, uint32_t workersCount);
+	// Workers with indices [0, workersCount) are bound to the caller's scheduler,
+	// any other thread is registered on its first call of an overload without workerIndex
+	explicit parallel_octree(uint32_t sizeLog, uint32_t bufferSize, uint32_t workersCount = 0);
 	~parallel_octree();
 
+	// The file written by save is queried in place, the returned octree is read-only: modifications, the GC and
+	// defragment throw std::logic_error
+	static std::unique_ptr<parallel_octree> open_mapped(const std::filesystem::path& path);
+
 	parallel_octree(const parallel_octree&) = delete;
 	const parallel_octree& operator = (const parallel_octree&) = delete;
 
 	float field_size() const;
+	uint32_t size_log() const;
+
+	// Number of entries removed since the last prepare_garbage_collection call
+	size_t tombstones_count() const;
+	// Used part of the arena, chunks recycled by the GC are reused before the arena grows
+	float memory_usage() const;
+	// Part of the arena taken by nodes, falls when the GC frees them. Exact only when no operation runs.
+	float live_memory_usage() const;
+	// Leaf updates which left tombstones below the subtrees marked for the GC, the work of the next cycle
+	size_t pending_gc_work() const;
 
 	void add_synchronized(const shape_data& shapeData, uint32_t workerIndex);
 	void remove_synchronized(const shape_data& shapeData, uint32_t workerIndex);
 	void move_synchronized(const shape_move& shapeMove, uint32_t workerIndex);
 
+	void add_synchronized(const shape_data& shapeData);
+	void remove_synchronized(const shape_data& shapeData);
+	void move_synchronized(const shape_move& shapeMove);
+
 	void add_exclusive(const shape_data& shapeData);
 	void remove_exclusive(const shape_data& shapeData);
 	void move_exclusive(const shape_move& shapeMove);
 
+	// Same as adding the shapes one by one, but groups of them descend together level by level and the nodes
+	// of the next level are prefetched meanwhile, so the cache misses of different shapes overlap
+	void add_batch_synchronized(std::span<const shape_data> shapes, uint32_t workerIndex);
+	void add_batch_synchronized(std::span<const shape_data> shapes);
+	void add_batch_exclusive(std::span<const shape_data> shapes);
+
+	// A point is kept in exactly one leaf, found from its coordinates without intersection tests. Points must be
+	// removed and moved by these functions as well, points on the border of two leaves belong to the upper one.
+	void add_point_synchronized(const point_data& pointData, uint32_t workerIndex);
+	void remove_point_synchronized(const point_data& pointData, uint32_t workerIndex);
+	void move_point_synchronized(const point_move& pointMove, uint32_t workerIndex);
+
+	void add_point_synchronized(const point_data& pointData);
+	void remove_point_synchronized(const point_data& pointData);
+	void move_point_synchronized(const point_move& pointMove);
+
+	void add_point_exclusive(const point_data& pointData);
+	void remove_point_exclusive(const point_data& pointData);
+	void move_point_exclusive(const point_move& pointMove);
+
 	void prepare_garbage_collection(std::pmr::vector<gc_root>& roots, uint32_t depth = 2);
-	void collect_garbage(gc_root root);
+	// Stops splitting a dirty subtree as soon as its work fits targetWork, or at depth
+	void prepare_garbage_collection(std::pmr::vector<gc_root>& roots, uint32_t depth, uint32_t targetWork);
+	// Must be called before collecting the rest of the roots if the octree was modified after prepare_garbage_collection
+	void resume_garbage_collection();
+	// Returns the number of visited nodes
+	uint32_t collect_garbage(gc_root root);
+	// Roots with more work than targetWork are split into spawnedRoots instead, the caller should schedule them as separate tasks
+	// and join the split root once all of them are collected
+	uint32_t collect_garbage(gc_root root, uint32_t targetWork, std::pmr::vector<gc_root>& spawnedRoots);
+	// Unlinks the spawned roots of a split root which were left empty. Roots split again are joined before their parent.
+	void join_garbage_collection(gc_root root);
+
+	// Returns indices stored in the leaves touched by the box without duplicates, whatever their tags. These are
+	// candidates only, the caller is expected to check the real shapes.
+	void query(const aabb& aabbQuery, std::pmr::vector<uint32_t>& result) const;
+#ifdef PARALLEL_OCTREE_LEAF_TAGS
+	// Skips entries whose tag has no common bits with tagMask, the tags share cache lines with the indices
+	void query(const aabb& aabbQuery, uint32_t tagMask, std::pmr::vector<uint32_t>& result) const;
+#endif
+
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+	// Appends the cells of the leaves which got entries added or removed since the previous call and starts over.
+	// Every leaf is logged once, a cell shows up twice only if the GC unlinked its leaf and a later add created
+	// it again. Must not run concurrently with modifications.
+	void consume_dirty(std::pmr::vector<cell>& result);
+#endif
+
+	// Same as a query of every box, but the boxes are sorted in Morton order of their centres and descend in groups
+	// level by level. Runs on the calling thread and must not run concurrently with modifications.
+	void query_batch(std::span<const aabb> queries, batch_result& result) const;
+	// The same in steps for the caller's threads: prepare_query_batch sorts the boxes, splits them into at most
+	// partsCount parts and returns their number, query_batch_part may then run concurrently for every part, and
+	// finish_query_batch joins their candidates. The boxes must stay alive until then.
+	size_t prepare_query_batch(std::span<const aabb> queries, batch_result& result, size_t partsCount) const;
+	void query_batch_part(batch_result& result, size_t partIndex) const;
+	void finish_query_batch(batch_result& result) const;
+
+	// Number of live entries in the leaves touched by the box, the leaves query collects the candidates from.
+	// A shape is counted once per leaf. With occupancy counts the subtrees inside the box are not walked.
+	size_t count_in_aabb(const aabb& aabbQuery) const;
+
+	// Walks the whole tree, on several threads for large arenas. Must not run concurrently with modifications.
+	statistics compute_statistics() const;
+
+	// Marks the cells at the level, from 0 for the root to size_log() for the leaves, which hold live entries.
+	// Walks the whole tree like compute_statistics; with occupancy counts nothing below the level is visited.
+	void rasterize_occupancy(uint32_t level, occupancy_bitmap& result) const;
+
+	// Writes the used part of the arena, defragment first to leave freed chunks out. Needs exclusive access.
+	void save(const std::filesystem::path& path) const;
+
+	// Copies live nodes into a new arena of the same size in depth-first order, siblings next to each other.
+	// Tombstones are dropped on the way. Needs exclusive access and a second arena for the time of the copy.
+	void defragment();
+
+	// Copies the used part of the arena as is, relative pointers stay valid. Chunks waiting in the free lists
+	// are not reused by the copy. Needs exclusive access, the copy is writable even if the octree is read-only.
+	// The arena of the copy has bufferSize bytes, 0 takes the size of the octree a read-only one was saved from.
+	std::unique_ptr<parallel_octree> clone(size_t bufferSize = 0) const;
+
+	// Every following modification and GC call is written to the recorder, nullptr stops the recording.
+	// Must not be called concurrently with other operations.
+	void set_recorder(operation_recorder* recorder);
+
+	// Add batches, GC root preparation, collect_garbage calls and allocator refills of the following calls are recorded
+	// into the trace, nullptr stops the tracing. Must not be called concurrently with other operations.
+	void set_event_trace(event_trace* trace);
+
+#ifdef PARALLEL_OCTREE_LATENCY_HISTOGRAMS
+	// Adds latencies of the synchronized operations and add batches of all workers and of collect_garbage to result.
+	// Calls in flight may be missed. Must not run concurrently with reset_latency_histograms.
+	void merge_latency_histograms(latency_histograms& result) const;
+	void reset_latency_histograms();
+#endif
 
 private:
+	parallel_octree(const uint8_t* data, size_t size, uint32_t sizeLog, size_t rootOffset, size_t originalCapacity);
+	// The first usedSize bytes of the arena are reserved for the copied nodes
+	parallel_octree(uint32_t sizeLog, size_t bufferSize, size_t usedSize, uint32_t workersCount, size_t rootOffset);
+
+	static void copy_memory(uint8_t* destination, const uint8_t* source, size_t size);
+
+	template <bool Synchronized>
+	void add_tombstones(uint32_t count);
+
+	worker& get_worker(uint32_t workerIndex) const;
+	worker& get_thread_worker();
+	worker& register_thread_worker();
+
 	aabb initial_aabb() const;
+	// Throws std::logic_error for octrees opened read-only, their arena is mapped without write access
+	void check_writable() const;
 
 	static aabb aabb_0(const aabb& aabb, const point& centre);
 	static aabb aabb_1(const aabb& aabb, const point& centre);
@@ -96,8 +390,29 @@ private:
 	static aabb aabb_6(const aabb& aabb, const point& centre);
 	static aabb aabb_7(const aabb& aabb, const point& centre);
 
+	// Children in the order of aabb_0 - aabb_7
+	static void split_aabb(const aabb& aabb, parallel_octree::aabb (&octants)[8]);
+	// Bit i is set if octants[i] intersects aabb
+	static uint32_t intersected_octants(const aabb& aabb, const parallel_octree::aabb (&octants)[8]);
+	// Starts loading the existing children of the octants in mask, so that their cache misses overlap
+	static void prefetch_children(const tree& currentTree, uint32_t mask);
+	// True for trees without live entries when they are counted, Levels is the number of levels below the node
+	template <uint32_t Levels>
+	static bool is_empty(const node& currentNode);
+
 	static bool are_intersected(const aabb& left, const aabb& right);
 	static bool are_intersected(const shape_data& shape, const aabb& aabb);
 
 	static point calculate_centre(const aabb& aabb);
+
+	static uint32_t leaf_capacity();
+	// Bits of the build options which change the node layout
+	static uint32_t layout_flags();
+
+	// The tree at the position of a recorded GC root, none if it is missing or isMarked is set and it is not marked for the GC
+	std::optional<gc_root> find_gc_root(uint32_t depth, const cell& rootCell, bool isMarked);
+
+	friend class shared_octree_writer;
+	friend class shared_octree_reader;
+	friend class operation_replay;
 };
@@ -11,6 +11,7 @@ template <typename T, typename TOffset = int32_t>
 class relative_ptr final
 {
 private:
+	// Loads acquire and stores release, so the contents of a node are visible to whoever sees the pointer to it
 	std::atomic<TOffset> _offset;
 
 public:
@@ -33,19 +34,19 @@ public:
 	template <typename TOtherOffset>
 	relative_ptr<T, TOffset>& operator = (const relative_ptr<T, TOtherOffset>& rhs)
 	{
-		_offset = get_diff(rhs.get());
+		_offset.store(get_diff(rhs.get()), std::memory_order_release);
 		return *this;
 	}
 
 	relative_ptr<T, TOffset>& operator = (T* ptr)
 	{
-		_offset = get_diff(ptr);
+		_offset.store(get_diff(ptr), std::memory_order_release);
 		return *this;
 	}
 
 	operator bool() const
 	{
-		return _offset != 0;
+		return _offset.load(std::memory_order_acquire) != 0;
 	}
 
 	template <typename TOtherOffset>
@@ -70,15 +71,15 @@ public:
 		return !operator==(rhs);
 	}
 
-	T* get()
+	T* get() const
 	{
-		return from_diff(_offset);
+		return from_diff(_offset.load(std::memory_order_acquire));
 	}
 
 	bool compare_exchange(T*& expected, T* desired)
 	{
 		TOffset expectedDiff = get_diff(expected);
-		const bool result = _offset.compare_exchange_strong(expectedDiff, get_diff(desired));
+		const bool result = _offset.compare_exchange_strong(expectedDiff, get_diff(desired), std::memory_order_acq_rel, std::memory_order_acquire);
 		expected = from_diff(expectedDiff);
 		return result;
 	}
@@ -101,15 +102,15 @@ private:
 		return TOffset(diff);
 	}
 
-	T* from_diff(TOffset offset)
+	T* from_diff(TOffset offset) const
 	{
 		if (offset == 0)
 		{
 			return nullptr;
 		}
-		void* const thisPtr = this;
-		void* const valuePtr = static_cast<uint8_t*>(thisPtr) + offset;
-		return static_cast<T*>(valuePtr);
+		const void* const thisPtr = this;
+		const void* const valuePtr = static_cast<const uint8_t*>(thisPtr) + offset;
+		return static_cast<T*>(const_cast<void*>(valuePtr));
 	}
 };
 
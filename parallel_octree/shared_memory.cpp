@@ -0,0 +1,176 @@
+#include "shared_memory.h"
+
+#include <system_error>
+#include <cassert>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#ifdef _WIN32
+
+static std::wstring mapping_name(const std::string& name)
+{
+	return L"Local\\" + std::wstring(name.begin(), name.end());
+}
+
+shared_memory::shared_memory(const std::string& name, size_t size)
+	: _name (name)
+	, _isOwner (true)
+	, _mapping (nullptr)
+{
+	const uint64_t size64 = size;
+	_mapping = CreateFileMappingW(
+		INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		DWORD(size64 >> 32), DWORD(size64 & 0xFFFFFFFFu),
+		mapping_name(name).c_str()
+		);
+
+	if (!_mapping)
+	{
+		throw std::system_error(int(GetLastError()), std::system_category(), name);
+	}
+
+	if (GetLastError() == ERROR_ALREADY_EXISTS)
+	{
+		close();
+		throw std::system_error(ERROR_ALREADY_EXISTS, std::system_category(), name);
+	}
+}
+
+shared_memory::shared_memory(const std::string& name)
+	: _name (name)
+	, _isOwner (false)
+	, _mapping (nullptr)
+{
+	_mapping = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, mapping_name(name).c_str());
+
+	if (!_mapping)
+	{
+		throw std::system_error(int(GetLastError()), std::system_category(), name);
+	}
+}
+
+uint8_t* shared_memory::map(size_t offset, size_t size, bool isWritable)
+{
+	assert(offset % ALLOCATION_GRANULARITY == 0);
+
+	const uint64_t offset64 = offset;
+	void* const data = MapViewOfFile(
+		_mapping, isWritable ? FILE_MAP_READ | FILE_MAP_WRITE : FILE_MAP_READ,
+		DWORD(offset64 >> 32), DWORD(offset64 & 0xFFFFFFFFu), size
+		);
+
+	if (!data)
+	{
+		throw std::system_error(int(GetLastError()), std::system_category(), _name);
+	}
+
+	_regions.push_back({ static_cast<uint8_t*>(data), size });
+	return static_cast<uint8_t*>(data);
+}
+
+void shared_memory::close() noexcept
+{
+	for (const region& currentRegion : _regions)
+	{
+		UnmapViewOfFile(currentRegion.Data);
+	}
+	_regions.clear();
+
+	if (_mapping)
+	{
+		CloseHandle(_mapping);
+		_mapping = nullptr;
+	}
+}
+
+#else
+
+static std::string segment_name(const std::string& name)
+{
+	return "/" + name;
+}
+
+shared_memory::shared_memory(const std::string& name, size_t size)
+	: _name (name)
+	, _isOwner (true)
+	, _file (-1)
+{
+	// Another writer's segment is never taken over, its readers would see the header being reset
+	_file = shm_open(segment_name(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+	if (_file < 0)
+	{
+		throw std::system_error(errno, std::generic_category(), name);
+	}
+
+	if (ftruncate(_file, off_t(size)) != 0)
+	{
+		const int error = errno;
+		close();
+		throw std::system_error(error, std::generic_category(), name);
+	}
+}
+
+shared_memory::shared_memory(const std::string& name)
+	: _name (name)
+	, _isOwner (false)
+	, _file (-1)
+{
+	_file = shm_open(segment_name(name).c_str(), O_RDWR, 0);
+
+	if (_file < 0)
+	{
+		throw std::system_error(errno, std::generic_category(), name);
+	}
+}
+
+uint8_t* shared_memory::map(size_t offset, size_t size, bool isWritable)
+{
+	assert(offset % ALLOCATION_GRANULARITY == 0);
+
+	void* const data = mmap(nullptr, size, isWritable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, _file, off_t(offset));
+
+	if (data == MAP_FAILED)
+	{
+		throw std::system_error(errno, std::generic_category(), _name);
+	}
+
+	_regions.push_back({ static_cast<uint8_t*>(data), size });
+	return static_cast<uint8_t*>(data);
+}
+
+void shared_memory::close() noexcept
+{
+	for (const region& currentRegion : _regions)
+	{
+		munmap(currentRegion.Data, currentRegion.Size);
+	}
+	_regions.clear();
+
+	if (_file >= 0)
+	{
+		::close(_file);
+		_file = -1;
+
+		if (_isOwner)
+		{
+			shm_unlink(segment_name(_name).c_str());
+		}
+	}
+}
+
+#endif
+
+shared_memory::~shared_memory()
+{
+	close();
+}
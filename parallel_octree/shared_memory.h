@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Named memory segment shared between processes. The process which creates it removes the name on destruction.
+class shared_memory final
+{
+private:
+	struct region final
+	{
+		uint8_t* Data;
+		size_t Size;
+	};
+
+private:
+	std::string _name;
+	bool _isOwner;
+	std::vector<region> _regions;
+
+#ifdef _WIN32
+	void* _mapping;
+#else
+	int _file;
+#endif
+
+public:
+	// Creates the segment and maps nothing yet. Fails if the name exists; on POSIX systems a segment left by a crashed
+	// owner keeps its name until shm_unlink.
+	shared_memory(const std::string& name, size_t size);
+	// Opens the existing segment
+	explicit shared_memory(const std::string& name);
+	~shared_memory();
+
+	shared_memory(const shared_memory&) = delete;
+	const shared_memory& operator = (const shared_memory&) = delete;
+
+	// Offset has to be a multiple of ALLOCATION_GRANULARITY, the mapping lives as long as the object
+	uint8_t* map(size_t offset, size_t size, bool isWritable);
+
+	// The coarsest granularity of the supported platforms, 64 KiB on Windows
+	static constexpr size_t ALLOCATION_GRANULARITY = 64 * 1024;
+
+private:
+	void close() noexcept;
+};
@@ -0,0 +1,209 @@
+#include "shared_octree.h"
+
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <cstring>
+#include <cassert>
+
+struct shared_octree_writer::header final
+{
+	static constexpr uint32_t MAGIC = 0x4D534F50; // "POSM"
+	static constexpr uint32_t VERSION = 3;
+	static constexpr uint32_t NO_SLOT = 0xFFFFFFFFu;
+
+	struct slot final
+	{
+		uint64_t RootOffset;
+		uint64_t UsedSize;
+		uint64_t Sequence;
+		// Arena size of the published octree, clones of the snapshot get it back
+		uint64_t Capacity;
+		uint32_t SizeLog;
+	};
+
+	std::atomic<uint32_t> Magic;
+	uint32_t Version;
+	uint32_t LeafCapacity;
+	uint32_t LayoutFlags;
+	uint64_t SlotCapacity;
+
+	std::atomic<uint32_t> Active;
+	slot Slots[2];
+
+	// Readers pinning each slot, the writer does not overwrite a slot while its counter is not zero
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> Readers0;
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> Readers1;
+
+	std::atomic<uint32_t>& readers(uint32_t slotIndex)
+	{
+		return slotIndex == 0 ? Readers0 : Readers1;
+	}
+};
+
+static size_t round_to_granularity(size_t size)
+{
+	const size_t granularity = shared_memory::ALLOCATION_GRANULARITY;
+	return (size + granularity - 1) / granularity * granularity;
+}
+
+shared_octree_writer::shared_octree_writer(const std::string& name, size_t slotCapacity)
+	: _memory (name, shared_memory::ALLOCATION_GRANULARITY + 2 * round_to_granularity(slotCapacity))
+	, _header (nullptr)
+	, _slots (nullptr)
+	, _slotCapacity (round_to_granularity(slotCapacity))
+{
+	static_assert(sizeof(header) <= shared_memory::ALLOCATION_GRANULARITY);
+	static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+	_header = new (_memory.map(0, shared_memory::ALLOCATION_GRANULARITY, true)) header();
+	_slots = _memory.map(shared_memory::ALLOCATION_GRANULARITY, 2 * _slotCapacity, true);
+
+	_header->Version = header::VERSION;
+	_header->LeafCapacity = parallel_octree::leaf_capacity();
+	_header->LayoutFlags = parallel_octree::layout_flags();
+	_header->SlotCapacity = _slotCapacity;
+	_header->Active.store(header::NO_SLOT);
+	_header->Magic.store(header::MAGIC);
+}
+
+bool shared_octree_writer::try_publish(const parallel_octree& octree)
+{
+	const size_t usedSize = octree._allocator.used_size();
+
+	if (usedSize > _slotCapacity)
+		[[unlikely]]
+	{
+		throw std::length_error("shared_octree_writer: the octree does not fit into the slot");
+	}
+
+	const uint32_t active = _header->Active.load();
+	const uint32_t target = active == header::NO_SLOT ? 0 : 1 - active;
+
+	// Readers which have just loaded the old index may still increment the counter, they recheck the index afterwards
+	if (_header->readers(target).load() != 0)
+	{
+		return false;
+	}
+
+	std::memcpy(_slots + target * _slotCapacity, octree._allocator.data(), usedSize);
+
+	header::slot& slot = _header->Slots[target];
+	slot.RootOffset = uint64_t(reinterpret_cast<const uint8_t*>(octree._root) - octree._allocator.data());
+	slot.UsedSize = usedSize;
+	slot.Capacity = octree._originalCapacity;
+	slot.SizeLog = octree._sizeLog;
+	slot.Sequence = active == header::NO_SLOT ? 1 : _header->Slots[active].Sequence + 1;
+
+	_header->Active.store(target);
+
+	return true;
+}
+
+void shared_octree_writer::publish(const parallel_octree& octree)
+{
+	while (!try_publish(octree))
+	{
+		std::this_thread::yield();
+	}
+}
+
+bool shared_octree_writer::publish(const parallel_octree& octree, std::chrono::microseconds timeout)
+{
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	while (!try_publish(octree))
+	{
+		if (std::chrono::steady_clock::now() >= deadline)
+		{
+			return false;
+		}
+
+		std::this_thread::yield();
+	}
+
+	return true;
+}
+
+shared_octree_reader::shared_octree_reader(const std::string& name)
+	: _memory (name)
+	, _header (nullptr)
+	, _slots (nullptr)
+	, _slotCapacity (0)
+{
+	_header = reinterpret_cast<shared_octree_writer::header*>(_memory.map(0, shared_memory::ALLOCATION_GRANULARITY, true));
+
+	if (_header->Magic.load() != shared_octree_writer::header::MAGIC)
+	{
+		throw std::runtime_error("shared_octree_reader: " + name + " is not an octree segment");
+	}
+
+	if (_header->Version != shared_octree_writer::header::VERSION || _header->LeafCapacity != parallel_octree::leaf_capacity() ||
+		_header->LayoutFlags != parallel_octree::layout_flags())
+	{
+		throw std::runtime_error("shared_octree_reader: " + name + " has an incompatible format");
+	}
+
+	_slotCapacity = size_t(_header->SlotCapacity);
+	_slots = _memory.map(shared_memory::ALLOCATION_GRANULARITY, 2 * _slotCapacity, false);
+}
+
+shared_octree_reader::snapshot shared_octree_reader::acquire()
+{
+	using header = shared_octree_writer::header;
+
+	uint32_t active = _header->Active.load();
+
+	for (;;)
+	{
+		if (active == header::NO_SLOT)
+		{
+			return snapshot(nullptr, header::NO_SLOT, 0, nullptr);
+		}
+
+		_header->readers(active).fetch_add(1);
+
+		const uint32_t current = _header->Active.load();
+		if (current == active)
+			[[likely]]
+		{
+			break;
+		}
+
+		_header->readers(active).fetch_sub(1);
+		active = current;
+	}
+
+	const header::slot& slot = _header->Slots[active];
+
+	std::unique_ptr<parallel_octree> octree(
+		new parallel_octree(_slots + active * _slotCapacity, size_t(slot.UsedSize), slot.SizeLog, size_t(slot.RootOffset), size_t(slot.Capacity))
+		);
+
+	return snapshot(this, active, slot.Sequence, std::move(octree));
+}
+
+shared_octree_reader::snapshot::snapshot(shared_octree_reader* reader, uint32_t slot, uint64_t sequence, std::unique_ptr<parallel_octree> octree)
+	: _reader (reader)
+	, _slot (slot)
+	, _sequence (sequence)
+	, _octree (std::move(octree))
+{
+}
+
+shared_octree_reader::snapshot::snapshot(snapshot&& other) noexcept
+	: _reader (other._reader)
+	, _slot (other._slot)
+	, _sequence (other._sequence)
+	, _octree (std::move(other._octree))
+{
+	other._reader = nullptr;
+}
+
+shared_octree_reader::snapshot::~snapshot()
+{
+	if (_reader)
+	{
+		_reader->_header->readers(_slot).fetch_sub(1);
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <memory>
+
+#include "parallel_octree.h"
+#include "shared_memory.h"
+
+// One process publishes snapshots of its octree into a shared memory segment, others map it and run queries.
+// The segment holds two slots: the writer fills the one readers do not use and then switches readers to it.
+class shared_octree_writer final
+{
+private:
+	struct header;
+
+private:
+	shared_memory _memory;
+	header* _header;
+	uint8_t* _slots;
+	size_t _slotCapacity;
+
+public:
+	// slotCapacity bounds the used part of the arena of published octrees. Throws std::system_error if the segment
+	// exists already, a live writer keeps it.
+	shared_octree_writer(const std::string& name, size_t slotCapacity);
+
+	shared_octree_writer(const shared_octree_writer&) = delete;
+	const shared_octree_writer& operator = (const shared_octree_writer&) = delete;
+
+	// Fails if a reader still holds the snapshot published before the last one.
+	// The octree must not be modified during the call.
+	bool try_publish(const parallel_octree& octree);
+	// Waits for such readers. A reader process which died while holding a snapshot never releases its slot, so
+	// without live readers this call never returns.
+	void publish(const parallel_octree& octree);
+	// Gives up after timeout and returns false
+	bool publish(const parallel_octree& octree, std::chrono::microseconds timeout);
+
+	friend class shared_octree_reader;
+};
+
+class shared_octree_reader final
+{
+public:
+	// Keeps the slot from being overwritten while it is alive
+	class snapshot final
+	{
+	private:
+		shared_octree_reader* _reader;
+		uint32_t _slot;
+		uint64_t _sequence;
+		std::unique_ptr<parallel_octree> _octree;
+
+	public:
+		snapshot(snapshot&& other) noexcept;
+		~snapshot();
+
+		snapshot(const snapshot&) = delete;
+		const snapshot& operator = (const snapshot&) = delete;
+
+		bool is_valid() const
+		{
+			return _octree != nullptr;
+		}
+
+		// Number of the publication, starting from 1
+		uint64_t sequence() const
+		{
+			return _sequence;
+		}
+
+		const parallel_octree& octree() const
+		{
+			return *_octree;
+		}
+
+	private:
+		snapshot(shared_octree_reader* reader, uint32_t slot, uint64_t sequence, std::unique_ptr<parallel_octree> octree);
+
+		friend class shared_octree_reader;
+	};
+
+private:
+	shared_memory _memory;
+	shared_octree_writer::header* _header;
+	const uint8_t* _slots;
+	size_t _slotCapacity;
+
+public:
+	explicit shared_octree_reader(const std::string& name);
+
+	shared_octree_reader(const shared_octree_reader&) = delete;
+	const shared_octree_reader& operator = (const shared_octree_reader&) = delete;
+
+	// Returns an invalid snapshot until the writer publishes anything
+	snapshot acquire();
+};
@@ -18,13 +18,13 @@ public:
 
 	void unlock() noexcept
 	{
-		assert(_flag == 1);
-		_flag.store(0);
+		assert(_flag.load(std::memory_order_relaxed) == 1);
+		_flag.store(0, std::memory_order_release);
 	}
 
 	bool try_lock() noexcept
 	{
 		uint32_t expected = 0;
-		return _flag.compare_exchange_strong(expected, 1u);
+		return _flag.compare_exchange_strong(expected, 1u, std::memory_order_acquire, std::memory_order_relaxed);
 	}
 };
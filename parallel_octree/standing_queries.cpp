@@ -0,0 +1,139 @@
+#include "standing_queries.h"
+
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+
+#include <algorithm>
+#include <cassert>
+
+static bool are_overlapped(const parallel_octree::aabb& left, const parallel_octree::aabb& right)
+{
+	return
+		left.Min.X <= right.Max.X && right.Min.X <= left.Max.X &&
+		left.Min.Y <= right.Max.Y && right.Min.Y <= left.Max.Y &&
+		left.Min.Z <= right.Max.Z && right.Min.Z <= left.Max.Z;
+}
+
+standing_queries::standing_queries(parallel_octree& octree, uint32_t bufferSize)
+	: _octree (octree)
+	// The GC needs a tree root, a larger field holds the same boxes
+	, _regions (std::max(octree.size_log(), 1u), bufferSize, 1)
+	, _regionsGC (_regions)
+{
+}
+
+uint32_t standing_queries::add(const parallel_octree::aabb& aabb)
+{
+	uint32_t id;
+
+	if (_freeIds.empty())
+	{
+		id = uint32_t(_queries.size());
+		_queries.push_back({});
+		_isPending.push_back(0);
+	}
+	else
+	{
+		id = _freeIds.back();
+		_freeIds.pop_back();
+	}
+
+	_queries[id].AABB = aabb;
+	_queries[id].IsAlive = true;
+
+	_regions.add_exclusive(region(id));
+	make_pending(id);
+
+	return id;
+}
+
+void standing_queries::remove(uint32_t id)
+{
+	assert(id < _queries.size() && _queries[id].IsAlive);
+
+	_regions.remove_exclusive(region(id));
+
+	_queries[id].IsAlive = false;
+	_queries[id].Candidates.clear();
+	_freeIds.push_back(id);
+}
+
+void standing_queries::move(uint32_t id, const parallel_octree::aabb& aabbNew)
+{
+	assert(id < _queries.size() && _queries[id].IsAlive);
+
+	_regions.move_exclusive({ _queries[id].AABB, aabbNew, id });
+	_queries[id].AABB = aabbNew;
+	make_pending(id);
+}
+
+void standing_queries::update(std::span<const parallel_octree::cell> dirtyCells, std::pmr::vector<uint32_t>& changed)
+{
+	_regionsGC.run_slice();
+
+	// Leaves are cells of size 1, a box asks about a leaf when it touches the cell
+	for (const parallel_octree::cell& dirtyCell : dirtyCells)
+	{
+		const parallel_octree::point cellMin{ float(dirtyCell.X), float(dirtyCell.Y), float(dirtyCell.Z) };
+		const parallel_octree::aabb cellAABB{ cellMin, { cellMin.X + 1.0f, cellMin.Y + 1.0f, cellMin.Z + 1.0f } };
+
+		_regions.query(cellAABB, _regionCandidates);
+
+		for (const uint32_t id : _regionCandidates)
+		{
+			if (!_isPending[id] && are_overlapped(_queries[id].AABB, cellAABB))
+			{
+				make_pending(id);
+			}
+		}
+	}
+
+	// Removed queries may stay in the list, their ids may be taken again already
+	_pendingBoxes.clear();
+	std::erase_if(_pending, [this](uint32_t id) { _isPending[id] = 0; return !_queries[id].IsAlive; });
+
+	for (const uint32_t id : _pending)
+	{
+		_pendingBoxes.push_back(_queries[id].AABB);
+	}
+
+	_octree.query_batch(_pendingBoxes, _batchResult);
+
+	for (size_t i = 0; i < _pending.size(); ++i)
+	{
+		const parallel_octree::batch_result::range& range = _batchResult.Ranges[i];
+		const auto first = _batchResult.Indices.cbegin() + range.Begin;
+		const auto last = _batchResult.Indices.cbegin() + range.End;
+
+		std::vector<uint32_t>& candidates = _queries[_pending[i]].Candidates;
+
+		if (!std::equal(first, last, candidates.cbegin(), candidates.cend()))
+		{
+			candidates.assign(first, last);
+			changed.push_back(_pending[i]);
+		}
+	}
+
+	_pending.clear();
+}
+
+const std::vector<uint32_t>& standing_queries::candidates(uint32_t id) const
+{
+	assert(id < _queries.size());
+	return _queries[id].Candidates;
+}
+
+parallel_octree::shape_data standing_queries::region(uint32_t id) const
+{
+	return { _queries[id].AABB, id };
+}
+
+void standing_queries::make_pending(uint32_t id)
+{
+	if (!_isPending[id])
+	{
+		_isPending[id] = 1;
+		_pending.push_back(id);
+	}
+}
+
+#endif
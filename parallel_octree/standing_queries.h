@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+#include "parallel_octree.h"
+#include "gc_scheduler.h"
+
+#ifdef PARALLEL_OCTREE_DIRTY_LEAVES
+
+// Keeps the candidates of boxes asked about every update, like trigger volumes. The boxes are kept in an octree
+// of their own; update takes the cells of the changed leaves, as consume_dirty returns them, and queries again only
+// the boxes touching one of them. The caller consumes the dirty cells and hands them to every consumer.
+class standing_queries final
+{
+private:
+	struct standing_query final
+	{
+		parallel_octree::aabb AABB;
+		// Sorted, as query returns them
+		std::vector<uint32_t> Candidates;
+		bool IsAlive;
+	};
+
+private:
+	parallel_octree& _octree;
+	// Entry indices are query ids
+	parallel_octree _regions;
+	// Moved and removed boxes leave tombstones in _regions, a slice runs every update
+	gc_scheduler _regionsGC;
+
+	std::vector<standing_query> _queries;
+	std::vector<uint32_t> _freeIds;
+	std::vector<uint8_t> _isPending;
+	std::vector<uint32_t> _pending;
+
+	// Reused by update
+	std::pmr::vector<uint32_t> _regionCandidates;
+	std::vector<parallel_octree::aabb> _pendingBoxes;
+	parallel_octree::batch_result _batchResult;
+
+public:
+	// The arena of bufferSize bytes holds the boxes
+	standing_queries(parallel_octree& octree, uint32_t bufferSize);
+
+	standing_queries(const standing_queries&) = delete;
+	const standing_queries& operator = (const standing_queries&) = delete;
+
+	// Candidates of new and moved boxes are found by the next update
+	uint32_t add(const parallel_octree::aabb& aabb);
+	void remove(uint32_t id);
+	void move(uint32_t id, const parallel_octree::aabb& aabbNew);
+
+	// Queries again the boxes touching the dirty cells and appends the ids whose candidates differ. Candidates of
+	// a new box start empty, under a reused id as well, so a new box which finds nothing is not reported.
+	// Must not run concurrently with modifications of the octree.
+	void update(std::span<const parallel_octree::cell> dirtyCells, std::pmr::vector<uint32_t>& changed);
+
+	// As of the last update
+	const std::vector<uint32_t>& candidates(uint32_t id) const;
+
+private:
+	parallel_octree::shape_data region(uint32_t id) const;
+	void make_pending(uint32_t id);
+};
+
+#endif
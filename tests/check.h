@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+// Failed checks throw, the test executable reports the message and exits with an error
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+			[[unlikely]] \
+		{ \
+			throw std::runtime_error(std::string(__FILE__) + ":" + std::to_string(__LINE__) + ": " #condition); \
+		} \
+	} while (false)
@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <exception>
+#include <memory_resource>
+#include <random>
+#include <vector>
+
+#include "parallel_octree.h"
+#include "check.h"
+
+namespace
+{
+	std::vector<parallel_octree::shape_data> generate_shapes(float fieldSize, uint32_t count)
+	{
+		std::minstd_rand0 rand(count);
+		std::uniform_real_distribution<float> coordinate(0.0f, fieldSize - 1.0f);
+
+		std::vector<parallel_octree::shape_data> shapes;
+		shapes.reserve(count);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const parallel_octree::point min{ coordinate(rand), coordinate(rand), coordinate(rand) };
+			shapes.push_back({ { min, { min.X + 0.5f, min.Y + 0.5f, min.Z + 0.5f } }, i });
+		}
+
+		return shapes;
+	}
+
+	// Spawned roots are collected depth first, so every split root is joined after all of them
+	void collect_split(parallel_octree& octree, parallel_octree::gc_root root, uint32_t targetWork)
+	{
+		std::pmr::vector<parallel_octree::gc_root> spawnedRoots;
+		octree.collect_garbage(root, targetWork, spawnedRoots);
+
+		if (spawnedRoots.empty())
+		{
+			return;
+		}
+
+		for (const parallel_octree::gc_root& spawnedRoot : spawnedRoots)
+		{
+			collect_split(octree, spawnedRoot, targetWork);
+		}
+
+		octree.join_garbage_collection(root);
+	}
+
+	std::vector<size_t> nodes_after_removing_all(bool split)
+	{
+		parallel_octree octree(6, 64 * 1024 * 1024, 1);
+		const std::vector<parallel_octree::shape_data> shapes = generate_shapes(octree.field_size(), 20000);
+
+		for (const parallel_octree::shape_data& shape : shapes)
+		{
+			octree.add_exclusive(shape);
+		}
+
+		for (const parallel_octree::shape_data& shape : shapes)
+		{
+			octree.remove_exclusive(shape);
+		}
+
+		std::pmr::vector<parallel_octree::gc_root> roots;
+
+		if (split)
+		{
+			octree.prepare_garbage_collection(roots, 2, 64);
+
+			for (const parallel_octree::gc_root& root : roots)
+			{
+				collect_split(octree, root, 64);
+			}
+		}
+		else
+		{
+			octree.prepare_garbage_collection(roots, 2);
+
+			for (const parallel_octree::gc_root& root : roots)
+			{
+				octree.collect_garbage(root);
+			}
+		}
+
+		CHECK(octree.pending_gc_work() == 0);
+		CHECK(octree.compute_statistics().EntriesCount == 0);
+
+		octree.prepare_garbage_collection(roots, 2);
+		CHECK(roots.empty());
+
+		return octree.compute_statistics().NodesPerLevel;
+	}
+
+	void split_gc_frees_emptied_roots()
+	{
+		const std::vector<size_t> baseline = nodes_after_removing_all(false);
+		const std::vector<size_t> split = nodes_after_removing_all(true);
+
+		CHECK(baseline.size() == 3);
+		CHECK(split == baseline);
+	}
+}
+
+int main()
+{
+	try
+	{
+		split_gc_frees_emptied_roots();
+	}
+	catch (const std::exception& excp)
+	{
+		std::fprintf(stderr, "%s\n", excp.what());
+		return 1;
+	}
+
+	return 0;
+}
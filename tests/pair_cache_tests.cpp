@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <memory_resource>
+#include <random>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "parallel_octree.h"
+#include "pair_cache.h"
+#include "check.h"
+
+// The pairs reported by the cache are accumulated over the ticks and compared with all pairs of overlapping boxes
+namespace
+{
+	constexpr uint32_t SIZE_LOG = 4;
+	constexpr uint32_t WORKERS_COUNT = 2;
+	constexpr uint32_t SHAPES_COUNT = 3000;
+	constexpr uint32_t TICKS_COUNT = 12;
+	constexpr size_t PARTS_COUNT = 4;
+
+	struct shape_state final
+	{
+		parallel_octree::aabb AABB;
+		bool IsAlive = false;
+	};
+
+	bool are_overlapped(const parallel_octree::aabb& left, const parallel_octree::aabb& right)
+	{
+		return
+			left.Min.X <= right.Max.X && right.Min.X <= left.Max.X &&
+			left.Min.Y <= right.Max.Y && right.Min.Y <= left.Max.Y &&
+			left.Min.Z <= right.Max.Z && right.Min.Z <= left.Max.Z;
+	}
+
+	parallel_octree::aabb random_aabb(std::minstd_rand0& rand, float fieldSize)
+	{
+		std::uniform_real_distribution<float> coordinate(0.0f, fieldSize - 1.0f);
+		std::uniform_real_distribution<float> size(0.0f, 1.0f);
+
+		const parallel_octree::point min{ coordinate(rand), coordinate(rand), coordinate(rand) };
+		return { min, { min.X + size(rand), min.Y + size(rand), min.Z + size(rand) } };
+	}
+
+	void apply_events(std::set<std::pair<uint32_t, uint32_t>>& pairs, const std::pmr::vector<pair_cache::pair>& begun, const std::pmr::vector<pair_cache::pair>& ended)
+	{
+		// A pair either begins or ends in one update, and only once
+		for (const pair_cache::pair& currentPair : ended)
+		{
+			CHECK(currentPair.First < currentPair.Second);
+			CHECK(pairs.erase({ currentPair.First, currentPair.Second }) == 1);
+		}
+
+		for (const pair_cache::pair& currentPair : begun)
+		{
+			CHECK(currentPair.First < currentPair.Second);
+			CHECK(pairs.insert({ currentPair.First, currentPair.Second }).second);
+		}
+	}
+
+	void check_pairs(const pair_cache& cache, const std::vector<shape_state>& states, const std::set<std::pair<uint32_t, uint32_t>>& pairs)
+	{
+		std::set<std::pair<uint32_t, uint32_t>> expected;
+		std::vector<std::vector<uint32_t>> expectedPartners(states.size());
+
+		for (uint32_t i = 0; i < states.size(); ++i)
+		{
+			for (uint32_t j = i + 1; j < states.size(); ++j)
+			{
+				if (states[i].IsAlive && states[j].IsAlive && are_overlapped(states[i].AABB, states[j].AABB))
+				{
+					expected.insert({ i, j });
+					expectedPartners[i].push_back(j);
+					expectedPartners[j].push_back(i);
+				}
+			}
+		}
+
+		CHECK(pairs == expected);
+
+		for (uint32_t i = 0; i < states.size(); ++i)
+		{
+			std::sort(expectedPartners[i].begin(), expectedPartners[i].end());
+			CHECK(cache.partners(i) == expectedPartners[i]);
+		}
+	}
+
+	// Every worker moves the alive shapes of its half of the indices
+	void move_synchronized(pair_cache& cache, std::vector<shape_state>& states, float fieldSize, uint32_t tick)
+	{
+		std::vector<std::thread> threads;
+
+		for (uint32_t workerIndex = 0; workerIndex < WORKERS_COUNT; ++workerIndex)
+		{
+			threads.emplace_back([&cache, &states, fieldSize, tick, workerIndex]
+			{
+				std::minstd_rand0 rand(tick * WORKERS_COUNT + workerIndex + 1);
+				const uint32_t first = workerIndex * SHAPES_COUNT / WORKERS_COUNT;
+				const uint32_t last = (workerIndex + 1) * SHAPES_COUNT / WORKERS_COUNT;
+
+				for (uint32_t index = first; index < last; ++index)
+				{
+					if (states[index].IsAlive && rand() % 2 == 0)
+					{
+						states[index].AABB = random_aabb(rand, fieldSize);
+						cache.move_synchronized(index, states[index].AABB, workerIndex);
+					}
+				}
+			});
+		}
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+	}
+
+	void update_in_parts(pair_cache& cache, std::pmr::vector<pair_cache::pair>& begun, std::pmr::vector<pair_cache::pair>& ended)
+	{
+		const size_t partsCount = cache.prepare_update(PARTS_COUNT);
+		CHECK(partsCount > 1);
+
+		std::vector<std::thread> threads;
+
+		for (size_t i = 0; i < partsCount; ++i)
+		{
+			threads.emplace_back([&cache, i] { cache.update_part(i); });
+		}
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		cache.finish_update(begun, ended);
+	}
+
+	void events_match_overlaps()
+	{
+		parallel_octree octree(SIZE_LOG, 64 * 1024 * 1024, WORKERS_COUNT);
+		pair_cache cache(octree, WORKERS_COUNT);
+		cache.reserve(SHAPES_COUNT);
+
+		std::minstd_rand0 rand(1);
+		std::vector<shape_state> states(SHAPES_COUNT);
+		std::set<std::pair<uint32_t, uint32_t>> pairs;
+		std::pmr::vector<pair_cache::pair> begun;
+		std::pmr::vector<pair_cache::pair> ended;
+
+		for (uint32_t index = 0; index < SHAPES_COUNT; index += 2)
+		{
+			states[index] = { random_aabb(rand, octree.field_size()), true };
+			cache.add({ states[index].AABB, index });
+		}
+
+		for (uint32_t tick = 0; tick < TICKS_COUNT; ++tick)
+		{
+			// Exclusive changes of a few shapes, then synchronized moves which touch most of them again
+			for (uint32_t i = 0; i < SHAPES_COUNT / 10; ++i)
+			{
+				const uint32_t index = rand() % SHAPES_COUNT;
+
+				if (!states[index].IsAlive)
+				{
+					states[index] = { random_aabb(rand, octree.field_size()), true };
+					cache.add({ states[index].AABB, index });
+				}
+				else if (rand() % 2 == 0)
+				{
+					states[index].IsAlive = false;
+					cache.remove(index);
+				}
+				else
+				{
+					states[index].AABB = random_aabb(rand, octree.field_size());
+					cache.move(index, states[index].AABB);
+				}
+			}
+
+			// Odd ticks leave the synchronized moves out, so a tick of few touched shapes runs in one part
+			if (tick % 2 == 0)
+			{
+				move_synchronized(cache, states, octree.field_size(), tick);
+			}
+
+			begun.clear();
+			ended.clear();
+
+			if (tick % 2 == 0)
+			{
+				update_in_parts(cache, begun, ended);
+			}
+			else
+			{
+				cache.update(begun, ended);
+			}
+
+			apply_events(pairs, begun, ended);
+			check_pairs(cache, states, pairs);
+		}
+	}
+}
+
+int main()
+{
+	try
+	{
+		events_match_overlaps();
+	}
+	catch (const std::exception& excp)
+	{
+		std::fprintf(stderr, "%s\n", excp.what());
+		return 1;
+	}
+
+	return 0;
+}
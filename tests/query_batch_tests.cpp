@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <memory_resource>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "parallel_octree.h"
+#include "check.h"
+
+// Every range of a batch must hold what a query of its box returns, whether one call or several parts ran it
+namespace
+{
+	constexpr uint32_t SIZE_LOG = 5;
+	constexpr uint32_t SHAPES_COUNT = 20000;
+	constexpr uint32_t QUERIES_COUNT = 3000;
+	constexpr size_t PARTS_COUNT = 4;
+
+	parallel_octree::aabb random_aabb(std::minstd_rand0& rand, float fieldSize, float maxSize)
+	{
+		std::uniform_real_distribution<float> coordinate(0.0f, fieldSize - maxSize);
+		std::uniform_real_distribution<float> size(0.0f, maxSize);
+
+		const parallel_octree::point min{ coordinate(rand), coordinate(rand), coordinate(rand) };
+		return { min, { min.X + size(rand), min.Y + size(rand), min.Z + size(rand) } };
+	}
+
+	void check_ranges(const parallel_octree& octree, const std::vector<parallel_octree::aabb>& queries, const parallel_octree::batch_result& result)
+	{
+		CHECK(result.Ranges.size() == queries.size());
+
+		std::pmr::vector<uint32_t> expected;
+		size_t indicesCount = 0;
+
+		for (size_t i = 0; i < queries.size(); ++i)
+		{
+			const parallel_octree::batch_result::range& range = result.Ranges[i];
+			CHECK(range.Begin <= range.End && range.End <= result.Indices.size());
+
+			octree.query(queries[i], expected);
+			CHECK(std::equal(expected.begin(), expected.end(), result.Indices.begin() + range.Begin, result.Indices.begin() + range.End));
+
+			indicesCount += range.End - range.Begin;
+		}
+
+		// Ranges do not overlap and cover all indices
+		CHECK(indicesCount == result.Indices.size());
+	}
+
+	void run_parts(const parallel_octree& octree, const std::vector<parallel_octree::aabb>& queries, parallel_octree::batch_result& result)
+	{
+		const size_t partsCount = octree.prepare_query_batch(queries, result, PARTS_COUNT);
+		CHECK(partsCount == PARTS_COUNT);
+
+		std::vector<std::thread> threads;
+
+		for (size_t i = 0; i < partsCount; ++i)
+		{
+			threads.emplace_back([&octree, &result, i] { octree.query_batch_part(result, i); });
+		}
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		octree.finish_query_batch(result);
+	}
+
+	void ranges_match_queries()
+	{
+		parallel_octree octree(SIZE_LOG, 64 * 1024 * 1024, 1);
+		std::minstd_rand0 rand(1);
+
+		for (uint32_t index = 0; index < SHAPES_COUNT; ++index)
+		{
+			octree.add_exclusive({ random_aabb(rand, octree.field_size(), 2.0f), index });
+		}
+
+		// Some boxes find nothing, some span many leaves
+		std::vector<parallel_octree::aabb> queries;
+
+		for (uint32_t i = 0; i < QUERIES_COUNT; ++i)
+		{
+			queries.push_back(random_aabb(rand, octree.field_size(), i % 10 == 0 ? 8.0f : 1.0f));
+		}
+
+		// One result is reused by every batch, its scratch must not leak between them
+		parallel_octree::batch_result result;
+
+		octree.query_batch(queries, result);
+		check_ranges(octree, queries, result);
+
+		run_parts(octree, queries, result);
+		check_ranges(octree, queries, result);
+
+		queries.resize(QUERIES_COUNT / 2);
+		run_parts(octree, queries, result);
+		check_ranges(octree, queries, result);
+
+		octree.query_batch(queries, result);
+		check_ranges(octree, queries, result);
+
+		queries.clear();
+		octree.query_batch(queries, result);
+		CHECK(result.Ranges.empty() && result.Indices.empty());
+	}
+}
+
+int main()
+{
+	try
+	{
+		ranges_match_queries();
+	}
+	catch (const std::exception& excp)
+	{
+		std::fprintf(stderr, "%s\n", excp.what());
+		return 1;
+	}
+
+	return 0;
+}
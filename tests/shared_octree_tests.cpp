@@ -0,0 +1,145 @@
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "parallel_octree.h"
+#include "shared_octree.h"
+#include "check.h"
+
+// The writer and the readers share one process here, the protocol is the same across processes
+namespace
+{
+	constexpr uint32_t SIZE_LOG = 5;
+	constexpr uint32_t SHAPES_PER_PUBLICATION = 2000;
+	constexpr uint32_t QUERIES_COUNT = 200;
+	constexpr size_t SLOT_CAPACITY = 16 * 1024 * 1024;
+
+	parallel_octree::aabb random_aabb(std::minstd_rand0& rand, float fieldSize, float maxSize)
+	{
+		std::uniform_real_distribution<float> coordinate(0.0f, fieldSize - maxSize);
+		std::uniform_real_distribution<float> size(0.0f, maxSize);
+
+		const parallel_octree::point min{ coordinate(rand), coordinate(rand), coordinate(rand) };
+		return { min, { min.X + size(rand), min.Y + size(rand), min.Z + size(rand) } };
+	}
+
+	// Every publication adds shapes, so the results of different ones differ
+	void add_shapes(parallel_octree& octree, std::minstd_rand0& rand, uint32_t& nextIndex)
+	{
+		for (uint32_t i = 0; i < SHAPES_PER_PUBLICATION; ++i)
+		{
+			octree.add_exclusive({ random_aabb(rand, octree.field_size(), 2.0f), nextIndex++ });
+		}
+	}
+
+	void check_same_results(const parallel_octree& expected, const parallel_octree& snapshot)
+	{
+		CHECK(snapshot.size_log() == expected.size_log());
+
+		std::minstd_rand0 rand(2);
+		std::pmr::vector<uint32_t> expectedResult;
+		std::pmr::vector<uint32_t> result;
+
+		for (uint32_t i = 0; i < QUERIES_COUNT; ++i)
+		{
+			const parallel_octree::aabb aabb = random_aabb(rand, expected.field_size(), 8.0f);
+
+			expected.query(aabb, expectedResult);
+			snapshot.query(aabb, result);
+			CHECK(result == expectedResult);
+		}
+	}
+
+	bool throws_system_error(const std::string& name)
+	{
+		try
+		{
+			shared_octree_writer writer(name, SLOT_CAPACITY);
+		}
+		catch (const std::system_error&)
+		{
+			return true;
+		}
+
+		return false;
+	}
+
+	void publish_and_acquire(const std::string& name)
+	{
+		parallel_octree octree(SIZE_LOG, 64 * 1024 * 1024, 1);
+		std::minstd_rand0 rand(1);
+		uint32_t nextIndex = 0;
+
+		shared_octree_writer writer(name, SLOT_CAPACITY);
+		shared_octree_reader reader(name);
+
+		// The segment of a live writer is not taken over
+		CHECK(throws_system_error(name));
+
+		CHECK(!reader.acquire().is_valid());
+
+		add_shapes(octree, rand, nextIndex);
+		writer.publish(octree);
+		const std::unique_ptr<parallel_octree> first = octree.clone();
+
+		shared_octree_reader::snapshot firstSnapshot = reader.acquire();
+		CHECK(firstSnapshot.is_valid());
+		CHECK(firstSnapshot.sequence() == 1);
+		check_same_results(octree, firstSnapshot.octree());
+
+		// The other slot is free
+		add_shapes(octree, rand, nextIndex);
+		CHECK(writer.try_publish(octree));
+		const std::unique_ptr<parallel_octree> second = octree.clone();
+
+		shared_octree_reader::snapshot secondSnapshot = reader.acquire();
+		CHECK(secondSnapshot.sequence() == 2);
+		check_same_results(octree, secondSnapshot.octree());
+
+		// The next publication goes to the slot of the first snapshot
+		add_shapes(octree, rand, nextIndex);
+		CHECK(!writer.try_publish(octree));
+		CHECK(!writer.publish(octree, std::chrono::microseconds(1000)));
+		CHECK(reader.acquire().sequence() == 2);
+
+		// Failed attempts leave the held slots alone
+		check_same_results(*first, firstSnapshot.octree());
+		check_same_results(*second, secondSnapshot.octree());
+
+		{
+			const shared_octree_reader::snapshot released = std::move(firstSnapshot);
+		}
+
+		CHECK(writer.try_publish(octree));
+
+		const shared_octree_reader::snapshot thirdSnapshot = reader.acquire();
+		CHECK(thirdSnapshot.sequence() == 3);
+		check_same_results(octree, thirdSnapshot.octree());
+		check_same_results(*second, secondSnapshot.octree());
+
+		// Now both slots are held
+		add_shapes(octree, rand, nextIndex);
+		CHECK(!writer.try_publish(octree));
+	}
+}
+
+int main()
+{
+	try
+	{
+		publish_and_acquire("parallel_octree_shared_tests_" + std::to_string(std::random_device()()));
+	}
+	catch (const std::exception& excp)
+	{
+		std::fprintf(stderr, "%s\n", excp.what());
+		return 1;
+	}
+
+	return 0;
+}
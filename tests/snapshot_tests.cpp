@@ -0,0 +1,221 @@
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "parallel_octree.h"
+#include "check.h"
+
+namespace
+{
+	constexpr uint32_t SIZE_LOG = 5;
+	constexpr uint32_t SHAPES_COUNT = 20000;
+	constexpr uint32_t QUERIES_COUNT = 500;
+
+	// LayoutFlags follows the magic, the version, the size log, the leaf capacity and three 64-bit fields
+	constexpr size_t LAYOUT_FLAGS_OFFSET = 4 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+
+	parallel_octree::aabb random_aabb(std::minstd_rand0& rand, float fieldSize, float maxSize)
+	{
+		std::uniform_real_distribution<float> coordinate(0.0f, fieldSize - maxSize);
+		std::uniform_real_distribution<float> size(0.0f, maxSize);
+
+		const parallel_octree::point min{ coordinate(rand), coordinate(rand), coordinate(rand) };
+		return { min, { min.X + size(rand), min.Y + size(rand), min.Z + size(rand) } };
+	}
+
+	template <typename Function>
+	bool throws_logic_error(Function&& function)
+	{
+		try
+		{
+			function();
+		}
+		catch (const std::logic_error&)
+		{
+			return true;
+		}
+
+		return false;
+	}
+
+	template <typename Function>
+	bool throws_runtime_error(Function&& function)
+	{
+		try
+		{
+			function();
+		}
+		catch (const std::runtime_error&)
+		{
+			return true;
+		}
+
+		return false;
+	}
+
+	std::vector<char> read_file(const std::filesystem::path& path)
+	{
+		std::ifstream stream(path, std::ios::binary);
+		return std::vector<char>(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+	}
+
+	void write_file(const std::filesystem::path& path, const std::vector<char>& data)
+	{
+		std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+		stream.write(data.data(), std::streamsize(data.size()));
+	}
+
+	// Removed shapes leave tombstones in the saved arena, the mapped octree has to skip them as the source does
+	std::unique_ptr<parallel_octree> build_source(std::vector<parallel_octree::shape_data>& shapes)
+	{
+		auto octree = std::make_unique<parallel_octree>(SIZE_LOG, 64 * 1024 * 1024, 1);
+		std::minstd_rand0 rand(1);
+
+		for (uint32_t i = 0; i < SHAPES_COUNT; ++i)
+		{
+			shapes.push_back({ random_aabb(rand, octree->field_size(), 2.0f), i });
+			octree->add_exclusive(shapes.back());
+		}
+
+		for (uint32_t i = 0; i < SHAPES_COUNT; i += 3)
+		{
+			octree->remove_exclusive(shapes[i]);
+		}
+
+		return octree;
+	}
+
+	void check_same_results(const parallel_octree& source, const parallel_octree& mapped)
+	{
+		CHECK(mapped.size_log() == source.size_log());
+
+		std::minstd_rand0 rand(2);
+		std::pmr::vector<uint32_t> expected;
+		std::pmr::vector<uint32_t> result;
+
+		for (uint32_t i = 0; i < QUERIES_COUNT; ++i)
+		{
+			const parallel_octree::aabb aabb = random_aabb(rand, source.field_size(), 8.0f);
+
+			source.query(aabb, expected);
+			mapped.query(aabb, result);
+			CHECK(result == expected);
+			CHECK(mapped.count_in_aabb(aabb) == source.count_in_aabb(aabb));
+		}
+
+		const parallel_octree::statistics sourceStatistics = source.compute_statistics();
+		const parallel_octree::statistics mappedStatistics = mapped.compute_statistics();
+		// The GC of the source drops tombstones only
+		CHECK(mappedStatistics.EntriesCount - mappedStatistics.TombstonesCount == sourceStatistics.EntriesCount - sourceStatistics.TombstonesCount);
+		CHECK(mappedStatistics.ShapesCount == sourceStatistics.ShapesCount);
+	}
+
+	void check_read_only(parallel_octree& mapped, parallel_octree& source, const parallel_octree::shape_data& shape)
+	{
+		const parallel_octree::shape_move shapeMove{ shape.AABB, shape.AABB, shape.Index };
+		const parallel_octree::point_data pointData{ shape.AABB.Min, shape.Index };
+
+		CHECK(throws_logic_error([&] { mapped.add_exclusive(shape); }));
+		CHECK(throws_logic_error([&] { mapped.remove_exclusive(shape); }));
+		CHECK(throws_logic_error([&] { mapped.move_exclusive(shapeMove); }));
+		CHECK(throws_logic_error([&] { mapped.add_synchronized(shape, 0); }));
+		CHECK(throws_logic_error([&] { mapped.remove_synchronized(shape); }));
+		CHECK(throws_logic_error([&] { mapped.move_synchronized(shapeMove, 0); }));
+		CHECK(throws_logic_error([&] { mapped.add_batch_exclusive({ &shape, 1 }); }));
+		CHECK(throws_logic_error([&] { mapped.add_point_exclusive(pointData); }));
+		CHECK(throws_logic_error([&] { mapped.remove_point_synchronized(pointData); }));
+		CHECK(throws_logic_error([&] { mapped.defragment(); }));
+
+		std::pmr::vector<parallel_octree::gc_root> roots;
+		CHECK(throws_logic_error([&] { mapped.prepare_garbage_collection(roots); }));
+		CHECK(throws_logic_error([&] { mapped.resume_garbage_collection(); }));
+
+		// A root of the source is enough, the mapped octree rejects it before looking at it
+		source.prepare_garbage_collection(roots);
+		CHECK(!roots.empty());
+		CHECK(throws_logic_error([&] { mapped.collect_garbage(roots.front()); }));
+
+		for (const parallel_octree::gc_root& root : roots)
+		{
+			source.collect_garbage(root);
+		}
+	}
+
+	void round_trip(const std::filesystem::path& path)
+	{
+		std::vector<parallel_octree::shape_data> shapes;
+		std::unique_ptr<parallel_octree> source = build_source(shapes);
+
+		source->save(path);
+		std::unique_ptr<parallel_octree> mapped = parallel_octree::open_mapped(path);
+		check_same_results(*source, *mapped);
+
+		check_read_only(*mapped, *source, shapes[1]);
+		check_same_results(*source, *mapped);
+
+		// A clone is writable again
+		std::unique_ptr<parallel_octree> clone = mapped->clone();
+		clone->add_exclusive(shapes[0]);
+		source->add_exclusive(shapes[0]);
+		check_same_results(*source, *clone);
+	}
+
+	void rejects_damaged_files(const std::filesystem::path& path)
+	{
+		std::vector<parallel_octree::shape_data> shapes;
+		build_source(shapes)->save(path);
+
+		const std::vector<char> data = read_file(path);
+		CHECK(data.size() > LAYOUT_FLAGS_OFFSET + sizeof(uint32_t));
+
+		std::vector<char> damaged(data.begin(), data.end() - 1);
+		write_file(path, damaged);
+		CHECK(throws_runtime_error([&] { parallel_octree::open_mapped(path); }));
+
+		damaged.assign(data.begin(), data.begin() + 16);
+		write_file(path, damaged);
+		CHECK(throws_runtime_error([&] { parallel_octree::open_mapped(path); }));
+
+		damaged = data;
+		uint32_t layoutFlags;
+		std::memcpy(&layoutFlags, damaged.data() + LAYOUT_FLAGS_OFFSET, sizeof(layoutFlags));
+		layoutFlags ^= 1u;
+		std::memcpy(damaged.data() + LAYOUT_FLAGS_OFFSET, &layoutFlags, sizeof(layoutFlags));
+		write_file(path, damaged);
+		CHECK(throws_runtime_error([&] { parallel_octree::open_mapped(path); }));
+
+		// The untouched file still opens
+		write_file(path, data);
+		CHECK(parallel_octree::open_mapped(path)->size_log() == SIZE_LOG);
+	}
+}
+
+int main()
+{
+	const std::filesystem::path path = std::filesystem::temp_directory_path() / "parallel_octree_snapshot_tests.bin";
+	int exitCode = 0;
+
+	try
+	{
+		round_trip(path);
+		rejects_damaged_files(path);
+	}
+	catch (const std::exception& excp)
+	{
+		std::fprintf(stderr, "%s\n", excp.what());
+		exitCode = 1;
+	}
+
+	std::error_code error;
+	std::filesystem::remove(path, error);
+
+	return exitCode;
+}
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <vector>
+
+#include "parallel_octree.h"
+#include "standing_queries.h"
+#include "check.h"
+
+// Built with -DPARALLEL_OCTREE_DIRTY_LEAVES=ON only. After every update the candidates of each box must equal
+// a direct query, and exactly the boxes whose candidates changed must be reported.
+namespace
+{
+	constexpr uint32_t SIZE_LOG = 5;
+	constexpr uint32_t SHAPES_COUNT = 3000;
+	constexpr uint32_t BOXES_COUNT = 300;
+	constexpr uint32_t TICKS_COUNT = 60;
+	constexpr uint32_t MOVES_PER_TICK = 30;
+	// Shapes stay off the last leaves, so a box in the far corner finds nothing
+	constexpr float SHAPES_MARGIN = 2.0f;
+
+	struct shape_state final
+	{
+		parallel_octree::shape_data ShapeData;
+		bool IsAlive = false;
+	};
+
+	parallel_octree::aabb random_aabb(std::minstd_rand0& rand, float rangeSize, float maxSize)
+	{
+		std::uniform_real_distribution<float> coordinate(0.0f, rangeSize - maxSize);
+		std::uniform_real_distribution<float> size(0.0f, maxSize);
+
+		const parallel_octree::point min{ coordinate(rand), coordinate(rand), coordinate(rand) };
+		return { min, { min.X + size(rand), min.Y + size(rand), min.Z + size(rand) } };
+	}
+
+	class tester final
+	{
+	private:
+		parallel_octree _octree;
+		standing_queries _queries;
+		std::minstd_rand0 _rand;
+
+		std::vector<shape_state> _shapes;
+		// Boxes by id with the candidates of the previous update
+		std::map<uint32_t, parallel_octree::aabb> _boxes;
+		std::map<uint32_t, std::vector<uint32_t>> _previous;
+
+		std::pmr::vector<parallel_octree::cell> _dirtyCells;
+		std::pmr::vector<uint32_t> _changed;
+
+	public:
+		tester()
+			: _octree (SIZE_LOG, 64 * 1024 * 1024, 1)
+			, _queries (_octree, 16 * 1024 * 1024)
+			, _rand (1)
+			, _shapes (SHAPES_COUNT)
+		{
+			for (uint32_t index = 0; index < SHAPES_COUNT; ++index)
+			{
+				_shapes[index] = { { random_aabb(_rand, _octree.field_size() - SHAPES_MARGIN, 1.5f), index }, true };
+				_octree.add_exclusive(_shapes[index].ShapeData);
+			}
+
+			for (uint32_t i = 0; i < BOXES_COUNT; ++i)
+			{
+				add_box();
+			}
+
+			update();
+		}
+
+		void run()
+		{
+			for (uint32_t tick = 0; tick < TICKS_COUNT; ++tick)
+			{
+				// Some ticks change the boxes only
+				if (tick % 10 != 0)
+				{
+					change_shapes();
+				}
+
+				move_box(pick_box());
+				remove_box(pick_box());
+
+				// A removed id is taken again by the next add within the tick, its candidates must not leak
+				const uint32_t id = pick_box();
+				remove_box(id);
+				CHECK(add_box() == id);
+
+				update();
+			}
+
+			empty_box_is_not_reported();
+		}
+
+	private:
+		void change_shapes()
+		{
+			for (uint32_t i = 0; i < MOVES_PER_TICK; ++i)
+			{
+				shape_state& shape = _shapes[_rand() % SHAPES_COUNT];
+
+				if (!shape.IsAlive)
+				{
+					shape.ShapeData.AABB = random_aabb(_rand, _octree.field_size() - SHAPES_MARGIN, 1.5f);
+					_octree.add_exclusive(shape.ShapeData);
+					shape.IsAlive = true;
+				}
+				else if (_rand() % 4 == 0)
+				{
+					_octree.remove_exclusive(shape.ShapeData);
+					shape.IsAlive = false;
+				}
+				else
+				{
+					const parallel_octree::aabb aabbNew = random_aabb(_rand, _octree.field_size() - SHAPES_MARGIN, 1.5f);
+					_octree.move_exclusive({ shape.ShapeData.AABB, aabbNew, shape.ShapeData.Index });
+					shape.ShapeData.AABB = aabbNew;
+				}
+			}
+		}
+
+		uint32_t pick_box()
+		{
+			auto it = _boxes.begin();
+			std::advance(it, _rand() % _boxes.size());
+			return it->first;
+		}
+
+		uint32_t add_box()
+		{
+			const parallel_octree::aabb aabb = random_aabb(_rand, _octree.field_size(), 4.0f);
+			const uint32_t id = _queries.add(aabb);
+
+			CHECK(_boxes.find(id) == _boxes.end());
+			_boxes[id] = aabb;
+			_previous[id].clear();
+
+			return id;
+		}
+
+		void move_box(uint32_t id)
+		{
+			const parallel_octree::aabb aabb = random_aabb(_rand, _octree.field_size(), 4.0f);
+			_queries.move(id, aabb);
+			_boxes[id] = aabb;
+		}
+
+		void remove_box(uint32_t id)
+		{
+			_queries.remove(id);
+			_boxes.erase(id);
+			_previous.erase(id);
+		}
+
+		void update()
+		{
+			_dirtyCells.clear();
+			_octree.consume_dirty(_dirtyCells);
+
+			_changed.clear();
+			_queries.update(_dirtyCells, _changed);
+
+			std::sort(_changed.begin(), _changed.end());
+			CHECK(std::adjacent_find(_changed.begin(), _changed.end()) == _changed.end());
+
+			std::pmr::vector<uint32_t> result;
+
+			for (const auto& [id, aabb] : _boxes)
+			{
+				_octree.query(aabb, result);
+				const std::vector<uint32_t>& candidates = _queries.candidates(id);
+				CHECK(std::equal(result.begin(), result.end(), candidates.begin(), candidates.end()));
+
+				std::vector<uint32_t>& previous = _previous[id];
+				CHECK((previous != candidates) == std::binary_search(_changed.begin(), _changed.end(), id));
+				previous = candidates;
+			}
+
+			// Removed ids are never reported
+			for (const uint32_t id : _changed)
+			{
+				CHECK(_boxes.find(id) != _boxes.end());
+			}
+		}
+
+		void empty_box_is_not_reported()
+		{
+			const float fieldSize = _octree.field_size();
+			const uint32_t id = _queries.add({ { fieldSize - 0.2f, fieldSize - 0.2f, fieldSize - 0.2f }, { fieldSize, fieldSize, fieldSize } });
+
+			_dirtyCells.clear();
+			_changed.clear();
+			_queries.update(_dirtyCells, _changed);
+
+			CHECK(_queries.candidates(id).empty());
+			CHECK(std::find(_changed.begin(), _changed.end(), id) == _changed.end());
+		}
+	};
+}
+
+int main()
+{
+	try
+	{
+		tester().run();
+	}
+	catch (const std::exception& excp)
+	{
+		std::fprintf(stderr, "%s\n", excp.what());
+		return 1;
+	}
+
+	return 0;
+}
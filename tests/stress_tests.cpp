@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <barrier>
+#include <cstdio>
+#include <exception>
+#include <memory_resource>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "parallel_octree.h"
+#include "check.h"
+
+// Threads add, move and remove shapes of a few leaves at once, so they race on the same leaf counts,
+// entry slots and extensions. Built with -DPARALLEL_OCTREE_THREAD_SANITIZER=ON it runs under ThreadSanitizer.
+namespace
+{
+	constexpr uint32_t SIZE_LOG = 2;
+	constexpr uint32_t THREADS_COUNT = 4;
+	constexpr uint32_t SHAPES_PER_THREAD = 4000;
+	constexpr uint32_t ROUNDS_COUNT = 16;
+
+	struct shape_state final
+	{
+		parallel_octree::cell Cell;
+		bool IsAlive = false;
+	};
+
+	// Strictly inside the cell, so every shape has exactly one entry
+	parallel_octree::aabb cell_aabb(const parallel_octree::cell& currentCell)
+	{
+		const parallel_octree::point min{ float(currentCell.X) + 0.25f, float(currentCell.Y) + 0.25f, float(currentCell.Z) + 0.25f };
+		return { min, { min.X + 0.5f, min.Y + 0.5f, min.Z + 0.5f } };
+	}
+
+	parallel_octree::cell random_cell(std::minstd_rand0& rand)
+	{
+		std::uniform_int_distribution<uint32_t> coordinate(0, (1u << SIZE_LOG) - 1);
+		return { coordinate(rand), coordinate(rand), coordinate(rand) };
+	}
+
+	// Even shapes go through the worker of the thread, odd ones through the registered thread worker
+	void run_thread(parallel_octree& octree, uint32_t threadIndex, std::vector<shape_state>& states, std::barrier<>& barrier)
+	{
+		std::minstd_rand0 rand(threadIndex + 1);
+		const uint32_t first = threadIndex * SHAPES_PER_THREAD;
+
+		const auto add = [&](uint32_t index)
+		{
+			const parallel_octree::shape_data shapeData{ cell_aabb(states[index].Cell), index };
+			index % 2 == 0 ? octree.add_synchronized(shapeData, threadIndex) : octree.add_synchronized(shapeData);
+			states[index].IsAlive = true;
+		};
+
+		const auto remove = [&](uint32_t index)
+		{
+			const parallel_octree::shape_data shapeData{ cell_aabb(states[index].Cell), index };
+			index % 2 == 0 ? octree.remove_synchronized(shapeData, threadIndex) : octree.remove_synchronized(shapeData);
+			states[index].IsAlive = false;
+		};
+
+		const auto move = [&](uint32_t index, const parallel_octree::cell& cellNew)
+		{
+			const parallel_octree::shape_move shapeMove{ cell_aabb(states[index].Cell), cell_aabb(cellNew), index };
+			index % 2 == 0 ? octree.move_synchronized(shapeMove, threadIndex) : octree.move_synchronized(shapeMove);
+			states[index].Cell = cellNew;
+		};
+
+		barrier.arrive_and_wait();
+
+		for (uint32_t index = first; index < first + SHAPES_PER_THREAD; ++index)
+		{
+			states[index].Cell = random_cell(rand);
+			add(index);
+		}
+
+		for (uint32_t round = 0; round < ROUNDS_COUNT; ++round)
+		{
+			barrier.arrive_and_wait();
+
+			for (uint32_t index = first; index < first + SHAPES_PER_THREAD; ++index)
+			{
+				const parallel_octree::cell cellNew = random_cell(rand);
+
+				if (rand() % 8 == 0)
+				{
+					if (states[index].IsAlive)
+					{
+						remove(index);
+					}
+					else
+					{
+						states[index].Cell = cellNew;
+						add(index);
+					}
+				}
+				else if (states[index].IsAlive)
+				{
+					move(index, cellNew);
+				}
+			}
+		}
+	}
+
+	void check_contents(const parallel_octree& octree, const std::vector<shape_state>& states)
+	{
+		const uint32_t cellsCount = 1u << SIZE_LOG;
+		std::vector<std::vector<uint32_t>> expected(size_t(cellsCount) * cellsCount * cellsCount);
+		std::vector<uint32_t> alive;
+
+		for (uint32_t index = 0; index < states.size(); ++index)
+		{
+			if (states[index].IsAlive)
+			{
+				const parallel_octree::cell& currentCell = states[index].Cell;
+				expected[(size_t(currentCell.X) * cellsCount + currentCell.Y) * cellsCount + currentCell.Z].push_back(index);
+				alive.push_back(index);
+			}
+		}
+
+		const parallel_octree::statistics statistics = octree.compute_statistics();
+		// Removed entries stay as tombstones until the GC
+		CHECK(statistics.EntriesCount - statistics.TombstonesCount == alive.size());
+		CHECK(statistics.ShapesCount == alive.size());
+
+		std::pmr::vector<uint32_t> result;
+		octree.query({ { 0.0f, 0.0f, 0.0f }, { octree.field_size(), octree.field_size(), octree.field_size() } }, result);
+		CHECK(std::equal(result.begin(), result.end(), alive.begin(), alive.end()));
+
+		for (uint32_t x = 0; x < cellsCount; ++x)
+		{
+			for (uint32_t y = 0; y < cellsCount; ++y)
+			{
+				for (uint32_t z = 0; z < cellsCount; ++z)
+				{
+					const parallel_octree::aabb aabb = cell_aabb({ x, y, z });
+					const std::vector<uint32_t>& cellExpected = expected[(size_t(x) * cellsCount + y) * cellsCount + z];
+
+					octree.query(aabb, result);
+					CHECK(std::equal(result.begin(), result.end(), cellExpected.begin(), cellExpected.end()));
+					CHECK(octree.count_in_aabb(aabb) == cellExpected.size());
+				}
+			}
+		}
+	}
+
+	void concurrent_updates_of_shared_leaves()
+	{
+		parallel_octree octree(SIZE_LOG, 64 * 1024 * 1024, THREADS_COUNT);
+		std::vector<shape_state> states(THREADS_COUNT * SHAPES_PER_THREAD);
+		std::barrier<> barrier(THREADS_COUNT);
+
+		std::vector<std::thread> threads;
+		threads.reserve(THREADS_COUNT);
+
+		for (uint32_t i = 0; i < THREADS_COUNT; ++i)
+		{
+			threads.emplace_back(run_thread, std::ref(octree), i, std::ref(states), std::ref(barrier));
+		}
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		check_contents(octree, states);
+
+		std::pmr::vector<parallel_octree::gc_root> roots;
+		octree.prepare_garbage_collection(roots, 1);
+
+		for (const parallel_octree::gc_root& root : roots)
+		{
+			octree.collect_garbage(root);
+		}
+
+		CHECK(octree.compute_statistics().TombstonesCount == 0);
+		check_contents(octree, states);
+	}
+}
+
+int main()
+{
+	try
+	{
+		concurrent_updates_of_shared_leaves();
+	}
+	catch (const std::exception& excp)
+	{
+		std::fprintf(stderr, "%s\n", excp.what());
+		return 1;
+	}
+
+	return 0;
+}